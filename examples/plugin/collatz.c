@@ -0,0 +1,40 @@
+// A plugin adding a `collatz_longest` native, see lopsinvm_plugin.h.
+//
+//   make
+//   ../../bin/lopsinvm collatz.lopsinvm --native-lib ./collatz.so
+
+#include "lopsinvm.h"
+#include "lopsinvm_plugin.h"
+
+bool lopsin_plugin_init(uint32_t abi_version);
+
+// ( n -- start ), the start below n of the longest Collatz sequence
+static LopsinErr collatz_longest(LopsinVM *vm, LopsinValue *args)
+{
+    (void) vm;
+    int64_t n = args[0].as_i64;
+    if (n < 2) return ERR_INVALID_OPERAND;
+
+    int64_t best = 1, best_steps = 0;
+    for (int64_t start = 1; start < n; start++) {
+        uint64_t x = start;
+        int64_t steps = 0;
+        while (x != 1) {
+            x = x % 2 == 0 ? x / 2 : 3 * x + 1;
+            steps++;
+        }
+        if (steps > best_steps) {
+            best = start;
+            best_steps = steps;
+        }
+    }
+
+    args[0].as_i64 = best;
+    return ERR_OK;
+}
+
+bool lopsin_plugin_init(uint32_t abi_version)
+{
+    if (abi_version != LOPSIN_PLUGIN_ABI_VERSION) return false;
+    return lopsin_register_native("collatz_longest", &collatz_longest, 1, 1);
+}
@@ -5,12 +5,18 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 const char * const MODULES[] = {
     "lopsinvm",
     "lopasm",
+    "lopsinrun",
 };
 
+#define BENCHDIR "bench"
+#define BENCH_DEFAULT_RUNS 5
+#define BENCH_GENERATED_LINES 1000000
+
 bool starts_with(Cstr cstr, Cstr prefix)
 {
     size_t prefix_len = strlen(prefix);
@@ -49,9 +55,273 @@ void ensure_dirs(void)
     }
 }
 
+// Writes a synthetic lopasm program of roughly `lines` lines that is cheap to run.
+// Used to measure assembler throughput.
+void generate_lopasm(Cstr path, size_t lines)
+{
+    // lines per generated function, including its share of `main`
+    const size_t func_lines = 2 * 32 + 10;
+    size_t funcs = lines / func_lines;
+    if (funcs == 0) funcs = 1;
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        PANIC("Could not open file %s: %s", path, strerror(errno));
+    }
+
+    fprintf(f, "// Generated by nobuild. Do not edit.\n");
+    fprintf(f, "call main hlt\n\n");
+
+    for (size_t i = 0; i < funcs; i++) {
+        fprintf(f, "// ( x -- y )\n");
+        fprintf(f, "f%zu:\n", i);
+        for (size_t j = 0; j < 32; j++) {
+            fprintf(f, "\tpush %zu isum\n", (i * 31 + j * 7) % 1000 + 1);
+            fprintf(f, "\tpush %zu imul push 1000003 imod\n", j % 13 + 2);
+        }
+        fprintf(f, "\tdup 1 push 0 ilt\n");
+        fprintf(f, "\tcjmp f%zu.neg\n", i);
+        fprintf(f, "\tret\n");
+        fprintf(f, "f%zu.neg:\n", i);
+        fprintf(f, "\tpush -1 imul\n");
+        fprintf(f, "\tret\n\n");
+    }
+
+    fprintf(f, "main:\n");
+    fprintf(f, "\tpush 1\n");
+    for (size_t i = 0; i < funcs; i++) {
+        fprintf(f, "\tcall f%zu\n", i);
+    }
+    fprintf(f, "\tncall puti\n");
+    fprintf(f, "\tpush '\\n' ncall putc\n");
+    fprintf(f, "\tret\n");
+
+    fclose(f);
+}
+
+double cmd_time_ms(Cmd cmd)
+{
+    Fd fdin  = fd_open_for_read("/dev/null");
+    Fd fdout = fd_open_for_write("/dev/null");
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_wait(cmd_run_async(cmd, &fdin, &fdout));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fd_close(fdin);
+    fd_close(fdout);
+
+    return (end.tv_sec - start.tv_sec) * 1e3
+         + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples.
+double percentile(const double *sorted, size_t count, double p)
+{
+    size_t rank = (size_t) (p / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+void bench_cmd(Cstr name, Cstr stage, Cmd cmd, size_t runs)
+{
+    INFO("BENCH: %s (%s) x%zu: %s", name, stage, runs, cmd_show(cmd));
+
+    double *samples = malloc(runs * sizeof(double));
+    assert(samples != NULL);
+
+    for (size_t i = 0; i < runs; i++) {
+        samples[i] = cmd_time_ms(cmd);
+    }
+
+    qsort(samples, runs, sizeof(double), compare_doubles);
+
+    printf("%s,%s,%zu,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+           name, stage, runs,
+           samples[0],
+           percentile(samples, runs, 50),
+           percentile(samples, runs, 90),
+           percentile(samples, runs, 99),
+           samples[runs - 1]);
+    fflush(stdout);
+
+    free(samples);
+}
+
+// The arguments a bench or test program asks lopsinvm for, on a first line of `// ARGS: ...`.
+Cstr_Array lopasm_file_args(Cstr path)
+{
+    Cstr_Array args = cstr_array_make(NULL);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        PANIC("Could not open file %s: %s", path, strerror(errno));
+    }
+
+    char line[256];
+    const char prefix[] = "// ARGS:";
+    if (fgets(line, sizeof(line), file) != NULL && starts_with(line, prefix)) {
+        for (char *arg = strtok(line + sizeof(prefix) - 1, " \t\n"); arg != NULL; arg = strtok(NULL, " \t\n")) {
+            args = cstr_array_append(args, strdup(arg));
+        }
+    }
+
+    fclose(file);
+    return args;
+}
+
+// Assembles and runs every bench/*.lopasm `runs` times, printing one CSV row per stage to stdout.
+void run_benchmarks(size_t runs)
+{
+    Cstr lopasm   = PATH(BINDIR, "lopasm");
+    Cstr lopsinvm = PATH(BINDIR, "lopsinvm");
+
+    generate_lopasm(PATH(BENCHDIR, "gen_1m.lopasm"), BENCH_GENERATED_LINES);
+
+    printf("benchmark,stage,runs,min_ms,median_ms,p90_ms,p99_ms,max_ms\n");
+
+    FOREACH_FILE_IN_DIR(file, BENCHDIR, {
+        if (ENDS_WITH(file, ".lopasm")) {
+            Cstr name     = NOEXT(file);
+            Cstr source   = PATH(BENCHDIR, file);
+            Cstr bytecode = PATH(BENCHDIR, CONCAT(name, ".lopsinvm"));
+
+            Cmd asm_cmd = { .line = cstr_array_make(lopasm, source, "-o", bytecode, NULL) };
+            // the cache would turn every run after the first into a hit, and write to ~/.cache
+            Cmd run_cmd = { .line = cstr_array_make(lopsinvm, "--no-cache", NULL) };
+            FOREACH_ARRAY(Cstr, arg, lopasm_file_args(source), {
+                run_cmd.line = cstr_array_append(run_cmd.line, *arg);
+            });
+            run_cmd.line = cstr_array_append(run_cmd.line, bytecode);
+
+            bench_cmd(name, "asm", asm_cmd, runs);
+            bench_cmd(name, "run", run_cmd, runs);
+        }
+    });
+}
+
+bool files_equal(Cstr path1, Cstr path2)
+{
+    FILE *file1 = fopen(path1, "rb");
+    if (file1 == NULL) {
+        PANIC("Could not open file %s: %s", path1, strerror(errno));
+    }
+    FILE *file2 = fopen(path2, "rb");
+    if (file2 == NULL) {
+        PANIC("Could not open file %s: %s", path2, strerror(errno));
+    }
+
+    int c1, c2;
+    do {
+        c1 = fgetc(file1);
+        c2 = fgetc(file2);
+    } while (c1 == c2 && c1 != EOF);
+
+    fclose(file1);
+    fclose(file2);
+    return c1 == c2;
+}
+
+// Builds every test/*.c against the VM sources under ThreadSanitizer and runs it. A test fails
+// by exiting with a non-zero status, which is also what ThreadSanitizer does once it reported a race.
+// Every test/*.lopasm is assembled and run on lopsinvm built the same way, with the arguments of its
+// `// ARGS:` line, and fails unless it prints exactly test/<name>.expected.
+void run_tests(void)
+{
+    build_module(MODE_BUILD, "lopasm");
+
+    Cstr vmdir = PATH(SRCDIR, "lopsinvm");
+    Cstr testbin = PATH(BINDIR, TESTDIR);
+    MKDIRS(testbin);
+
+    Cstr_Array vm_srcfiles = cstr_array_make(PATH(SRCDIR, "common", "handles.c"),
+                                              PATH(SRCDIR, "common", "util.c"), NULL);
+    FOREACH_FILE_IN_DIR(srcfile, vmdir, {
+        if (ENDS_WITH(srcfile, ".c") && strcmp(srcfile, "main.c") != 0 && strcmp(srcfile, "nobuild.c") != 0) {
+            vm_srcfiles = cstr_array_append(vm_srcfiles, PATH(vmdir, srcfile));
+        }
+    });
+
+    size_t count = 0;
+    FOREACH_FILE_IN_DIR(file, TESTDIR, {
+        if (ENDS_WITH(file, ".c")) {
+            Cstr name = NOEXT(file);
+            Cstr outfile = PATH(testbin, name);
+
+            Cmd cmd = { .line = cstr_array_make(CC, "-o", outfile, PATH(TESTDIR, file), NULL) };
+            FOREACH_ARRAY(Cstr, srcfile, vm_srcfiles, {
+                cmd.line = cstr_array_append(cmd.line, *srcfile);
+            });
+            Cstr_Array cflags = cstr_array_make(TEST_CFLAGS, C_INCLUDES, JOIN("", "-I", vmdir), NULL);
+            FOREACH_ARRAY(Cstr, cflag, cflags, {
+                cmd.line = cstr_array_append(cmd.line, *cflag);
+            });
+            INFO("CMD: %s", cmd_show(cmd));
+            cmd_run_sync(cmd);
+
+            CMD(outfile);
+            count++;
+        }
+    });
+
+    Cstr lopasm   = PATH(BINDIR, "lopasm");
+    Cstr lopsinvm = PATH(testbin, "lopsinvm");
+    {
+        Cmd cmd = { .line = cstr_array_make(CC, "-o", lopsinvm, PATH(vmdir, "main.c"), NULL) };
+        FOREACH_ARRAY(Cstr, srcfile, vm_srcfiles, {
+            cmd.line = cstr_array_append(cmd.line, *srcfile);
+        });
+        Cstr_Array cflags = cstr_array_make(TEST_CFLAGS, C_INCLUDES, NULL);
+        FOREACH_ARRAY(Cstr, cflag, cflags, {
+            cmd.line = cstr_array_append(cmd.line, *cflag);
+        });
+        INFO("CMD: %s", cmd_show(cmd));
+        cmd_run_sync(cmd);
+    }
+
+    FOREACH_FILE_IN_DIR(file, TESTDIR, {
+        if (ENDS_WITH(file, ".lopasm")) {
+            Cstr name     = NOEXT(file);
+            Cstr source   = PATH(TESTDIR, file);
+            Cstr bytecode = PATH(testbin, CONCAT(name, ".lopsinvm"));
+            Cstr output   = PATH(testbin, CONCAT(name, ".out"));
+            Cstr expected = PATH(TESTDIR, CONCAT(name, ".expected"));
+
+            CMD(lopasm, source, "-o", bytecode);
+
+            Cmd cmd = { .line = cstr_array_make(lopsinvm, "--no-cache", NULL) };
+            FOREACH_ARRAY(Cstr, arg, lopasm_file_args(source), {
+                cmd.line = cstr_array_append(cmd.line, *arg);
+            });
+            cmd.line = cstr_array_append(cmd.line, bytecode);
+            INFO("CMD: %s > %s", cmd_show(cmd), output);
+
+            Fd fdout = fd_open_for_write(output);
+            pid_wait(cmd_run_async(cmd, NULL, &fdout));
+            fd_close(fdout);
+
+            if (!files_equal(output, expected)) {
+                PANIC("%s: output %s differs from %s", name, output, expected);
+            }
+            count++;
+        }
+    });
+
+    INFO("All %zu tests passed", count);
+}
+
 void usage(FILE *stream, const char *program)
 {
-    fprintf(stream, "USAGE: %s <build|debug|clean>\n", program);
+    fprintf(stream, "USAGE: %s <build|debug|clean|test|bench [runs]|gen <output.lopasm> [lines]>\n", program);
 }
 
 int main(int argc, const char **argv)
@@ -106,6 +376,42 @@ int main(int argc, const char **argv)
             });
         }
 
+        return 0;
+    } else if (strcmp(mode_text, "test") == 0) {
+        run_tests();
+        return 0;
+    } else if (strcmp(mode_text, "bench") == 0) {
+        size_t runs = BENCH_DEFAULT_RUNS;
+        if (*argv != NULL) {
+            runs = strtoul(*argv, NULL, 10);
+            if (runs == 0) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: Invalid run count `%s`\n", *argv);
+                exit(1);
+            }
+        }
+
+        for (size_t i = 0; i < ARRAY_LEN(MODULES); i++) {
+            build_module(MODE_BUILD, MODULES[i]);
+        }
+
+        run_benchmarks(runs);
+        return 0;
+    } else if (strcmp(mode_text, "gen") == 0) {
+        Cstr output = *argv++;
+        if (output == NULL) {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: No output file provided\n");
+            exit(1);
+        }
+
+        size_t lines = BENCH_GENERATED_LINES;
+        if (*argv != NULL) {
+            lines = strtoul(*argv, NULL, 10);
+        }
+
+        INFO("Generating %zu lines of lopasm into %s", lines, output);
+        generate_lopasm(output, lines);
         return 0;
     } else {
         usage(stderr, program);
@@ -16,13 +16,24 @@ extern "C"
 #define DEBUG_CXXFLAGS CXXFLAGS, "-ggdb", "-D_DEBUG"
 #define BUILD_CXXFLAGS CXXFLAGS, "-O3"
 
-#define CFLAGS "-std=c11", "-Wall", "-Wextra", "-Werror", "-Wpedantic", "-Wno-missing-braces", "-Wmissing-prototypes", "-static", "-lm"
+#define SHARED_CFLAGS "-std=c11", "-Wall", "-Wextra", "-Werror", "-Wpedantic", "-Wno-missing-braces", "-Wmissing-prototypes", "-pthread", "-lm"
+#define CFLAGS SHARED_CFLAGS, "-static"
 #define DEBUG_CFLAGS CFLAGS, "-ggdb", "-D_DEBUG"
 #define BUILD_CFLAGS CFLAGS, "-O3"
 
+// For programs that dlopen() plugins. A static program would give each plugin a libc of its own,
+// and the plugins couldn't call the program's functions.
+#define DYNAMIC_CFLAGS SHARED_CFLAGS, "-rdynamic", "-ldl"
+#define DYNAMIC_DEBUG_CFLAGS DYNAMIC_CFLAGS, "-ggdb", "-D_DEBUG"
+#define DYNAMIC_BUILD_CFLAGS DYNAMIC_CFLAGS, "-O3"
+
+// Tests link the VM in, and run it under ThreadSanitizer, see `./nobuild test`.
+#define TEST_CFLAGS DYNAMIC_CFLAGS, "-g", "-O1", "-fsanitize=thread"
+
 #define NOBUILD_CFLAGS "-std=c11", "-O3"
 #define SRCDIR "src"
 #define BINDIR "bin"
+#define TESTDIR "test"
 
 #define C_INCLUDES JOIN("", "-I", PATH(SRCDIR, "common"))
 
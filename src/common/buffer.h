@@ -62,7 +62,11 @@ BUFFERDEF void buffer_ensure(Buffer *buf, size_t req)
 {
     if (buf->cap >= req) return;
 
-    buf->data = NOTNULL(realloc(buf->data, req));
+    size_t cap = buf->cap > 0 ? buf->cap : DEFAULT_BUFFER_CAP;
+    while (cap < req) cap *= 2;
+
+    buf->data = NOTNULL(realloc(buf->data, cap));
+    buf->cap = cap;
 }
 
 BUFFERDEF Buffer *new_buffer(size_t cap)
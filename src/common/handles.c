@@ -0,0 +1,37 @@
+#include "handles.h"
+
+#include <stdlib.h>
+
+#include "util.h"
+
+int64_t handle_table_add(Handle_Table *table, void *item)
+{
+    // reuse a removed handle before growing the table
+    if (table->count >= table->cap) {
+        for (size_t i = 0; i < table->count; i++) {
+            if (table->items[i] == NULL) {
+                table->items[i] = item;
+                return i;
+            }
+        }
+
+        table->cap = table->cap == 0 ? HANDLE_TABLE_INITIAL_CAP : table->cap * 2;
+        table->items = NOTNULL(realloc(table->items, table->cap * sizeof(void *)));
+    }
+
+    table->items[table->count] = item;
+    return table->count++;
+}
+
+void *handle_table_remove(Handle_Table *table, int64_t handle)
+{
+    void *item = handle_table_get(table, handle);
+    if (item != NULL) table->items[handle] = NULL;
+    return item;
+}
+
+void handle_table_free(Handle_Table *table)
+{
+    free(table->items);
+    *table = (Handle_Table) {0};
+}
@@ -0,0 +1,45 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef HANDLES_H_
+#define HANDLES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+#define HANDLE_TABLE_INITIAL_CAP 8
+
+/// Objects a program refers to by index, like the channels, maps and vectors of a VM. A removed
+/// handle holds NULL, and is given out again before the table grows.
+typedef struct {
+    void **items;
+    size_t count;
+    size_t cap;
+} Handle_Table;
+
+/// Returns the handle of item, which must not be NULL.
+int64_t handle_table_add(Handle_Table *table, void *item);
+/// Gives the handle back, returning what it held, NULL if it held nothing.
+void *handle_table_remove(Handle_Table *table, int64_t handle);
+/// Frees the table, not its items.
+void handle_table_free(Handle_Table *table);
+
+/// NULL if the handle was never given out, or was removed. Inline, as every native taking a
+/// handle goes through it.
+static inline void *handle_table_get(const Handle_Table *table, int64_t handle)
+{
+    if (handle < 0 || (uint64_t) handle >= table->count) return NULL;
+    return table->items[handle];
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* HANDLES_H_ */
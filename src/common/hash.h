@@ -0,0 +1,32 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/// FNV-1a, for the hash tables keyed by short strings: labels, constants, map keys.
+static inline uint64_t fnv1a_hash(const void *bytes, size_t len)
+{
+    const unsigned char *p = bytes;
+    uint64_t x = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        x ^= p[i];
+        x *= 0x100000001b3;
+    }
+    return x;
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* HASH_H_ */
@@ -10,6 +10,17 @@ typedef LopAsm_Token Token;
 typedef LopAsm_InstToken InstToken;
 typedef LopAsm_Lexer Lexer;
 
+static_assert(COUNT_LOPASM_DIRECTIVES == 7, "Exhaustive definition of LOPASM_DIRECTIVE_NAMES with respect to LopAsm_DirectiveType's");
+const char * const LOPASM_DIRECTIVE_NAMES[COUNT_LOPASM_DIRECTIVES] = {
+    [LOPASM_DIRECTIVE_LOCAL]    = ".local",
+    [LOPASM_DIRECTIVE_JMPTAB]   = ".jmptab",
+    [LOPASM_DIRECTIVE_STRING]   = ".string",
+    [LOPASM_DIRECTIVE_BYTES]    = ".bytes",
+    [LOPASM_DIRECTIVE_I64]      = ".i64",
+    [LOPASM_DIRECTIVE_F64]      = ".f64",
+    [LOPASM_DIRECTIVE_END]      = ".end",
+};
+
 static inline bool notisspace(char c)
 {
     return !isspace(c);
@@ -26,6 +37,27 @@ static inline String_View sv_chop_by_whitespace(String_View *sv)
     return sv_chop_left_while(sv, notisspace);
 }
 
+// Chops a literal quoted with sv->data[0], which may contain whitespace and escaped quotes.
+static String_View chop_quoted(String_View *sv)
+{
+    char quote = sv->data[0];
+
+    size_t i = 1;
+    while (i < sv->count && sv->data[i] != quote && sv->data[i] != '\n') {
+        if (sv->data[i] == '\\') i++;
+        i++;
+    }
+
+    if (i >= sv->count || sv->data[i] != quote) {
+        String_View literal = sv_chop_by_whitespace(sv);
+        fprintf(stderr, "ERROR: Unterminated literal `"SV_Fmt"`\n",
+                SV_Arg(literal));
+        exit(1);
+    }
+
+    return sv_chop_left(sv, i + 1);
+}
+
 static bool sv_try_chop_i64(String_View *sv, int radix, int64_t *out)
 {
     char *contents = NOTNULL(malloc((sv->count + 1) * sizeof(char)));
@@ -50,6 +82,65 @@ static bool sv_try_chop_i64(String_View *sv, int radix, int64_t *out)
     return true;
 }
 
+static int digit_value(char c)
+{
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('a' <= c && c <= 'f') return c - 'a' + 10;
+    if ('A' <= c && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Chops at most `max_digits` digits in `radix` off the front of `text`.
+static char chop_escape_number(String_View *text, int radix, size_t max_digits)
+{
+    int64_t result = 0;
+    size_t digits = 0;
+
+    while (digits < max_digits && text->count > 0) {
+        int d = digit_value(text->data[0]);
+        if (d < 0 || d >= radix) break;
+
+        result = result * radix + d;
+        sv_chop_left(text, 1);
+        digits++;
+    }
+
+    if (digits == 0) {
+        fprintf(stderr, "ERROR: invalid escape sequence `"SV_Fmt"`\n",
+                SV_Arg(*text));
+        exit(1);
+    }
+
+    return (char) result;
+}
+
+// Chops one, possibly escaped, character off the front of `text`.
+static char chop_char_lit(String_View *text)
+{
+    assert(text->count > 0);
+    char c = sv_chop_left(text, 1).data[0];
+
+    if (c != '\\' || text->count == 0) return c;
+
+    c = text->data[0];
+    switch (c) {
+        case '\\': sv_chop_left(text, 1); return '\\';
+        case '\'': sv_chop_left(text, 1); return '\'';
+        case '"':  sv_chop_left(text, 1); return '"';
+        case 'n':  sv_chop_left(text, 1); return '\n';
+        case 't':  sv_chop_left(text, 1); return '\t';
+        case 'r':  sv_chop_left(text, 1); return '\r';
+        case 'u': {
+            sv_chop_left(text, 1);
+            return chop_escape_number(text, 16, 2);
+        }
+
+        default: {
+            return chop_escape_number(text, 8, 3);
+        }
+    }
+}
+
 static char parse_char_lit(String_View chartext)
 {
     if (!sv_eq(sv_chop_left(&chartext, 1),
@@ -58,53 +149,21 @@ static char parse_char_lit(String_View chartext)
         return '\0';
     }
 
-    bool escape = false;
-    while (chartext.count > 0) {
-        char c = sv_chop_left(&chartext, 1).data[0];
-
-        if (escape) {
-            escape = false;
-            switch (c) {
-                case '\\': return '\\';
-                case 'n':  return '\n';
-                case 't':  return '\t';
-                case 'u': {
-                    assert(chartext.count > 0);
-                    int64_t result;
-                    if (sv_try_chop_i64(&chartext, 16, &result)) {
-                        return (char) result;
-                    } else {
-                        fprintf(stderr, "ERROR: invalid escape sequence `"SV_Fmt"`\n",
-                                SV_Arg(chartext));
-                        exit(1);
-                    }
-                }
-
-                default: {
-                    chartext.data--;
-                    chartext.count++;
-                    assert(chartext.count > 0);
-                    int64_t result;
-                    if (sv_try_chop_i64(&chartext, 8, &result)) {
-                        return (char) result;
-                    } else {
-                        fprintf(stderr, "ERROR: invalid escape sequence `"SV_Fmt"`\n",
-                                SV_Arg(chartext));
-                        exit(1);
-                    }
-                }
-            }
-        }
-        switch (c) {
-            case '\\': escape = true; continue;
+    if (chartext.count == 0) return '\0';
 
-            default: {
-                return c;
-            }
-        }
+    return chop_char_lit(&chartext);
+}
+
+size_t lopasm_unescape_str(String_View lit, char *out)
+{
+    size_t len = 0;
+    while (lit.count > 0) {
+        char c = chop_char_lit(&lit);
+        if (out) out[len] = c;
+        len++;
     }
 
-    return '\0';
+    return len;
 }
 
 static bool lex_tok_as_inst(Token *tok)
@@ -122,7 +181,23 @@ static bool lex_tok_as_inst(Token *tok)
     return false;
 }
 
-// TODOOOO(#2): lopasm has no support for floating point literals
+static bool lex_tok_as_directive(Token *tok)
+{
+    if (tok->text.data[0] != '.') return false;
+
+    for (LopAsm_DirectiveType i = 0; i < COUNT_LOPASM_DIRECTIVES; i++) {
+        if (sv_eq(tok->text, sv_from_cstr(LOPASM_DIRECTIVE_NAMES[i]))) {
+            tok->type = LOPASM_TOKEN_TYPE_DIRECTIVE;
+            tok->as.directive = (LopAsm_DirectiveToken) {
+                .type = i,
+            };
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static bool lex_tok_as_i64(Token *tok)
 {
     String_View tok_text = tok->text;
@@ -138,6 +213,29 @@ static bool lex_tok_as_i64(Token *tok)
     return true;
 }
 
+// `1.5`, `1e-9`, `0x1.8p3`, `inf`, `nan`, ... anything strtod() takes, as long as it isn't an integer
+static bool lex_tok_as_f64(Token *tok)
+{
+    char *contents = NOTNULL(malloc((tok->text.count + 1) * sizeof(char)));
+
+    memcpy(contents, tok->text.data, tok->text.count);
+    contents[tok->text.count] = '\0';
+
+    char *endptr = NULL;
+    double result = strtod(contents, &endptr);
+
+    size_t len = endptr - contents;
+    free(contents);
+
+    if (len == 0 || len != tok->text.count) {
+        return false;
+    }
+
+    tok->as.lit_float.value = result;
+    tok->type = LOPASM_TOKEN_TYPE_LIT_FLOAT;
+    return true;
+}
+
 static bool lex_tok_as_char(Token *tok)
 {
     String_View toktext = tok->text;
@@ -150,6 +248,17 @@ static bool lex_tok_as_char(Token *tok)
     return true;
 }
 
+static bool lex_tok_as_str(Token *tok)
+{
+    if (tok->text.data[0] != '"') return false;
+
+    // the quotes were checked by chop_quoted()
+    tok->as.lit_str.value = sv_from_parts(tok->text.data + 1, tok->text.count - 2);
+    tok->type = LOPASM_TOKEN_TYPE_LIT_STR;
+
+    return true;
+}
+
 static bool lex_tok_as_label_def(Token *tok)
 {
     String_View tok_text = sv_trim(tok->text);
@@ -196,16 +305,22 @@ bool lopasm_lexer_spit_token(Lexer *lexer, Token *out)
 
     Token result;
 
-    // TODO(#8): LopAsm_Lexer can't handle the `' '` char literal
-    result.text = sv_chop_by_whitespace(&lexer->source);
+    if (lexer->source.data[0] == '"' || lexer->source.data[0] == '\'') {
+        result.text = chop_quoted(&lexer->source);
+    } else {
+        result.text = sv_chop_by_whitespace(&lexer->source);
+    }
 
     if (result.text.count == 0) {
         return lopasm_lexer_spit_token(lexer, out);
     }
 
     if (lex_tok_as_inst(&result)) {
+    } else if (lex_tok_as_directive(&result)) {
     } else if (lex_tok_as_i64(&result)) {
+    } else if (lex_tok_as_f64(&result)) {
     } else if (lex_tok_as_char(&result)) {
+    } else if (lex_tok_as_str(&result)) {
     } else if (lex_tok_as_label_def(&result)) {
     } else if (lex_tok_as_identifier(&result)) {
     } else {
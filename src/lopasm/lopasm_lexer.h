@@ -25,12 +25,29 @@ typedef struct {
 typedef enum {
     LOPASM_TOKEN_TYPE_INST = 0,
     LOPASM_TOKEN_TYPE_LIT_INT,
+    LOPASM_TOKEN_TYPE_LIT_FLOAT,
+    LOPASM_TOKEN_TYPE_LIT_STR,
     LOPASM_TOKEN_TYPE_IDENTIFIER,
     LOPASM_TOKEN_TYPE_LABEL_DEF,
+    LOPASM_TOKEN_TYPE_DIRECTIVE,
 
     COUNT_LOPASM_TOKEN_TYPES
 } LopAsm_TokenType;
 
+typedef enum {
+    LOPASM_DIRECTIVE_LOCAL = 0,
+    LOPASM_DIRECTIVE_JMPTAB,
+    LOPASM_DIRECTIVE_STRING,
+    LOPASM_DIRECTIVE_BYTES,
+    LOPASM_DIRECTIVE_I64,
+    LOPASM_DIRECTIVE_F64,
+    LOPASM_DIRECTIVE_END,
+
+    COUNT_LOPASM_DIRECTIVES
+} LopAsm_DirectiveType;
+
+extern const char * const LOPASM_DIRECTIVE_NAMES[COUNT_LOPASM_DIRECTIVES];
+
 typedef struct {
     LopsinInstType type;
 } LopAsm_InstToken;
@@ -39,6 +56,15 @@ typedef struct {
     int64_t value;
 } LopAsm_LitIntToken;
 
+typedef struct {
+    double value;
+} LopAsm_LitFloatToken;
+
+typedef struct {
+    // between the quotes, escapes still in place (see lopasm_unescape_str())
+    String_View value;
+} LopAsm_LitStrToken;
+
 typedef struct {
     String_View name;
 } LopAsm_IdentifierToken;
@@ -47,11 +73,18 @@ typedef struct {
     String_View name;
 } LopAsm_LabelDefToken;
 
+typedef struct {
+    LopAsm_DirectiveType type;
+} LopAsm_DirectiveToken;
+
 typedef union {
     LopAsm_InstToken inst;
     LopAsm_LitIntToken lit_int;
+    LopAsm_LitFloatToken lit_float;
+    LopAsm_LitStrToken lit_str;
     LopAsm_IdentifierToken identifier;
     LopAsm_LabelDefToken label_def;
+    LopAsm_DirectiveToken directive;
 } LopAsm_TokenAs;
 
 
@@ -68,6 +101,8 @@ typedef struct {
 
 bool lopasm_lexer_spit_token(LopAsm_Lexer *, LopAsm_Token *out);
 void lopasm_print_token(FILE *stream, LopAsm_Token token);
+// Writes the bytes a string literal stands for to `out` (if not NULL), and returns how many there are.
+size_t lopasm_unescape_str(String_View lit, char *out);
 
 
 #ifdef __cplusplus
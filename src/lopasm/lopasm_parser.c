@@ -2,26 +2,96 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sv.h>
 
+#include "hash.h"
 #include "util.h"
 
 typedef LopAsm_Parser Parser;
 typedef LopAsm_Token Token;
 typedef LopAsm_Label Label;
 
-#define PARSER_TOKENS_CAP_INC 64
 static void append_token(Parser *parser, Token token)
 {
     if (parser->tokens_sz >= parser->tokens_cap) {
-        parser->tokens = realloc(parser->tokens, parser->tokens_cap + PARSER_TOKENS_CAP_INC);
-        parser->tokens_cap += PARSER_TOKENS_CAP_INC;
+        parser->tokens_cap *= 2;
+        parser->tokens = NOTNULL(realloc(parser->tokens, parser->tokens_cap * sizeof(Token)));
     }
 
     parser->tokens[parser->tokens_sz++] = token;
 }
 
+#define LOPASM_PARSER_INITIAL_LABELS_CAP 1024
+
+static uint64_t label_hash(String_View name)
+{
+    return fnv1a_hash(name.data, name.count);
+}
+
+// Returns the slot in `label_index` where `name` is or would be stored.
+static size_t label_index_slot(const Parser *parser, String_View name)
+{
+    size_t mask = parser->label_index_cap - 1;
+    size_t slot = label_hash(name) & mask;
+
+    while (parser->label_index[slot] != 0
+        && !sv_eq(parser->labels[parser->label_index[slot] - 1].name, name))
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static void label_index_grow(Parser *parser)
+{
+    size_t *old_index = parser->label_index;
+    size_t old_cap = parser->label_index_cap;
+
+    parser->label_index_cap *= 2;
+    parser->label_index = NOTNULL(calloc(parser->label_index_cap, sizeof(size_t)));
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old_index[i] != 0) {
+            Label label = parser->labels[old_index[i] - 1];
+            parser->label_index[label_index_slot(parser, label.name)] = old_index[i];
+        }
+    }
+
+    free(old_index);
+}
+
+static const Label *find_label(const Parser *parser, String_View name)
+{
+    size_t idx = parser->label_index[label_index_slot(parser, name)];
+    return idx == 0 ? NULL : &parser->labels[idx - 1];
+}
+
+static void add_label(Parser *parser, Label label)
+{
+    // keep the index at most half full
+    if (2 * (parser->labels_sz + 1) > parser->label_index_cap) {
+        label_index_grow(parser);
+    }
+
+    size_t slot = label_index_slot(parser, label.name);
+    if (parser->label_index[slot] != 0) {
+        fprintf(stderr, "ERROR: Redefinition of label `"SV_Fmt"`\n", SV_Arg(label.name));
+        exit(1);
+    }
+
+    if (parser->labels_sz >= parser->labels_cap) {
+        parser->labels_cap *= 2;
+        parser->labels = NOTNULL(realloc(parser->labels, parser->labels_cap * sizeof(Label)));
+    }
+
+    parser->labels[parser->labels_sz] = label;
+    parser->label_index[slot] = ++parser->labels_sz;
+}
+
 static bool parse_label_def(Parser *parser, Token token, Label *out)
 {
     assert(token.type == LOPASM_TOKEN_TYPE_LABEL_DEF);
@@ -36,6 +106,516 @@ static bool parse_label_def(Parser *parser, Token token, Label *out)
     return true;
 }
 
+static bool token_is_directive(const Parser *parser, size_t i, LopAsm_DirectiveType type)
+{
+    return i < parser->tokens_sz
+        && parser->tokens[i].type == LOPASM_TOKEN_TYPE_DIRECTIVE
+        && parser->tokens[i].as.directive.type == type;
+}
+
+// Number of tokens from `start` up to the next `.end`.
+static size_t count_until_end(const Parser *parser, size_t start, const char *directive)
+{
+    size_t i = start;
+    while (i < parser->tokens_sz && !token_is_directive(parser, i, LOPASM_DIRECTIVE_END)) {
+        i++;
+    }
+
+    if (i >= parser->tokens_sz) {
+        fprintf(stderr, "ERROR: `%s` is missing its `.end`\n", directive);
+        exit(1);
+    }
+
+    return i - start;
+}
+
+static Token expect_data_name(const Parser *parser, size_t i, const char *directive)
+{
+    if (i >= parser->tokens_sz || parser->tokens[i].type != LOPASM_TOKEN_TYPE_IDENTIFIER) {
+        fprintf(stderr, "ERROR: Expected a name after `%s`\n", directive);
+        exit(1);
+    }
+
+    return parser->tokens[i];
+}
+
+// Reserves `bytes` of zeroes in the data section at an offset aligned to `align`, and returns the offset.
+static size_t reserve_data(Parser *parser, size_t bytes, size_t align)
+{
+    size_t offset = (parser->data_sz + align - 1) / align * align;
+
+    if (offset + bytes > parser->data_cap) {
+        while (offset + bytes > parser->data_cap) parser->data_cap *= 2;
+        parser->data = NOTNULL(realloc(parser->data, parser->data_cap));
+    }
+
+    memset(&parser->data[parser->data_sz], 0, offset + bytes - parser->data_sz);
+    parser->data_sz = offset + bytes;
+    return offset;
+}
+
+// Constants with the same bytes but a different alignment may all be in the index, so
+// unlike labels, a constant always goes in the first empty slot.
+static void consts_index_insert(Parser *parser, size_t idx)
+{
+    size_t mask = parser->consts_index_cap - 1;
+    size_t slot = parser->consts[idx].hash & mask;
+
+    while (parser->consts_index[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    parser->consts_index[slot] = idx + 1;
+}
+
+static void consts_index_grow(Parser *parser)
+{
+    free(parser->consts_index);
+
+    parser->consts_index_cap *= 2;
+    parser->consts_index = NOTNULL(calloc(parser->consts_index_cap, sizeof(size_t)));
+
+    for (size_t i = 0; i < parser->consts_sz; i++) {
+        consts_index_insert(parser, i);
+    }
+}
+
+// Looks for an earlier constant with exactly the same bytes as data[offset .. offset + size),
+// suitably aligned. If there is one, the new bytes are given back and the earlier offset returned.
+static size_t intern_data(Parser *parser, size_t offset, size_t size, size_t align)
+{
+    uint64_t hash = label_hash(sv_from_parts(&parser->data[offset], size));
+
+    size_t mask = parser->consts_index_cap - 1;
+    for (size_t slot = hash & mask; parser->consts_index[slot] != 0; slot = (slot + 1) & mask) {
+        LopAsm_DataConst c = parser->consts[parser->consts_index[slot] - 1];
+        if (c.hash == hash && c.size == size && c.offset % align == 0
+            && memcmp(&parser->data[c.offset], &parser->data[offset], size) == 0)
+        {
+            // only the newest reservation can be given back
+            assert(offset + size == parser->data_sz);
+            parser->data_sz = offset;
+            return c.offset;
+        }
+    }
+
+    // keep the index at most half full
+    if (2 * (parser->consts_sz + 1) > parser->consts_index_cap) {
+        consts_index_grow(parser);
+    }
+
+    if (parser->consts_sz >= parser->consts_cap) {
+        parser->consts_cap *= 2;
+        parser->consts = NOTNULL(realloc(parser->consts, parser->consts_cap * sizeof(LopAsm_DataConst)));
+    }
+
+    parser->consts[parser->consts_sz] = (LopAsm_DataConst) {
+        .hash = hash,
+        .offset = offset,
+        .size = size,
+    };
+    consts_index_insert(parser, parser->consts_sz++);
+
+    return offset;
+}
+
+static void write_data_u64(Parser *parser, size_t offset, uint64_t value)
+{
+    assert(offset + sizeof(value) <= parser->data_sz);
+    memcpy(&parser->data[offset], &value, sizeof(value));
+}
+
+static bool parse_operand(const Parser *parser, Token token, LopsinValue *out, LopAsm_LabelKind kind);
+
+static void write_data_entry(Parser *parser, LopAsm_DirectiveType type, size_t offset, Token token)
+{
+    LopsinValue value;
+
+    switch (type) {
+        case LOPASM_DIRECTIVE_BYTES: {
+            if (token.type != LOPASM_TOKEN_TYPE_LIT_INT
+                || token.as.lit_int.value < INT8_MIN || token.as.lit_int.value > UINT8_MAX)
+            {
+                fprintf(stderr, "ERROR: Expected a byte in `.bytes`, found `"SV_Fmt"`\n",
+                        SV_Arg(token.text));
+                exit(1);
+            }
+            parser->data[offset] = (char) token.as.lit_int.value;
+        } break;
+
+        case LOPASM_DIRECTIVE_I64:
+        case LOPASM_DIRECTIVE_JMPTAB: {
+            // code labels are allowed too, eg for tables of functions to `rjmp` to
+            if (token.type != LOPASM_TOKEN_TYPE_LIT_INT && token.type != LOPASM_TOKEN_TYPE_IDENTIFIER) {
+                fprintf(stderr, "ERROR: Expected an integer or a label in `%s`, found `"SV_Fmt"`\n",
+                        LOPASM_DIRECTIVE_NAMES[type], SV_Arg(token.text));
+                exit(1);
+            }
+            parse_operand(parser, token, &value, LOPASM_LABEL_CODE);
+            write_data_u64(parser, offset, value.as_i64);
+        } break;
+
+        case LOPASM_DIRECTIVE_F64: {
+            if (token.type == LOPASM_TOKEN_TYPE_LIT_FLOAT) {
+                value.as_f64 = token.as.lit_float.value;
+            } else if (token.type == LOPASM_TOKEN_TYPE_LIT_INT) {
+                value.as_f64 = (double) token.as.lit_int.value;
+            } else {
+                fprintf(stderr, "ERROR: Expected a number in `.f64`, found `"SV_Fmt"`\n",
+                        SV_Arg(token.text));
+                exit(1);
+            }
+            write_data_u64(parser, offset, value.as_i64);
+        } break;
+
+        default: {
+            CRASH("Not a data directive");
+        }
+    }
+}
+
+// Whether the `count` entries of a data directive starting at token i are known before labels are.
+static bool data_is_constant(const Parser *parser, LopAsm_DirectiveType type, size_t i, size_t count)
+{
+    if (type == LOPASM_DIRECTIVE_JMPTAB) return false;
+
+    for (size_t j = i; j < i + count; j++) {
+        if (parser->tokens[j].type == LOPASM_TOKEN_TYPE_IDENTIFIER) return false;
+    }
+
+    return true;
+}
+
+// Lays out a data directive starting at token i, and returns the index of its last token.
+static size_t collect_data_directive(Parser *parser, size_t i)
+{
+    Token directive = parser->tokens[i];
+    const char *directive_name = LOPASM_DIRECTIVE_NAMES[directive.as.directive.type];
+
+    if (directive.as.directive.type == LOPASM_DIRECTIVE_LOCAL
+        || directive.as.directive.type == LOPASM_DIRECTIVE_END)
+    {
+        return i;
+    }
+
+    Token name = expect_data_name(parser, i + 1, directive_name);
+    size_t bytes = 0;
+    size_t align = 1;
+    size_t entries = 0;
+    size_t last = i;
+
+    switch (directive.as.directive.type) {
+        case LOPASM_DIRECTIVE_JMPTAB: {
+            entries = count_until_end(parser, i + 2, directive_name);
+
+            if (entries == 0) {
+                fprintf(stderr, "ERROR: `.jmptab "SV_Fmt"` needs at least a default target\n",
+                        SV_Arg(name.text));
+                exit(1);
+            }
+
+            // the default target, then one per case
+            bytes = sizeof(LopsinJmpTab) + (entries - 1) * sizeof(uint64_t);
+            align = sizeof(uint64_t);
+            last = i + 2 + entries;
+        } break;
+
+        case LOPASM_DIRECTIVE_STRING: {
+            if (i + 2 >= parser->tokens_sz || parser->tokens[i + 2].type != LOPASM_TOKEN_TYPE_LIT_STR) {
+                fprintf(stderr, "ERROR: Expected a string literal after `.string "SV_Fmt"`\n",
+                        SV_Arg(name.text));
+                exit(1);
+            }
+
+            // NUL terminated
+            bytes = lopasm_unescape_str(parser->tokens[i + 2].as.lit_str.value, NULL) + 1;
+            last = i + 2;
+        } break;
+
+        case LOPASM_DIRECTIVE_BYTES: {
+            entries = count_until_end(parser, i + 2, directive_name);
+            bytes = entries;
+            last = i + 2 + entries;
+        } break;
+
+        case LOPASM_DIRECTIVE_I64:
+        case LOPASM_DIRECTIVE_F64: {
+            entries = count_until_end(parser, i + 2, directive_name);
+            bytes = entries * sizeof(uint64_t);
+            align = sizeof(uint64_t);
+            last = i + 2 + entries;
+        } break;
+
+        default: {
+            CRASH("Not a data directive");
+        }
+    }
+
+    size_t offset = reserve_data(parser, bytes, align);
+
+    LopAsm_DirectiveType type = directive.as.directive.type;
+    if (type == LOPASM_DIRECTIVE_STRING) {
+        lopasm_unescape_str(parser->tokens[i + 2].as.lit_str.value, &parser->data[offset]);
+        offset = intern_data(parser, offset, bytes, align);
+    } else if (data_is_constant(parser, type, i + 2, entries)) {
+        size_t entry_size = type == LOPASM_DIRECTIVE_BYTES ? 1 : sizeof(uint64_t);
+        for (size_t j = 0; j < entries; j++) {
+            write_data_entry(parser, type, offset + j * entry_size, parser->tokens[i + 2 + j]);
+        }
+        offset = intern_data(parser, offset, bytes, align);
+    }
+
+    add_label(parser, (Label) {
+        .name = name.as.identifier.name,
+        .loc  = offset,
+        .kind = LOPASM_LABEL_DATA,
+    });
+
+    return last;
+}
+
+static void collect_labels(Parser *parser)
+{
+    parser->ip = 0;
+
+    for (size_t i = 0; i < parser->tokens_sz; i++) {
+        Token token = parser->tokens[i];
+
+        switch (token.type) {
+            case LOPASM_TOKEN_TYPE_LABEL_DEF: {
+                Label label;
+                if (parse_label_def(parser, token, &label)) {
+                    add_label(parser, label);
+                }
+            } break;
+
+            case LOPASM_TOKEN_TYPE_DIRECTIVE: {
+                i = collect_data_directive(parser, i);
+            } break;
+
+            case LOPASM_TOKEN_TYPE_INST: {
+                parser->ip++; // we'll catch things like `push swap` at a later stage
+            } break;
+
+            default: break;
+        }
+    }
+}
+
+static_assert(COUNT_LOPSIN_INST_TYPES == 91, "Exhaustive definition of FUSED_JUMPS with respect to LopsinInstType's");
+// comparison -> compare-and-jump, LOPSIN_INST_NOP if it has no fused form
+static const LopsinInstType FUSED_JUMPS[COUNT_LOPSIN_INST_TYPES] = {
+    [LOPSIN_INST_IGT]   = LOPSIN_INST_JIGT,
+    [LOPSIN_INST_ILT]   = LOPSIN_INST_JILT,
+    [LOPSIN_INST_IGTE]  = LOPSIN_INST_JIGTE,
+    [LOPSIN_INST_ILTE]  = LOPSIN_INST_JILTE,
+    [LOPSIN_INST_IEQ]   = LOPSIN_INST_JIEQ,
+    [LOPSIN_INST_INEQ]  = LOPSIN_INST_JINEQ,
+
+    [LOPSIN_INST_FGT]   = LOPSIN_INST_JFGT,
+    [LOPSIN_INST_FLT]   = LOPSIN_INST_JFLT,
+    [LOPSIN_INST_FGTE]  = LOPSIN_INST_JFGTE,
+    [LOPSIN_INST_FLTE]  = LOPSIN_INST_JFLTE,
+    [LOPSIN_INST_FEQ]   = LOPSIN_INST_JFEQ,
+    [LOPSIN_INST_FNEQ]  = LOPSIN_INST_JFNEQ,
+};
+
+// integer comparison -> compare-with-immediate-and-jump
+static const LopsinInstType FUSED_IMM_JUMPS[COUNT_LOPSIN_INST_TYPES] = {
+    [LOPSIN_INST_IGT]   = LOPSIN_INST_JIGTI,
+    [LOPSIN_INST_ILT]   = LOPSIN_INST_JILTI,
+    [LOPSIN_INST_IGTE]  = LOPSIN_INST_JIGTEI,
+    [LOPSIN_INST_ILTE]  = LOPSIN_INST_JILTEI,
+    [LOPSIN_INST_IEQ]   = LOPSIN_INST_JIEQI,
+    [LOPSIN_INST_INEQ]  = LOPSIN_INST_JINEQI,
+};
+
+static bool token_is_inst(const Parser *parser, size_t i, LopsinInstType *out)
+{
+    if (i >= parser->tokens_sz) return false;
+    if (parser->tokens[i].type != LOPASM_TOKEN_TYPE_INST) return false;
+
+    if (out) *out = parser->tokens[i].as.inst.type;
+    return true;
+}
+
+static bool is_relative_jump(LopsinInstType insttype)
+{
+    return insttype == LOPSIN_INST_RJMP || insttype == LOPSIN_INST_CRJMP;
+}
+
+// Marks where each relative jump lands in `targets`. Returns false if the offset of one isn't
+// a literal, so that where it lands can't be known.
+static bool relative_jump_targets(const Parser *parser, size_t inst_count, bool *targets)
+{
+    size_t ip = 0;
+    for (size_t i = 0; i < parser->tokens_sz; i++) {
+        LopsinInstType insttype;
+        if (!token_is_inst(parser, i, &insttype)) continue;
+
+        if (is_relative_jump(insttype)) {
+            if (i + 1 >= parser->tokens_sz || parser->tokens[i + 1].type != LOPASM_TOKEN_TYPE_LIT_INT) return false;
+
+            int64_t target = (int64_t) ip + parser->tokens[i + 1].as.lit_int.value;
+            // a jump out of the program fails the same way wherever it goes
+            if (target >= 0 && (uint64_t) target <= inst_count) targets[target] = true;
+        }
+        ip++;
+    }
+    return true;
+}
+
+// Whether an integer literal is surely a number rather than a code address: a character, the offset
+// of a relative jump, or pushed to be computed with right away, like the 2 of `push 2 ilt`.
+static bool literal_is_number(const Parser *parser, size_t i)
+{
+    if (parser->tokens[i].text.count > 0 && parser->tokens[i].text.data[0] == '\'') return true;
+
+    LopsinInstType before, after;
+    if (i == 0 || !token_is_inst(parser, i - 1, &before)) return false;
+    if (is_relative_jump(before)) return true;
+
+    // arithmetic, conversions, comparisons and bitwise and logical operations
+    return before == LOPSIN_INST_PUSH
+        && token_is_inst(parser, i + 1, &after)
+        && after >= LOPSIN_INST_ISUM && after <= LOPSIN_INST_LNOT;
+}
+
+// Returns the first instruction a fusion may start at, so that no integer literal which could be a
+// code address (`jmp 5`, a subroutine pushed for `pfor`, an `.i64` entry, ...) names one that moves.
+// A literal can't always be told apart from a number, so all of them count but the ones that surely
+// are numbers.
+static size_t first_fusable_inst(const Parser *parser, size_t inst_count)
+{
+    size_t first = 0;
+    for (size_t i = 0; i < parser->tokens_sz; i++) {
+        if (parser->tokens[i].type != LOPASM_TOKEN_TYPE_LIT_INT) continue;
+        if (literal_is_number(parser, i)) continue;
+
+        int64_t value = parser->tokens[i].as.lit_int.value;
+        if (value >= 0 && (uint64_t) value <= inst_count && (size_t) value > first) first = value;
+    }
+    return first;
+}
+
+// Fusing turns several instructions into one, so the instructions after it move. Label definitions
+// are tokens too, so a label is never in the middle of what gets fused, and labels are only resolved
+// later. Literal code addresses are not, so nothing before the last one a literal could name is
+// fused. Relative jumps are resolved already: a sequence with a relative jump into its middle is left
+// alone, and their offsets are adjusted afterwards. If where one lands can't be known, nothing is fused.
+void lopasm_parser_optimize(LopAsm_Parser *parser)
+{
+    assert(parser->phase == LOPASM_PARSER_PHASE_ONE);
+
+    size_t inst_count = 0;
+    bool has_relative_jumps = false;
+    for (size_t i = 0; i < parser->tokens_sz; i++) {
+        LopsinInstType insttype;
+        if (!token_is_inst(parser, i, &insttype)) continue;
+        has_relative_jumps = has_relative_jumps || is_relative_jump(insttype);
+        inst_count++;
+    }
+
+    size_t first_fusable = first_fusable_inst(parser, inst_count);
+
+    // where relative jumps land, and where each instruction ends up, only if there are any
+    bool *targets = NULL;
+    size_t *moved_to = NULL;
+    if (has_relative_jumps) {
+        targets = NOTNULL(calloc(inst_count + 1, sizeof(bool)));
+        moved_to = NOTNULL(malloc((inst_count + 1) * sizeof(size_t)));
+        if (!relative_jump_targets(parser, inst_count, targets)) {
+            free(targets);
+            free(moved_to);
+            return;
+        }
+    }
+
+    size_t w = 0;
+    size_t r = 0;
+    // instructions read and written so far
+    size_t old_ip = 0;
+    size_t new_ip = 0;
+    while (r < parser->tokens_sz) {
+        LopsinInstType a, b, c;
+
+        // `push K <icmp> cjmp L` -> `j<icmp>i K L`
+        if (token_is_inst(parser, r, &a) && a == LOPSIN_INST_PUSH
+            && r + 1 < parser->tokens_sz
+            && parser->tokens[r + 1].type == LOPASM_TOKEN_TYPE_LIT_INT
+            && parser->tokens[r + 1].as.lit_int.value >= INT32_MIN
+            && parser->tokens[r + 1].as.lit_int.value <= INT32_MAX
+            && token_is_inst(parser, r + 2, &b) && FUSED_IMM_JUMPS[b] != LOPSIN_INST_NOP
+            && token_is_inst(parser, r + 3, &c) && c == LOPSIN_INST_CJMP
+            && old_ip >= first_fusable
+            && (targets == NULL || (!targets[old_ip + 1] && !targets[old_ip + 2])))
+        {
+            Token fused = parser->tokens[r + 2];
+            fused.as.inst.type = FUSED_IMM_JUMPS[b];
+
+            if (moved_to != NULL) moved_to[old_ip] = moved_to[old_ip + 1] = moved_to[old_ip + 2] = new_ip;
+            parser->tokens[w++] = fused;
+            parser->tokens[w++] = parser->tokens[r + 1];
+            r += 4;
+            old_ip += 3;
+            new_ip++;
+            continue;
+        }
+
+        // `<cmp> cjmp L` -> `j<cmp> L`
+        if (token_is_inst(parser, r, &a) && FUSED_JUMPS[a] != LOPSIN_INST_NOP
+            && token_is_inst(parser, r + 1, &b) && b == LOPSIN_INST_CJMP
+            && old_ip >= first_fusable
+            && (targets == NULL || !targets[old_ip + 1]))
+        {
+            Token fused = parser->tokens[r];
+            fused.as.inst.type = FUSED_JUMPS[a];
+
+            if (moved_to != NULL) moved_to[old_ip] = moved_to[old_ip + 1] = new_ip;
+            parser->tokens[w++] = fused;
+            r += 2;
+            old_ip += 2;
+            new_ip++;
+            continue;
+        }
+
+        if (token_is_inst(parser, r, NULL)) {
+            if (moved_to != NULL) moved_to[old_ip] = new_ip;
+            old_ip++;
+            new_ip++;
+        }
+        parser->tokens[w++] = parser->tokens[r++];
+    }
+
+    parser->tokens_sz = w;
+
+    if (has_relative_jumps) {
+        moved_to[inst_count] = new_ip;
+
+        // the operands still hold the offsets from before. An instruction is the first of those
+        // that moved to it, as the instructions kept their order.
+        size_t ip = 0;
+        old_ip = 0;
+        for (size_t i = 0; i < parser->tokens_sz; i++) {
+            LopsinInstType insttype;
+            if (!token_is_inst(parser, i, &insttype)) continue;
+
+            while (moved_to[old_ip] < ip) old_ip++;
+            if (is_relative_jump(insttype)) {
+                int64_t *offset = &parser->tokens[i + 1].as.lit_int.value;
+                int64_t target = (int64_t) old_ip + *offset;
+                if (target >= 0 && (uint64_t) target <= inst_count) {
+                    *offset = (int64_t) moved_to[target] - (int64_t) ip;
+                }
+            }
+            ip++;
+        }
+
+        free(targets);
+        free(moved_to);
+    }
+}
+
 void lopasm_parser_next_phase(LopAsm_Parser *parser)
 {
     parser->phase++;
@@ -45,6 +625,7 @@ void lopasm_parser_next_phase(LopAsm_Parser *parser)
         } break;
 
         case LOPASM_PARSER_PHASE_TWO: {
+            collect_labels(parser);
             parser->ip = 0;
         } break;
 
@@ -59,53 +640,64 @@ bool lopasm_parser_accept_token(LopAsm_Parser *parser, LopAsm_Token token)
 {
     assert(parser->phase == LOPASM_PARSER_PHASE_ONE);
 
-    switch (token.type) {
-        case LOPASM_TOKEN_TYPE_LABEL_DEF: {
-            if (parse_label_def(parser, token, &parser->labels[parser->labels_sz])) {
-                parser->labels_sz++;
-            } else return false;
-        } break;
-
-        case LOPASM_TOKEN_TYPE_INST: {
-            parser->ip++; // we'll catch things like `push swap` at a later stage
-            FALLTHROUGH;
-        }
-
-        default: {
-            append_token(parser, token);
-        }
-    }
+    append_token(parser, token);
 
     return true;
 }
 
-static bool parse_identifier_value(const Parser *parser, Token token, LopsinValue *out)
+static bool parse_identifier_value(const Parser *parser, Token token, LopsinValue *out, LopAsm_LabelKind *kind)
 {
     assert(token.type == LOPASM_TOKEN_TYPE_IDENTIFIER);
 
 
-    for (size_t i = 0; i < parser->labels_sz; i++) {
-        Label label = parser->labels[i];
-        if (sv_eq(token.as.identifier.name, label.name)) {
+    const Label *label = find_label(parser, token.as.identifier.name);
+    if (label != NULL) {
+        if (out) *out = (LopsinValue) {
+            .as_i64 = label->loc,
+        };
+        if (kind) *kind = label->kind;
 
+        return true;
+    }
+
+    fprintf(stderr, "ERROR: Unknown identifier `"SV_Fmt"`\n", SV_Arg(token.text));
+    exit(1);
+    return false;
+}
+
+static bool parse_local_value(const Parser *parser, Token token, LopsinValue *out)
+{
+    assert(token.type == LOPASM_TOKEN_TYPE_IDENTIFIER);
+
+    for (size_t i = 0; i < parser->locals_sz; i++) {
+        Label local = parser->locals[i];
+        if (sv_eq(token.as.identifier.name, local.name)) {
             if (out) *out = (LopsinValue) {
-                .as_i64 = label.loc,
+                .as_i64 = local.loc,
             };
 
             return true;
         }
     }
 
-    fprintf(stderr, "ERROR: Unknown identifier `"SV_Fmt"`\n", SV_Arg(token.text));
+    fprintf(stderr, "ERROR: Unknown local `"SV_Fmt"`\n", SV_Arg(token.text));
     exit(1);
     return false;
 }
 
-static bool parse_operand(const Parser *parser, Token token, LopsinValue *out)
+static bool parse_operand(const Parser *parser, Token token, LopsinValue *out, LopAsm_LabelKind kind)
 {
     switch (token.type) {
         case LOPASM_TOKEN_TYPE_IDENTIFIER: {
-            bool success = parse_identifier_value(parser, token, out);
+            LopAsm_LabelKind actual;
+            bool success = parse_identifier_value(parser, token, out, &actual);
+            if (success && actual != kind) {
+                fprintf(stderr, "ERROR: `"SV_Fmt"` is a %s label, expected a %s label\n",
+                        SV_Arg(token.text),
+                        actual == LOPASM_LABEL_DATA ? "data" : "code",
+                        kind == LOPASM_LABEL_DATA ? "data" : "code");
+                exit(1);
+            }
             return success;
         } break;
 
@@ -126,13 +718,217 @@ static bool parse_operand(const Parser *parser, Token token, LopsinValue *out)
     return false;
 }
 
+static bool parse_memory_order(const Parser *parser, Token token, LopsinValue *out)
+{
+    if (token.type == LOPASM_TOKEN_TYPE_IDENTIFIER) {
+        for (LopsinMemoryOrder i = 0; i < COUNT_LOPSIN_MEMORY_ORDERS; i++) {
+            if (sv_eq(token.as.identifier.name, sv_from_cstr(LOPSIN_MEMORY_ORDER_NAMES[i]))) {
+                if (out) *out = (LopsinValue) {
+                    .as_i64 = i,
+                };
+                return true;
+            }
+        }
+    }
+
+    fprintf(stderr, "ERROR: Expected a memory order for `"SV_Fmt"` (relaxed, acquire, release, acq_rel or seq_cst), found `"SV_Fmt"`\n",
+            SV_Arg(parser->tokens[parser->ip - 2].text),
+            SV_Arg(token.text));
+    exit(1);
+    return false;
+}
+
+// Natives are not known until the VM loads the program (they can come from plugins), so any
+// name is accepted, and added to the program's table of natives.
+static bool parse_native(Parser *parser, Token token, LopsinValue *out)
+{
+    if (token.type != LOPASM_TOKEN_TYPE_IDENTIFIER) {
+        fprintf(stderr, "ERROR: Expected the name of a native for `ncall`, found `"SV_Fmt"`\n",
+                SV_Arg(token.text));
+        exit(1);
+    }
+
+    String_View name = token.as.identifier.name;
+    size_t i = 0;
+    while (i < parser->natives_sz && !sv_eq(parser->natives[i], name)) i++;
+
+    if (i == parser->natives_sz) {
+        if (parser->natives_sz >= parser->natives_cap) {
+            parser->natives_cap *= 2;
+            parser->natives = NOTNULL(realloc(parser->natives, parser->natives_cap * sizeof(String_View)));
+        }
+        parser->natives[parser->natives_sz++] = name;
+    }
+
+    if (out) *out = (LopsinValue) {
+        .as_i64 = i,
+    };
+    return true;
+}
+
+static bool parse_immediate(const Parser *parser, Token token, int32_t *out)
+{
+    if (token.type != LOPASM_TOKEN_TYPE_LIT_INT) {
+        fprintf(stderr, "ERROR: Expected an integer immediate for `"SV_Fmt"`, found `"SV_Fmt"`\n",
+                SV_Arg(parser->tokens[parser->ip - 2].text),
+                SV_Arg(token.text));
+        exit(1);
+    }
+
+    if (token.as.lit_int.value < INT32_MIN || token.as.lit_int.value > INT32_MAX) {
+        fprintf(stderr, "ERROR: Immediate `"SV_Fmt"` does not fit in 32 bits\n",
+                SV_Arg(token.text));
+        exit(1);
+    }
+
+    if (out) *out = (int32_t) token.as.lit_int.value;
+    return true;
+}
+
+static void declare_local(Parser *parser, Token name)
+{
+    if (name.type != LOPASM_TOKEN_TYPE_IDENTIFIER) {
+        fprintf(stderr, "ERROR: Expected a name after `.local`, found `"SV_Fmt"`\n",
+                SV_Arg(name.text));
+        exit(1);
+    }
+
+    for (size_t i = 0; i < parser->locals_sz; i++) {
+        if (sv_eq(parser->locals[i].name, name.as.identifier.name)) {
+            fprintf(stderr, "ERROR: Redefinition of local `"SV_Fmt"`\n",
+                    SV_Arg(name.text));
+            exit(1);
+        }
+    }
+
+    if (parser->locals_sz >= LOPASM_LOCALS_CAP) {
+        fprintf(stderr, "ERROR: Too many locals (at most %d per scope)\n", LOPASM_LOCALS_CAP);
+        exit(1);
+    }
+
+    parser->locals[parser->locals_sz] = (Label) {
+        .name = name.as.identifier.name,
+        .loc = parser->locals_sz,
+    };
+    parser->locals_sz++;
+}
+
+// Fills in the data laid out by collect_data_directive(). parser->ip points just after the directive.
+static void parse_data_directive(Parser *parser, LopAsm_DirectiveType type)
+{
+    const char *directive_name = LOPASM_DIRECTIVE_NAMES[type];
+    Token name = expect_data_name(parser, parser->ip++, directive_name);
+
+    const Label *label = find_label(parser, name.as.identifier.name);
+    assert(label != NULL && label->kind == LOPASM_LABEL_DATA);
+    size_t offset = label->loc;
+
+    // constants were already filled in by collect_data_directive()
+    if (type == LOPASM_DIRECTIVE_STRING) {
+        parser->ip++;
+        return;
+    }
+
+    size_t entries = count_until_end(parser, parser->ip, directive_name);
+    if (data_is_constant(parser, type, parser->ip, entries)) {
+        parser->ip += entries + 1;
+        return;
+    }
+
+    size_t entry_size = type == LOPASM_DIRECTIVE_BYTES ? 1 : sizeof(uint64_t);
+
+    if (type == LOPASM_DIRECTIVE_JMPTAB) {
+        write_data_u64(parser, offset + offsetof(LopsinJmpTab, count), entries - 1);
+        // the default target comes first, and is laid out the same as the targets themselves
+        offset += offsetof(LopsinJmpTab, default_target);
+    }
+
+    for (size_t i = 0; i < entries; i++) {
+        write_data_entry(parser, type, offset + i * entry_size, parser->tokens[parser->ip++]);
+    }
+
+    // .end
+    parser->ip++;
+}
+
+static void parse_directive(Parser *parser, Token directive)
+{
+    assert(directive.type == LOPASM_TOKEN_TYPE_DIRECTIVE);
+
+    static_assert(COUNT_LOPASM_DIRECTIVES == 7, "Exhaustive handling of LopAsm_DirectiveType's in parse_directive()");
+    switch (directive.as.directive.type) {
+        case LOPASM_DIRECTIVE_LOCAL: {
+            if (parser->ip >= parser->tokens_sz) {
+                fprintf(stderr, "ERROR: Expected a name after `.local`, found none\n");
+                exit(1);
+            }
+            declare_local(parser, parser->tokens[parser->ip++]);
+        } break;
+
+        case LOPASM_DIRECTIVE_JMPTAB:
+        case LOPASM_DIRECTIVE_STRING:
+        case LOPASM_DIRECTIVE_BYTES:
+        case LOPASM_DIRECTIVE_I64:
+        case LOPASM_DIRECTIVE_F64: {
+            parse_data_directive(parser, directive.as.directive.type);
+        } break;
+
+        case LOPASM_DIRECTIVE_END: {
+            fprintf(stderr, "ERROR: `.end` without a matching directive\n");
+            exit(1);
+        } break;
+
+        default: {
+            CRASH("Bad directive type");
+        }
+    }
+}
+
+static bool token_is_data_label(const Parser *parser, Token token)
+{
+    if (token.type != LOPASM_TOKEN_TYPE_IDENTIFIER) return false;
+
+    const Label *label = find_label(parser, token.as.identifier.name);
+    return label != NULL && label->kind == LOPASM_LABEL_DATA;
+}
+
+// Which kind of label an instruction's operand may name.
+static LopAsm_LabelKind operand_label_kind(LopsinInstType type)
+{
+    switch (type) {
+        case LOPSIN_INST_PUSHD:
+        case LOPSIN_INST_JMPTAB:
+            return LOPASM_LABEL_DATA;
+
+        default:
+            return LOPASM_LABEL_CODE;
+    }
+}
+
 bool lopasm_parser_spit_inst(LopAsm_Parser *parser, LopsinInst *out)
 {
     assert(parser->phase == LOPASM_PARSER_PHASE_TWO);
 
+    while (parser->ip < parser->tokens_sz) {
+        Token tok = parser->tokens[parser->ip];
+
+        if (tok.type == LOPASM_TOKEN_TYPE_LABEL_DEF) {
+            // label locations were already collected, but a top-level label opens a new scope for locals
+            if (!sv_index_of(tok.as.label_def.name, '.', NULL)) {
+                parser->locals_sz = 0;
+            }
+            parser->ip++;
+        } else if (tok.type == LOPASM_TOKEN_TYPE_DIRECTIVE) {
+            parser->ip++;
+            parse_directive(parser, tok);
+        } else {
+            break;
+        }
+    }
+
     if (parser->ip >= parser->tokens_sz) return false;
 
-    LopsinInst result;
+    LopsinInst result = {0};
 
     {
         Token tok = parser->tokens[parser->ip++];
@@ -140,6 +936,21 @@ bool lopasm_parser_spit_inst(LopAsm_Parser *parser, LopsinInst *out)
         switch (tok.type) {
             case LOPASM_TOKEN_TYPE_INST: {
                 result.type = tok.as.inst.type;
+                if (requires_immediate(tok.as.inst.type)) {
+                    if (parser->ip >= parser->tokens_sz) {
+                        fprintf(stderr,
+                            "ERROR: Instruction of type `%s` requires an immediate (found none)\n",
+                            LOPSIN_INST_TYPE_NAMES[result.type]);
+
+                        exit(1);
+                    }
+
+                    Token immtok = parser->tokens[parser->ip++];
+                    if (!parse_immediate(parser, immtok, &result.imm)) {
+                        return false;
+                    }
+                }
+
                 if (requires_operand(tok.as.inst.type)) {
                     if (parser->ip >= parser->tokens_sz) {
                         fprintf(stderr,
@@ -150,15 +961,41 @@ bool lopasm_parser_spit_inst(LopAsm_Parser *parser, LopsinInst *out)
                     }
 
                     Token optok = parser->tokens[parser->ip++];
-                    if (!parse_operand(parser, optok, &result.operand)) {
+
+                    // pushing a data label pushes its address
+                    if (result.type == LOPSIN_INST_PUSH && token_is_data_label(parser, optok)) {
+                        result.type = LOPSIN_INST_PUSHD;
+                    }
+
+                    if (result.type == LOPSIN_INST_PUSH && optok.type == LOPASM_TOKEN_TYPE_LIT_FLOAT) {
+                        // bit-exact, including the sign of zero and NaN payloads
+                        result.operand.as_f64 = optok.as.lit_float.value;
+                    } else if ((result.type == LOPSIN_INST_LOCAL_GET || result.type == LOPSIN_INST_LOCAL_SET)
+                        && optok.type == LOPASM_TOKEN_TYPE_IDENTIFIER)
+                    {
+                        if (!parse_local_value(parser, optok, &result.operand)) {
+                            return false;
+                        }
+                    } else if (result.type == LOPSIN_INST_NCALL) {
+                        if (!parse_native(parser, optok, &result.operand)) {
+                            return false;
+                        }
+                    } else if (is_atomic_inst(result.type)) {
+                        if (!parse_memory_order(parser, optok, &result.operand)) {
+                            return false;
+                        }
+                    } else if (!parse_operand(parser, optok, &result.operand, operand_label_kind(result.type))) {
                         return false;
                     }
                 }
             } break;
 
             case LOPASM_TOKEN_TYPE_LIT_INT:
+            case LOPASM_TOKEN_TYPE_LIT_FLOAT:
+            case LOPASM_TOKEN_TYPE_LIT_STR:
             case LOPASM_TOKEN_TYPE_IDENTIFIER:
             case LOPASM_TOKEN_TYPE_LABEL_DEF:
+            case LOPASM_TOKEN_TYPE_DIRECTIVE:
             {
                 fprintf(stderr, "ERROR: Unexpected token `"SV_Fmt"`\n",
                         SV_Arg(tok.text));
@@ -177,36 +1014,49 @@ bool lopasm_parser_spit_inst(LopAsm_Parser *parser, LopsinInst *out)
 
 void lopasm_parser_free(LopAsm_Parser *parser)
 {
+    free(parser->labels);
+    free(parser->label_index);
+    free(parser->data);
+    free(parser->consts);
+    free(parser->consts_index);
+    free(parser->natives);
     free(parser->tokens);
     free(parser);
 }
 
-static void populate_hardcoded_labels(Parser *parser)
-{
-    for (LopsinNativeType i = 0; i < COUNT_LOPSIN_NATIVES; i++) {
-        assert(parser->labels_sz < LOPASM_LABELS_CAP);
-        parser->labels[parser->labels_sz++] = (Label) {
-            .loc = i,
-            .name = sv_from_cstr(LOPSIN_NATIVES[i].name),
-        };
-    }
-}
-
 #define LOPASM_PARSER_INITIAL_TOKENS_CAP 1024
+#define LOPASM_PARSER_INITIAL_DATA_CAP 1024
+#define LOPASM_PARSER_INITIAL_CONSTS_CAP 64
+#define LOPASM_PARSER_INITIAL_NATIVES_CAP 16
 LopAsm_Parser *lopasm_parser_new(void)
 {
     Parser *parser = NOTNULL(malloc(sizeof(Parser)));
     *parser = (Parser) {
         .ip = 0,
-        .labels = {0},
+        .labels = NOTNULL(calloc(LOPASM_PARSER_INITIAL_LABELS_CAP, sizeof(Label))),
         .labels_sz = 0,
+        .labels_cap = LOPASM_PARSER_INITIAL_LABELS_CAP,
+        .label_index = NOTNULL(calloc(2 * LOPASM_PARSER_INITIAL_LABELS_CAP, sizeof(size_t))),
+        .label_index_cap = 2 * LOPASM_PARSER_INITIAL_LABELS_CAP,
+        .locals = {0},
+        .locals_sz = 0,
+        .data = NOTNULL(malloc(LOPASM_PARSER_INITIAL_DATA_CAP)),
+        .data_sz = 0,
+        .data_cap = LOPASM_PARSER_INITIAL_DATA_CAP,
+        .consts = NOTNULL(calloc(LOPASM_PARSER_INITIAL_CONSTS_CAP, sizeof(LopAsm_DataConst))),
+        .consts_sz = 0,
+        .consts_cap = LOPASM_PARSER_INITIAL_CONSTS_CAP,
+        .consts_index = NOTNULL(calloc(2 * LOPASM_PARSER_INITIAL_CONSTS_CAP, sizeof(size_t))),
+        .consts_index_cap = 2 * LOPASM_PARSER_INITIAL_CONSTS_CAP,
+        .natives = NOTNULL(calloc(LOPASM_PARSER_INITIAL_NATIVES_CAP, sizeof(String_View))),
+        .natives_sz = 0,
+        .natives_cap = LOPASM_PARSER_INITIAL_NATIVES_CAP,
         .tokens = NOTNULL(calloc(LOPASM_PARSER_INITIAL_TOKENS_CAP, sizeof(Token))),
         .tokens_cap = LOPASM_PARSER_INITIAL_TOKENS_CAP,
         .tokens_sz = 0,
         .phase = LOPASM_PARSER_PHASE_ONE,
     };
 
-    populate_hardcoded_labels(parser);
 
     return parser;
 }
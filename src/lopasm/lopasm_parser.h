@@ -14,9 +14,16 @@ extern "C"
 
 #include "./lopasm_lexer.h"
 
+typedef enum {
+    LOPASM_LABEL_CODE = 0,
+    LOPASM_LABEL_DATA,
+} LopAsm_LabelKind;
+
 typedef struct {
     String_View name;
+    // instruction index for code labels, offset into the data section for data labels
     size_t loc;
+    LopAsm_LabelKind kind;
 } LopAsm_Label;
 
 typedef enum {
@@ -28,18 +35,56 @@ typedef enum {
     COUNT_LOPASM_PARSER_PHASES
 } LopAsm_ParserPhase;
 
-#define LOPASM_LABELS_CAP 1024
-// TODO(#3): LopAsm_Parser's internal label list is not dynamically sized
+#define LOPASM_LOCALS_CAP 256
+
+// a run of constant bytes in the data section, which later identical constants can share
 typedef struct {
-    LopAsm_Label labels[LOPASM_LABELS_CAP];
+    uint64_t hash;
+    size_t offset;
+    size_t size;
+} LopAsm_DataConst;
+
+typedef struct {
+    LopAsm_Label *labels;
     size_t labels_sz;
+    size_t labels_cap;
+
+    // open addressing hash index into `labels`, holding (label index + 1), 0 if empty
+    size_t *label_index;
+    size_t label_index_cap;
+
+    // names declared with `.local`, in scope until the next top-level label
+    // (a label without a `.` in its name). loc holds the local's index.
+    LopAsm_Label locals[LOPASM_LOCALS_CAP];
+    size_t locals_sz;
 
     LopAsm_Token *tokens;
     size_t tokens_sz;
     size_t tokens_cap;
 
+    // read-only data section, laid out when collecting labels and filled in phase two
+    // (constants are filled in right away, so that duplicates can be shared)
+    char *data;
+    size_t data_sz;
+    size_t data_cap;
+
+    LopAsm_DataConst *consts;
+    size_t consts_sz;
+    size_t consts_cap;
+
+    // open addressing hash index into `consts` by their hash, holding (const index + 1), 0 if empty
+    size_t *consts_index;
+    size_t consts_index_cap;
+
+    // names of the natives called with `ncall`, whose operand is an index into them.
+    // They are written out ahead of the data section, and resolved when the VM loads the program
+    String_View *natives;
+    size_t natives_sz;
+    size_t natives_cap;
+
     // in phase one, this holds the instruction pointer
     // in phase two, this holds the token pointer (ie how many tokens have been consumed), because doing sh!t like `*parser->tokens++` is dangerous :)
+    // labels are collected from the tokens when moving from phase one to phase two
     size_t ip;
     LopAsm_ParserPhase phase;
 } LopAsm_Parser;
@@ -48,6 +93,8 @@ void lopasm_parser_next_phase(LopAsm_Parser *parser);
 LopAsm_Parser *lopasm_parser_new(void);
 bool lopasm_parser_spit_inst(LopAsm_Parser *parser, LopsinInst *out);
 bool lopasm_parser_accept_token(LopAsm_Parser *parser, LopAsm_Token token);
+// Peephole optimizations over the accepted tokens. Must be done before moving on to phase two.
+void lopasm_parser_optimize(LopAsm_Parser *parser);
 void lopasm_parser_free(LopAsm_Parser *parser);
 
 #ifdef __cplusplus
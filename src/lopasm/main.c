@@ -3,6 +3,7 @@
 #   define _GNU_SOURCE
 
 #   include <sys/wait.h>
+#   include <sys/resource.h>
 #   include <signal.h>
 #elif defined _WIN32
 
@@ -13,6 +14,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #define SV_IMPLEMENTATION
 #include <sv.h>
@@ -33,12 +35,84 @@ static void usage(FILE *stream, const char *program_name)
         "   --debug, -d             Enable debugging mode\n"
         "   --help,  -h             Print this help message and exit\n"
         "   --run,   -r             Run program after compilation (requries --vm)\n"
+        "   --time-passes           Print time and memory taken by each assembler pass\n"
+        "   --no-optimize           Emit instructions exactly as written\n"
         "   --vm <vm.exe>           Use a shebang pointing to <vm.exe> (this does nothing smart with the working directory, exercise caution)\n"
     );
 }
 
 #define cstreq(a, b) (strcmp(a, b) == 0)
 
+#define MAX_PASSES 8
+
+typedef struct {
+    const char *name;
+    double ms;
+    long maxrss_kib;
+} Pass;
+
+typedef struct {
+    bool enabled;
+    Pass passes[MAX_PASSES];
+    size_t count;
+    struct timespec start;
+} Pass_Timer;
+
+static long maxrss_kib(void)
+{
+#if defined __linux__ || (defined __APPLE__ && defined __MACH__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) return 0;
+#   if defined __APPLE__
+    return usage.ru_maxrss / 1024;
+#   else
+    return usage.ru_maxrss;
+#   endif
+#else
+    return 0;
+#endif
+}
+
+static void pass_begin(Pass_Timer *timer, const char *name)
+{
+    if (!timer->enabled) return;
+
+    assert(timer->count < MAX_PASSES);
+    timer->passes[timer->count].name = name;
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+}
+
+static void pass_end(Pass_Timer *timer)
+{
+    if (!timer->enabled) return;
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    Pass *pass = &timer->passes[timer->count++];
+    pass->ms = (end.tv_sec - timer->start.tv_sec) * 1e3
+             + (end.tv_nsec - timer->start.tv_nsec) / 1e6;
+    pass->maxrss_kib = maxrss_kib();
+}
+
+static void pass_timer_report(FILE *stream, const Pass_Timer *timer)
+{
+    if (!timer->enabled) return;
+
+    double total = 0;
+    long prev_rss = 0;
+
+    fprintf(stream, "%-12s %12s %16s %14s\n", "Pass", "Time (ms)", "Max RSS (KiB)", "+RSS (KiB)");
+    for (size_t i = 0; i < timer->count; i++) {
+        Pass pass = timer->passes[i];
+        fprintf(stream, "%-12s %12.3f %16ld %14ld\n",
+                pass.name, pass.ms, pass.maxrss_kib, pass.maxrss_kib - prev_rss);
+        total += pass.ms;
+        prev_rss = pass.maxrss_kib;
+    }
+    fprintf(stream, "%-12s %12.3f %16ld\n", "total", total, prev_rss);
+}
+
 int main(int argc, const char **argv)
 {
     assert(argc > 0);
@@ -52,6 +126,8 @@ int main(int argc, const char **argv)
         const char *vm_path;
         bool debug_mode;
         bool run;
+        bool time_passes;
+        bool no_optimize;
     } args = {0};
 
     while (*argv != NULL) {
@@ -83,6 +159,10 @@ int main(int argc, const char **argv)
             }
         } else if (cstreq(arg, "--run") || cstreq(arg, "-r")) {
             args.run = true;
+        } else if (cstreq(arg, "--time-passes")) {
+            args.time_passes = true;
+        } else if (cstreq(arg, "--no-optimize")) {
+            args.no_optimize = true;
         } else {
             // TODO(#4): lopasm does not support multiple compilation units
             if (args.input_path != NULL) {
@@ -107,8 +187,12 @@ int main(int argc, const char **argv)
         exit(1);
     }
 
+    Pass_Timer timer = { .enabled = args.time_passes };
+
+    pass_begin(&timer, "read");
     Buffer *input_buf = new_buffer(0);
     buffer_append_file(input_buf, args.input_path);
+    pass_end(&timer);
 
     String_View input = {
         .count = input_buf->size,
@@ -124,6 +208,7 @@ int main(int argc, const char **argv)
     LopAsm_Parser *parser = lopasm_parser_new();
     LopAsm_Token tok = {0};
 
+    pass_begin(&timer, "lex");
     bool success;
     do {
         success = lopasm_lexer_spit_token(&lexer, &tok);
@@ -143,19 +228,22 @@ int main(int argc, const char **argv)
             }
         }
     } while (success);
+    pass_end(&timer);
 
-    lopasm_parser_next_phase(parser);
+    if (!args.no_optimize) {
+        pass_begin(&timer, "optimize");
+        lopasm_parser_optimize(parser);
+        pass_end(&timer);
+    }
 
-    {
-        Buffer *output_buf = new_buffer(0);
+    pass_begin(&timer, "labels");
+    lopasm_parser_next_phase(parser);
+    pass_end(&timer);
 
-        if (args.vm_path) {
-            buffer_append_cstr(output_buf, "#!");
-            buffer_append_cstr(output_buf, args.vm_path);
-            buffer_append_char(output_buf, '\n');
-        }
-        buffer_append_cstr(output_buf, LOPSINVM_BYTECODE_MAGIC);
+    Buffer *insts_buf = new_buffer(0);
 
+    pass_begin(&timer, "resolve");
+    {
         LopsinInst inst = {0};
         do {
             success = lopasm_parser_spit_inst(parser, &inst);
@@ -165,6 +253,10 @@ int main(int argc, const char **argv)
                     printf("Spit instruction: %s\t",
                            LOPSIN_INST_TYPE_NAMES[inst.type]);
 
+                    if (requires_immediate(inst.type)) {
+                        printf("%"PRId32"\t", inst.imm);
+                    }
+
                     if (requires_operand(inst.type)) {
                         lopsinvalue_print(stdout, inst.operand);
                     }
@@ -172,20 +264,59 @@ int main(int argc, const char **argv)
                     printf("\n");
                 }
 
-                buffer_append_bytes(output_buf, &inst, sizeof(LopsinInst));
+                buffer_append_bytes(insts_buf, &inst, sizeof(LopsinInst));
             }
         } while (success);
+    }
+    pass_end(&timer);
+
+    pass_begin(&timer, "emit");
+    {
+        Buffer *output_buf = new_buffer(0);
+
+        if (args.vm_path) {
+            buffer_append_cstr(output_buf, "#!");
+            buffer_append_cstr(output_buf, args.vm_path);
+            buffer_append_char(output_buf, '\n');
+        }
+        buffer_append_cstr(output_buf, LOPSINVM_BYTECODE_MAGIC);
+
+        Buffer *natives_buf = new_buffer(0);
+        for (size_t i = 0; i < parser->natives_sz; i++) {
+            buffer_append_bytes(natives_buf, parser->natives[i].data, parser->natives[i].count);
+            buffer_append_char(natives_buf, '\0');
+        }
+
+        LopsinBytecodeHeader header = {
+            .version      = LOPSINVM_BYTECODE_VERSION,
+            .natives_size = natives_buf->size,
+            .data_size    = parser->data_sz,
+            .inst_count   = insts_buf->size / sizeof(LopsinInst),
+        };
+        buffer_append_bytes(output_buf, &header, sizeof(header));
+        buffer_append_bytes(output_buf, natives_buf->data, natives_buf->size);
+        buffer_append_bytes(output_buf, parser->data, parser->data_sz);
+        buffer_append_bytes(output_buf, insts_buf->data, insts_buf->size);
 
         buffer_write_to_file(output_buf, args.output_path);
 
+        buffer_clear(natives_buf);
+        buffer_free(natives_buf);
         buffer_clear(output_buf);
         buffer_free(output_buf);
     }
+    pass_end(&timer);
+
+    lopasm_parser_free(parser);
+
+    buffer_clear(insts_buf);
+    buffer_free(insts_buf);
 
     buffer_clear(input_buf);
     buffer_free(input_buf);
 
     printf("Compiled %s -> %s successfully.\n", args.input_path, args.output_path);
+    pass_timer_report(stdout, &timer);
 
     if (args.run) {
         if (args.vm_path == NULL) {
@@ -13,6 +13,13 @@
 
 #define EXTRA_SRCFILES                          \
     PATH(SRCDIR, "lopsinvm", "lopsinvm.c"),     \
+    PATH(SRCDIR, "lopsinvm", "lopsinvm_chan.c"),\
+    PATH(SRCDIR, "lopsinvm", "lopsinvm_pfor.c"),\
+    PATH(SRCDIR, "lopsinvm", "lopsinvm_simd.c"),\
+    PATH(SRCDIR, "lopsinvm", "lopsinvm_sort.c"),\
+    PATH(SRCDIR, "lopsinvm", "lopsinvm_map.c"),\
+    PATH(SRCDIR, "lopsinvm", "lopsinvm_vec.c"),\
+    PATH(SRCDIR, "common", "handles.c"),    \
     PATH(SRCDIR, "common", "util.c")
 
 int main(int argc, const char **argv)
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+
+#include "../lopsinvm/lopsinvm_serve.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define cstreq(a, b) (strcmp(a, b) == 0)
+
+#define LOPSINRUN_SOCKET_ENV "LOPSINVM_SOCKET"
+
+static void usage(FILE *stream, const char *program)
+{
+    fprintf(stream, "USAGE: %s [OPTIONS] <input.lopsinvm>\n", program);
+    fprintf(stream,
+        "Runs the program on a `lopsinvm --serve`, with this process' stdin, stdout and stderr,\n"
+        "and exits with the status `lopsinvm` would have.\n"
+        "OPTIONS:\n"
+        "   --help,   -h            Display this help and exit\n"
+        "   --socket, -s <path>     Socket the server listens on (default: $" LOPSINRUN_SOCKET_ENV ")\n");
+}
+
+static int connect_to(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t len = strlen(path);
+    if (len >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(addr.sun_path, path, len + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool send_request(int sock, const LopsinServeRequest *req, const int fds[COUNT_LOPSIN_SERVE_FDS])
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * COUNT_LOPSIN_SERVE_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = { .iov_base = (void *) req, .iov_len = sizeof(*req) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * COUNT_LOPSIN_SERVE_FDS);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * COUNT_LOPSIN_SERVE_FDS);
+
+    ssize_t n;
+    do n = sendmsg(sock, &msg, MSG_NOSIGNAL); while (n < 0 && errno == EINTR);
+    if (n < 0) return false;
+
+    // the descriptors went with the first part, the rest is plain bytes
+    size_t sent = n;
+    while (sent < sizeof(*req)) {
+        n = send(sock, (const char *) req + sent, sizeof(*req) - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        sent += n;
+    }
+
+    return true;
+}
+
+int main(int argc, const char **argv)
+{
+    (void) argc;
+
+    assert(*argv != NULL);
+
+    const char *program_name = *argv++;
+    const char *input_file = NULL;
+    const char *socket_path = getenv(LOPSINRUN_SOCKET_ENV);
+
+    while (*argv != NULL) {
+        const char *arg = *argv++;
+
+        if (cstreq(arg, "--help") || cstreq(arg, "-h")) {
+            usage(stdout, program_name);
+            exit(0);
+        } else if (cstreq(arg, "--socket") || cstreq(arg, "-s")) {
+            if (*argv == NULL) {
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No value provided for `%s`\n", arg);
+                exit(1);
+            }
+            socket_path = *argv++;
+        } else {
+            if (input_file != NULL) {
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: Unknown option `%s`\n", arg);
+                exit(1);
+            }
+
+            input_file = arg;
+        }
+    }
+
+    if (input_file == NULL) {
+        usage(stderr, program_name);
+        fprintf(stderr, "ERROR: No input file provided\n");
+        exit(1);
+    }
+
+    if (socket_path == NULL || *socket_path == '\0') {
+        usage(stderr, program_name);
+        fprintf(stderr, "ERROR: No socket provided\n");
+        exit(1);
+    }
+
+    // the server reads the program through this descriptor, with the permissions of this process
+    int program = open(input_file, O_RDONLY | O_CLOEXEC);
+    if (program < 0) {
+        fprintf(stderr, "ERROR: Could not open file %s: %s\n", input_file, strerror(errno));
+        exit(1);
+    }
+
+    int sock = connect_to(socket_path);
+    if (sock < 0) {
+        fprintf(stderr, "ERROR: Could not connect to %s: %s\n", socket_path, strerror(errno));
+        exit(1);
+    }
+
+    LopsinServeRequest req = { .version = LOPSIN_SERVE_PROTOCOL_VERSION };
+    snprintf(req.name, sizeof(req.name), "%s", input_file);
+
+    const int fds[COUNT_LOPSIN_SERVE_FDS] = {
+        [LOPSIN_SERVE_FD_PROGRAM] = program,
+        [LOPSIN_SERVE_FD_STDIN]   = STDIN_FILENO,
+        [LOPSIN_SERVE_FD_STDOUT]  = STDOUT_FILENO,
+        [LOPSIN_SERVE_FD_STDERR]  = STDERR_FILENO,
+    };
+
+    if (!send_request(sock, &req, fds)) {
+        fprintf(stderr, "ERROR: Could not send %s to %s: %s\n", input_file, socket_path, strerror(errno));
+        exit(1);
+    }
+    close(program);
+
+    // the program writes to our stdout and stderr itself, all that comes back is its status
+    LopsinServeResponse response;
+    size_t got = 0;
+    while (got < sizeof(response)) {
+        ssize_t n = recv(sock, (char *) &response + got, sizeof(response) - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "ERROR: The server closed the connection before %s finished\n", input_file);
+            exit(1);
+        }
+        got += n;
+    }
+
+    close(sock);
+    return response.status;
+}
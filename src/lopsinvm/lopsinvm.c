@@ -1,12 +1,23 @@
+#define _GNU_SOURCE
+
 #include "./lopsinvm.h"
+#include "./lopsinvm_chan.h"
+#include "./lopsinvm_map.h"
+#include "./lopsinvm_vec.h"
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #define BUFFERDEF static inline
 #define BUFFER_IMPLEMENTATION
@@ -21,7 +32,7 @@
 #define NATIVES_IMPLEMENTATION
 #include "./natives.h"
 
-static_assert(COUNT_LOPSIN_INST_TYPES == 54, "Exhaustive definition of LOPSIN_INST_TYPE_NAMES with respect to LopsinInstType's");
+static_assert(COUNT_LOPSIN_INST_TYPES == 91, "Exhaustive definition of LOPSIN_INST_TYPE_NAMES with respect to LopsinInstType's");
 const char * const LOPSIN_INST_TYPE_NAMES[COUNT_LOPSIN_INST_TYPES] = {
     [LOPSIN_INST_NOP]           = "nop",
     [LOPSIN_INST_HLT]           = "hlt",
@@ -86,9 +97,63 @@ const char * const LOPSIN_INST_TYPE_NAMES[COUNT_LOPSIN_INST_TYPES] = {
     [LOPSIN_INST_CALL]          = "call",
     [LOPSIN_INST_RET]           = "ret",
     [LOPSIN_INST_NCALL]         = "ncall",
+
+    [LOPSIN_INST_ENTER]         = "enter",
+    [LOPSIN_INST_LEAVE]         = "leave",
+    [LOPSIN_INST_LOCAL_GET]     = "local.get",
+    [LOPSIN_INST_LOCAL_SET]     = "local.set",
+
+    [LOPSIN_INST_JIGT]          = "jigt",
+    [LOPSIN_INST_JILT]          = "jilt",
+    [LOPSIN_INST_JIGTE]         = "jigte",
+    [LOPSIN_INST_JILTE]         = "jilte",
+    [LOPSIN_INST_JIEQ]          = "jieq",
+    [LOPSIN_INST_JINEQ]         = "jineq",
+
+    [LOPSIN_INST_JFGT]          = "jfgt",
+    [LOPSIN_INST_JFLT]          = "jflt",
+    [LOPSIN_INST_JFGTE]         = "jfgte",
+    [LOPSIN_INST_JFLTE]         = "jflte",
+    [LOPSIN_INST_JFEQ]          = "jfeq",
+    [LOPSIN_INST_JFNEQ]         = "jfneq",
+
+    [LOPSIN_INST_JIGTI]         = "jigti",
+    [LOPSIN_INST_JILTI]         = "jilti",
+    [LOPSIN_INST_JIGTEI]        = "jigtei",
+    [LOPSIN_INST_JILTEI]        = "jiltei",
+    [LOPSIN_INST_JIEQI]         = "jieqi",
+    [LOPSIN_INST_JINEQI]        = "jineqi",
+
+    [LOPSIN_INST_JMPTAB]        = "jmptab",
+
+    [LOPSIN_INST_PUSHD]         = "pushd",
+
+    [LOPSIN_INST_SPAWN]         = "spawn",
+    [LOPSIN_INST_YIELD]         = "yield",
+    [LOPSIN_INST_JOIN]          = "join",
+
+    [LOPSIN_INST_ATOMIC_LOAD32]  = "atomic.load32",
+    [LOPSIN_INST_ATOMIC_LOAD64]  = "atomic.load64",
+    [LOPSIN_INST_ATOMIC_STORE32] = "atomic.store32",
+    [LOPSIN_INST_ATOMIC_STORE64] = "atomic.store64",
+    [LOPSIN_INST_ATOMIC_ADD32]   = "atomic.add32",
+    [LOPSIN_INST_ATOMIC_ADD64]   = "atomic.add64",
+    [LOPSIN_INST_ATOMIC_XCHG32]  = "atomic.xchg32",
+    [LOPSIN_INST_ATOMIC_XCHG64]  = "atomic.xchg64",
+    [LOPSIN_INST_ATOMIC_CAS32]   = "atomic.cas32",
+    [LOPSIN_INST_ATOMIC_CAS64]   = "atomic.cas64",
+};
+
+static_assert(COUNT_LOPSIN_MEMORY_ORDERS == 5, "Exhaustive definition of LOPSIN_MEMORY_ORDER_NAMES with respect to LopsinMemoryOrder's");
+const char * const LOPSIN_MEMORY_ORDER_NAMES[COUNT_LOPSIN_MEMORY_ORDERS] = {
+    [LOPSIN_MEMORY_ORDER_RELAXED] = "relaxed",
+    [LOPSIN_MEMORY_ORDER_ACQUIRE] = "acquire",
+    [LOPSIN_MEMORY_ORDER_RELEASE] = "release",
+    [LOPSIN_MEMORY_ORDER_ACQ_REL] = "acq_rel",
+    [LOPSIN_MEMORY_ORDER_SEQ_CST] = "seq_cst",
 };
 
-static_assert(COUNT_LOPSIN_ERRS == 14, "Exhaustive definition of LOPSIN_ERR_NAMES with respct to LopsinErr's");
+static_assert(COUNT_LOPSIN_ERRS == 22, "Exhaustive definition of LOPSIN_ERR_NAMES with respct to LopsinErr's");
 const char * const LOPSIN_ERR_NAMES[COUNT_LOPSIN_ERRS] = {
     [ERR_OK]                = "OK",
 
@@ -96,6 +161,8 @@ const char * const LOPSIN_ERR_NAMES[COUNT_LOPSIN_ERRS] = {
     [ERR_DSTACK_OVERFLOW]   = "Data stack overflow",
     [ERR_RSTACK_UNDERFLOW]  = "Return stack underflow",
     [ERR_RSTACK_OVERFLOW]   = "Return stack overflow",
+    [ERR_LSTACK_UNDERFLOW]  = "Locals stack underflow",
+    [ERR_LSTACK_OVERFLOW]   = "Locals stack overflow",
 
     [ERR_ILLEGAL_INST]      = "Illegal instruction",
     [ERR_BAD_INST_PTR]      = "Bad instruction pointer",
@@ -107,31 +174,135 @@ const char * const LOPSIN_ERR_NAMES[COUNT_LOPSIN_ERRS] = {
     [ERR_INVALID_TYPE]      = "Invalid type for operation",
 
     [ERR_DIV_BY_ZERO]       = "Division by zero",
+
+    [ERR_WOULD_BLOCK]       = "Would block",
+
+    [ERR_BAD_FIBER]         = "Bad fiber id, or already joined",
+    [ERR_DEADLOCK]          = "Deadlock, every fiber is waiting on another",
+    [ERR_BAD_CHAN]          = "Bad channel handle",
+    [ERR_BAD_MAP]           = "Bad map handle",
+    [ERR_BAD_VEC]           = "Bad vector handle",
 };
 
-#define NATIVE(x) { .name = #x, .proc = &lopsin_native_##x }
+// The stack effect of the native, ( arity -- results ), is checked by `ncall`.
+#define NATIVE(x, in, out) { .name = #x, .proc = &lopsin_native_##x, .arity = (in), .results = (out) }
 
-static_assert(COUNT_LOPSIN_NATIVES == 8, "Exhaustive definition of LOPSIN_NATIVES[] with respect to LopsinNativeType's");
+static_assert(COUNT_LOPSIN_NATIVES == 56, "Exhaustive definition of LOPSIN_NATIVES[] with respect to LopsinNativeType's");
 const LopsinNative LOPSIN_NATIVES[COUNT_LOPSIN_NATIVES] = {
-    [LOPSIN_NATIVE_PUTX]   = NATIVE(putx),
-    [LOPSIN_NATIVE_PUTI]   = NATIVE(puti),
-    [LOPSIN_NATIVE_PUTF]   = NATIVE(putf),
-    [LOPSIN_NATIVE_PUTC]   = NATIVE(putc),
-    [LOPSIN_NATIVE_READ]   = NATIVE(read),
-    [LOPSIN_NATIVE_MALLOC] = NATIVE(malloc),
-    [LOPSIN_NATIVE_FREE]   = NATIVE(free),
-    [LOPSIN_NATIVE_TIME]   = NATIVE(time),
+    [LOPSIN_NATIVE_PUTX]   = NATIVE(putx, 1, 0),
+    [LOPSIN_NATIVE_PUTI]   = NATIVE(puti, 1, 0),
+    [LOPSIN_NATIVE_PUTF]   = NATIVE(putf, 1, 0),
+    [LOPSIN_NATIVE_PUTC]   = NATIVE(putc, 1, 0),
+    [LOPSIN_NATIVE_READ]   = NATIVE(read, 0, 1),
+    [LOPSIN_NATIVE_MALLOC] = NATIVE(malloc, 1, 1),
+    [LOPSIN_NATIVE_FREE]   = NATIVE(free, 1, 0),
+    [LOPSIN_NATIVE_TIME]   = NATIVE(time, 0, 1),
+    [LOPSIN_NATIVE_PUTS]   = NATIVE(puts, 1, 0),
+    [LOPSIN_NATIVE_CHAN_NEW]  = NATIVE(chan_new, 1, 1),
+    [LOPSIN_NATIVE_CHAN_SEND] = NATIVE(chan_send, 2, 0),
+    [LOPSIN_NATIVE_CHAN_RECV] = NATIVE(chan_recv, 1, 1),
+    [LOPSIN_NATIVE_PFOR]   = NATIVE(pfor, 5, 0),
+    [LOPSIN_NATIVE_VADD_I64]  = NATIVE(vadd_i64, 4, 0),
+    [LOPSIN_NATIVE_VADD_F64]  = NATIVE(vadd_f64, 4, 0),
+    [LOPSIN_NATIVE_VMUL_I64]  = NATIVE(vmul_i64, 4, 0),
+    [LOPSIN_NATIVE_VMUL_F64]  = NATIVE(vmul_f64, 4, 0),
+    [LOPSIN_NATIVE_VSCALE_I64]= NATIVE(vscale_i64, 4, 0),
+    [LOPSIN_NATIVE_VSCALE_F64]= NATIVE(vscale_f64, 4, 0),
+    [LOPSIN_NATIVE_VSUM_I64]  = NATIVE(vsum_i64, 2, 1),
+    [LOPSIN_NATIVE_VSUM_F64]  = NATIVE(vsum_f64, 2, 1),
+    [LOPSIN_NATIVE_VDOT_I64]  = NATIVE(vdot_i64, 3, 1),
+    [LOPSIN_NATIVE_VDOT_F64]  = NATIVE(vdot_f64, 3, 1),
+    [LOPSIN_NATIVE_VMIN_I64]  = NATIVE(vmin_i64, 2, 1),
+    [LOPSIN_NATIVE_VMIN_F64]  = NATIVE(vmin_f64, 2, 1),
+    [LOPSIN_NATIVE_VMAX_I64]  = NATIVE(vmax_i64, 2, 1),
+    [LOPSIN_NATIVE_VMAX_F64]  = NATIVE(vmax_f64, 2, 1),
+    [LOPSIN_NATIVE_MEMCPY]    = NATIVE(memcpy, 3, 0),
+    [LOPSIN_NATIVE_MEMMOVE]   = NATIVE(memmove, 3, 0),
+    [LOPSIN_NATIVE_MEMSET]    = NATIVE(memset, 3, 0),
+    [LOPSIN_NATIVE_MEMCMP]    = NATIVE(memcmp, 3, 1),
+    [LOPSIN_NATIVE_SORT_I64]  = NATIVE(sort_i64, 2, 0),
+    [LOPSIN_NATIVE_SORT_U64]  = NATIVE(sort_u64, 2, 0),
+    [LOPSIN_NATIVE_SORT_F64]  = NATIVE(sort_f64, 2, 0),
+    [LOPSIN_NATIVE_SORT_BY]   = NATIVE(sort_by, 3, 0),
+    [LOPSIN_NATIVE_MAP_NEW]        = NATIVE(map_new, 0, 1),
+    [LOPSIN_NATIVE_MAP_NEW_BYTES]  = NATIVE(map_new_bytes, 0, 1),
+    [LOPSIN_NATIVE_MAP_FREE]       = NATIVE(map_free, 1, 0),
+    [LOPSIN_NATIVE_MAP_COUNT]      = NATIVE(map_count, 1, 1),
+    [LOPSIN_NATIVE_MAP_PUT]        = NATIVE(map_put, 3, 0),
+    [LOPSIN_NATIVE_MAP_GET]        = NATIVE(map_get, 2, 2),
+    [LOPSIN_NATIVE_MAP_DEL]        = NATIVE(map_del, 2, 1),
+    [LOPSIN_NATIVE_MAP_ITER]       = NATIVE(map_iter, 2, 3),
+    [LOPSIN_NATIVE_MAP_PUT_BYTES]  = NATIVE(map_put_bytes, 4, 0),
+    [LOPSIN_NATIVE_MAP_GET_BYTES]  = NATIVE(map_get_bytes, 3, 2),
+    [LOPSIN_NATIVE_MAP_DEL_BYTES]  = NATIVE(map_del_bytes, 3, 1),
+    [LOPSIN_NATIVE_MAP_ITER_BYTES] = NATIVE(map_iter_bytes, 4, 3),
+    [LOPSIN_NATIVE_REALLOC]        = NATIVE(realloc, 2, 1),
+    [LOPSIN_NATIVE_VEC_NEW]        = NATIVE(vec_new, 0, 1),
+    [LOPSIN_NATIVE_VEC_FREE]       = NATIVE(vec_free, 1, 0),
+    [LOPSIN_NATIVE_VEC_PUSH]       = NATIVE(vec_push, 2, 0),
+    [LOPSIN_NATIVE_VEC_POP]        = NATIVE(vec_pop, 1, 1),
+    [LOPSIN_NATIVE_VEC_GET]        = NATIVE(vec_get, 2, 1),
+    [LOPSIN_NATIVE_VEC_SET]        = NATIVE(vec_set, 3, 0),
+    [LOPSIN_NATIVE_VEC_LEN]        = NATIVE(vec_len, 1, 1),
+    [LOPSIN_NATIVE_VEC_DATA]       = NATIVE(vec_data, 1, 1),
 };
 
+#define LOPSIN_REGISTERED_NATIVES_INITIAL_CAP 16
+
+// Natives added with lopsin_register_native(), names included are never freed.
+static LopsinNative *registered_natives = NULL;
+static size_t registered_natives_count = 0;
+static size_t registered_natives_cap = 0;
+
+const LopsinNative *lopsin_find_native(const char *name, size_t len)
+{
+    for (size_t i = 0; i < COUNT_LOPSIN_NATIVES; i++) {
+        if (strlen(LOPSIN_NATIVES[i].name) == len && memcmp(LOPSIN_NATIVES[i].name, name, len) == 0) {
+            return &LOPSIN_NATIVES[i];
+        }
+    }
+
+    for (size_t i = 0; i < registered_natives_count; i++) {
+        if (strlen(registered_natives[i].name) == len && memcmp(registered_natives[i].name, name, len) == 0) {
+            return &registered_natives[i];
+        }
+    }
+
+    return NULL;
+}
+
+bool lopsin_register_native(const char *name, LopsinNativeProc proc, uint8_t arity, uint8_t results)
+{
+    size_t len = strlen(name);
+    if (len == 0 || lopsin_find_native(name, len) != NULL) return false;
+
+    if (registered_natives_count >= registered_natives_cap) {
+        registered_natives_cap = registered_natives_cap == 0
+            ? LOPSIN_REGISTERED_NATIVES_INITIAL_CAP
+            : registered_natives_cap * 2;
+        registered_natives = NOTNULL(realloc(registered_natives, registered_natives_cap * sizeof(LopsinNative)));
+    }
+
+    char *copy = NOTNULL(malloc(len + 1));
+    memcpy(copy, name, len + 1);
+
+    // the fields are const, so the entry can't be assigned
+    LopsinNative native = { .proc = proc, .name = copy, .arity = arity, .results = results };
+    memcpy(&registered_natives[registered_natives_count++], &native, sizeof(native));
+    return true;
+}
+
 static void lopvm_dump_stack(FILE *stream, const LopsinVM *vm)
 {
     fprintf(stream,
         "Stack pointer: %zu\n"
         "Inst pointer:  %zu\n"
+        "Frame pointer: %zu\n"
         "Stack: \n",
 
         vm->dsp,
-        vm->ip);
+        vm->ip,
+        vm->fp);
 
     for (size_t i = 0; i < vm->dsp; i++) {
         LopsinValue a = vm->dstack[i];
@@ -144,7 +315,7 @@ static void lopvm_dump_stack(FILE *stream, const LopsinVM *vm)
 
 bool requires_operand(LopsinInstType insttype)
 {
-    static_assert(COUNT_LOPSIN_INST_TYPES == 54, "Exhaustive handling of LopsinInstType's in requires_operand");
+    static_assert(COUNT_LOPSIN_INST_TYPES == 91, "Exhaustive handling of LopsinInstType's in requires_operand");
 
     switch (insttype) {
     case LOPSIN_INST_NOP:
@@ -191,6 +362,9 @@ bool requires_operand(LopsinInstType insttype)
     case LOPSIN_INST_W16:
     case LOPSIN_INST_W32:
     case LOPSIN_INST_W64:
+    case LOPSIN_INST_LEAVE:
+    case LOPSIN_INST_YIELD:
+    case LOPSIN_INST_JOIN:
         return false;
 
     case LOPSIN_INST_PUSH:
@@ -203,6 +377,40 @@ bool requires_operand(LopsinInstType insttype)
     case LOPSIN_INST_CRJMP:
     case LOPSIN_INST_CALL:
     case LOPSIN_INST_NCALL:
+    case LOPSIN_INST_ENTER:
+    case LOPSIN_INST_LOCAL_GET:
+    case LOPSIN_INST_LOCAL_SET:
+    case LOPSIN_INST_JIGT:
+    case LOPSIN_INST_JILT:
+    case LOPSIN_INST_JIGTE:
+    case LOPSIN_INST_JILTE:
+    case LOPSIN_INST_JIEQ:
+    case LOPSIN_INST_JINEQ:
+    case LOPSIN_INST_JFGT:
+    case LOPSIN_INST_JFLT:
+    case LOPSIN_INST_JFGTE:
+    case LOPSIN_INST_JFLTE:
+    case LOPSIN_INST_JFEQ:
+    case LOPSIN_INST_JFNEQ:
+    case LOPSIN_INST_JIGTI:
+    case LOPSIN_INST_JILTI:
+    case LOPSIN_INST_JIGTEI:
+    case LOPSIN_INST_JILTEI:
+    case LOPSIN_INST_JIEQI:
+    case LOPSIN_INST_JINEQI:
+    case LOPSIN_INST_JMPTAB:
+    case LOPSIN_INST_PUSHD:
+    case LOPSIN_INST_SPAWN:
+    case LOPSIN_INST_ATOMIC_LOAD32:
+    case LOPSIN_INST_ATOMIC_LOAD64:
+    case LOPSIN_INST_ATOMIC_STORE32:
+    case LOPSIN_INST_ATOMIC_STORE64:
+    case LOPSIN_INST_ATOMIC_ADD32:
+    case LOPSIN_INST_ATOMIC_ADD64:
+    case LOPSIN_INST_ATOMIC_XCHG32:
+    case LOPSIN_INST_ATOMIC_XCHG64:
+    case LOPSIN_INST_ATOMIC_CAS32:
+    case LOPSIN_INST_ATOMIC_CAS64:
         return true;
 
     default: {
@@ -211,6 +419,32 @@ bool requires_operand(LopsinInstType insttype)
     }
 }
 
+// Whether the instruction takes an immediate in LopsinInst.imm, in addition to its operand.
+// In lopasm it is written before the operand, eg `jigti 10 loop`.
+bool requires_immediate(LopsinInstType insttype)
+{
+    switch (insttype) {
+    case LOPSIN_INST_JIGTI:
+    case LOPSIN_INST_JILTI:
+    case LOPSIN_INST_JIGTEI:
+    case LOPSIN_INST_JILTEI:
+    case LOPSIN_INST_JIEQI:
+    case LOPSIN_INST_JINEQI:
+    case LOPSIN_INST_SPAWN:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// Whether the operand of the instruction is a LopsinMemoryOrder.
+// In lopasm it is written by name, eg `atomic.add64 relaxed`.
+bool is_atomic_inst(LopsinInstType insttype)
+{
+    return insttype >= LOPSIN_INST_ATOMIC_LOAD32 && insttype <= LOPSIN_INST_ATOMIC_CAS64;
+}
+
 #define BINARY_OP(vm, in, out, op)                                             \
     do                                                                         \
     {                                                                          \
@@ -224,40 +458,323 @@ bool requires_operand(LopsinInstType insttype)
         (vm)->ip++;                                                            \
     } while (0)
 
+#define COMPARE_AND_JUMP(vm, inst, in, op)                                     \
+    do                                                                         \
+    {                                                                          \
+        if ((vm)->dsp < 2)                                                     \
+            return ERR_DSTACK_UNDERFLOW;                                       \
+                                                                               \
+        LopsinValue a = (vm)->dstack[--(vm)->dsp];                             \
+        LopsinValue b = (vm)->dstack[--(vm)->dsp];                             \
+                                                                               \
+        if (b.as_##in op a.as_##in) {                                          \
+            (vm)->ip = (inst).operand.as_i64;                                  \
+        } else {                                                               \
+            (vm)->ip++;                                                        \
+        }                                                                      \
+    } while (0)
+
+#define COMPARE_IMM_AND_JUMP(vm, inst, op)                                     \
+    do                                                                         \
+    {                                                                          \
+        if ((vm)->dsp < 1)                                                     \
+            return ERR_DSTACK_UNDERFLOW;                                       \
+                                                                               \
+        LopsinValue a = (vm)->dstack[--(vm)->dsp];                             \
+                                                                               \
+        if (a.as_i64 op (int64_t) (inst).imm) {                                \
+            (vm)->ip = (inst).operand.as_i64;                                  \
+        } else {                                                               \
+            (vm)->ip++;                                                        \
+        }                                                                      \
+    } while (0)
+
+// Index of the last chunk starting at or before ptr, or heap->count if there is none.
+static size_t lopsin_heap_find(const LopsinHeap *heap, uintptr_t ptr)
+{
+    size_t lo = 0, hi = heap->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t) heap->chunks[mid].ptr <= ptr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo == 0 ? heap->count : lo - 1;
+}
+
+static void lopsin_heap_insert(LopsinHeap *heap, Mem_Chunk chunk)
+{
+    if (heap->count >= heap->cap) {
+        heap->cap = heap->cap == 0 ? LOPSINVM_HEAP_INITIAL_CAP : heap->cap * 2;
+        heap->chunks = NOTNULL(realloc(heap->chunks, heap->cap * sizeof(Mem_Chunk)));
+    }
+
+    size_t i = lopsin_heap_find(heap, (uintptr_t) chunk.ptr);
+    i = i == heap->count ? 0 : i + 1;
+
+    memmove(&heap->chunks[i + 1], &heap->chunks[i], (heap->count - i) * sizeof(Mem_Chunk));
+    heap->chunks[i] = chunk;
+    heap->count++;
+}
+
+void lopsinvm_heap_add(LopsinVM *vm, void *ptr, size_t bytes)
+{
+    lopsin_heap_insert(&vm->heap, (Mem_Chunk) { .ptr = ptr, .bytes = bytes, .owned = false });
+}
+
+// Index of the chunk starting at ptr, or heap->count if there is none, or it isn't `owned` as asked.
+static size_t lopsin_heap_find_exact(const LopsinHeap *heap, const void *ptr, bool owned)
+{
+    size_t i = lopsin_heap_find(heap, (uintptr_t) ptr);
+    if (i == heap->count || heap->chunks[i].ptr != ptr || heap->chunks[i].owned != owned) return heap->count;
+    return i;
+}
+
+static bool lopsin_heap_remove(LopsinHeap *heap, void *ptr, bool owned)
+{
+    size_t i = lopsin_heap_find_exact(heap, ptr, owned);
+    if (i == heap->count) return false;
+
+    heap->count--;
+    memmove(&heap->chunks[i], &heap->chunks[i + 1], (heap->count - i) * sizeof(Mem_Chunk));
+    return true;
+}
+
+static LopsinErr lopsin_heap_realloc(LopsinHeap *heap, void **ptr, size_t bytes, bool owned)
+{
+    if (*ptr == NULL) {
+        void *fresh = malloc(bytes);
+        if (fresh == NULL) return ERR_OUT_OF_MEMORY;
+        lopsin_heap_insert(heap, (Mem_Chunk) { .ptr = fresh, .bytes = bytes, .owned = owned });
+        *ptr = fresh;
+        return ERR_OK;
+    }
+
+    size_t i = lopsin_heap_find_exact(heap, *ptr, owned);
+    if (i == heap->count) return ERR_BAD_MEM_PTR;
+
+    // realloc() may free the chunk and return NULL when asked for 0 bytes
+    void *moved = realloc(*ptr, bytes > 0 ? bytes : 1);
+    if (moved == NULL) return ERR_OUT_OF_MEMORY;
+    *ptr = moved;
+
+    Mem_Chunk chunk = { .ptr = moved, .bytes = bytes, .owned = owned };
+
+    // most of the time the chunk grew in place, or still sorts between the same neighbours
+    uintptr_t p = (uintptr_t) moved;
+    if ((i == 0 || (uintptr_t) heap->chunks[i - 1].ptr < p)
+        && (i + 1 == heap->count || p < (uintptr_t) heap->chunks[i + 1].ptr))
+    {
+        heap->chunks[i] = chunk;
+        return ERR_OK;
+    }
+
+    heap->count--;
+    memmove(&heap->chunks[i], &heap->chunks[i + 1], (heap->count - i) * sizeof(Mem_Chunk));
+    lopsin_heap_insert(heap, chunk);
+    return ERR_OK;
+}
+
+bool lopsinvm_heap_remove(LopsinVM *vm, void *ptr)
+{
+    return lopsin_heap_remove(&vm->heap, ptr, false);
+}
+
+LopsinErr lopsinvm_heap_realloc(LopsinVM *vm, void **ptr, size_t bytes)
+{
+    return lopsin_heap_realloc(&vm->heap, ptr, bytes, false);
+}
+
+bool lopsinvm_heap_remove_owned(LopsinVM *vm, void *ptr)
+{
+    return lopsin_heap_remove(&vm->heap, ptr, true);
+}
+
+LopsinErr lopsinvm_heap_realloc_owned(LopsinVM *vm, void **ptr, size_t bytes)
+{
+    return lopsin_heap_realloc(&vm->heap, ptr, bytes, true);
+}
+
+size_t lopsinvm_writable_bytes(const LopsinVM *vm, const void *ptr)
+{
+    uintptr_t p = (uintptr_t) ptr;
+
+    size_t i = lopsin_heap_find(&vm->heap, p);
+    if (i < vm->heap.count) {
+        uintptr_t chunk = (uintptr_t) vm->heap.chunks[i].ptr;
+        if (p < chunk + vm->heap.chunks[i].bytes) {
+            return chunk + vm->heap.chunks[i].bytes - p;
+        }
+    }
+
+    return 0;
+}
+
+// How many bytes can be read starting at ptr: either from memory allocated by the VM, or from the data section.
+size_t lopsinvm_readable_bytes(const LopsinVM *vm, const void *ptr)
+{
+    uintptr_t p = (uintptr_t) ptr;
+
+    uintptr_t data = (uintptr_t) vm->program->data;
+    if (data <= p && p < data + vm->program->data_size) {
+        return data + vm->program->data_size - p;
+    }
+
+    return lopsinvm_writable_bytes(vm, ptr);
+}
+
 static bool lopsinvm_chkmem(LopsinVM *vm, void *memptr, Mem_Chunk *out)
 {
     uintptr_t ptr = (uintptr_t) memptr;
-    for (size_t i = 0; i < vm->alloced_count; i++) {
-        Mem_Chunk chunk = vm->alloced[i];
-        if ((uintptr_t)chunk.ptr <= ptr && ptr <= (uintptr_t)chunk.ptr + chunk.bytes) {
-            if (out) *out = chunk;
-            return true;
-        }
+    size_t i = lopsin_heap_find(&vm->heap, ptr);
+    if (i == vm->heap.count) return false;
+
+    Mem_Chunk chunk = vm->heap.chunks[i];
+    if (ptr <= (uintptr_t)chunk.ptr + chunk.bytes) {
+        if (out) *out = chunk;
+        return true;
     }
     return false;
 }
 
-LopsinErr lopsinvm_run_inst(LopsinVM *vm)
+// Whether ptr is a naturally aligned cell of `bytes` bytes in memory allocated by the VM,
+// which is what atomics require.
+static bool lopsinvm_atomic_cell(const LopsinVM *vm, const void *ptr, size_t bytes)
 {
-    static_assert(COUNT_LOPSIN_INST_TYPES == 54, "Exhaustive handling of LopsinInstType's in lopsinvm_run_inst()");
+    uintptr_t p = (uintptr_t) ptr;
+    if (p % bytes != 0) return false;
 
-    if (!vm->running) {
-        return ERR_HALTED;
-    }
+    size_t i = lopsin_heap_find(&vm->heap, p);
+    if (i == vm->heap.count) return false;
+
+    uintptr_t chunk = (uintptr_t) vm->heap.chunks[i].ptr;
+    return p + bytes <= chunk + vm->heap.chunks[i].bytes;
+}
+
+// Run `stmt` with `mo` set to the C11 memory order matching `order`, as a constant, so that
+// each atomic compiles down to the instruction for its order rather than a seq_cst one.
+// Orders the verifier rejects for the kind of access fall back to seq_cst.
+#define WITH_LOAD_ORDER(order, stmt)                                                    \
+    do {                                                                                \
+        switch (order) {                                                                \
+        case LOPSIN_MEMORY_ORDER_RELAXED: { const memory_order mo = memory_order_relaxed; stmt; } break; \
+        case LOPSIN_MEMORY_ORDER_ACQUIRE: { const memory_order mo = memory_order_acquire; stmt; } break; \
+        default:                          { const memory_order mo = memory_order_seq_cst; stmt; } break; \
+        }                                                                               \
+    } while (0)
+
+#define WITH_STORE_ORDER(order, stmt)                                                   \
+    do {                                                                                \
+        switch (order) {                                                                \
+        case LOPSIN_MEMORY_ORDER_RELAXED: { const memory_order mo = memory_order_relaxed; stmt; } break; \
+        case LOPSIN_MEMORY_ORDER_RELEASE: { const memory_order mo = memory_order_release; stmt; } break; \
+        default:                          { const memory_order mo = memory_order_seq_cst; stmt; } break; \
+        }                                                                               \
+    } while (0)
+
+// Also sets `mo_fail`, the strongest order a failed compare-exchange is allowed to have.
+#define WITH_RMW_ORDER(order, stmt)                                                     \
+    do {                                                                                \
+        switch (order) {                                                                \
+        case LOPSIN_MEMORY_ORDER_RELAXED: { const memory_order mo = memory_order_relaxed, mo_fail = memory_order_relaxed; (void) mo_fail; stmt; } break; \
+        case LOPSIN_MEMORY_ORDER_ACQUIRE: { const memory_order mo = memory_order_acquire, mo_fail = memory_order_acquire; (void) mo_fail; stmt; } break; \
+        case LOPSIN_MEMORY_ORDER_RELEASE: { const memory_order mo = memory_order_release, mo_fail = memory_order_relaxed; (void) mo_fail; stmt; } break; \
+        case LOPSIN_MEMORY_ORDER_ACQ_REL: { const memory_order mo = memory_order_acq_rel, mo_fail = memory_order_acquire; (void) mo_fail; stmt; } break; \
+        default:                          { const memory_order mo = memory_order_seq_cst, mo_fail = memory_order_seq_cst; (void) mo_fail; stmt; } break; \
+        }                                                                               \
+    } while (0)
+
+// `atomic.load<N> order ( ptr -- val )`
+#define ATOMIC_LOAD(vm, inst, type)                                            \
+    do                                                                         \
+    {                                                                          \
+        if ((vm)->dsp < 1) return ERR_DSTACK_UNDERFLOW;                        \
+        _Atomic type *ptr = (vm)->dstack[(vm)->dsp - 1].as_ptr;                \
+        if (!lopsinvm_atomic_cell((vm), ptr, sizeof(type))) return ERR_BAD_MEM_PTR; \
+                                                                               \
+        type val;                                                              \
+        WITH_LOAD_ORDER((inst).operand.as_i64, val = atomic_load_explicit(ptr, mo)); \
+        (vm)->dstack[(vm)->dsp - 1].as_i64 = val;                              \
+        (vm)->ip++;                                                            \
+    } while (0)
+
+// `atomic.store<N> order ( val ptr -- )`
+#define ATOMIC_STORE(vm, inst, type)                                           \
+    do                                                                         \
+    {                                                                          \
+        if ((vm)->dsp < 2) return ERR_DSTACK_UNDERFLOW;                        \
+        _Atomic type *ptr = (vm)->dstack[(vm)->dsp - 1].as_ptr;                \
+        type val = (type) (vm)->dstack[(vm)->dsp - 2].as_i64;                  \
+        if (!lopsinvm_atomic_cell((vm), ptr, sizeof(type))) return ERR_BAD_MEM_PTR; \
+                                                                               \
+        WITH_STORE_ORDER((inst).operand.as_i64, atomic_store_explicit(ptr, val, mo)); \
+        (vm)->dsp -= 2;                                                        \
+        (vm)->ip++;                                                            \
+    } while (0)
+
+// `atomic.add<N> order ( delta ptr -- old )` and `atomic.xchg<N> order ( val ptr -- old )`
+#define ATOMIC_RMW(vm, inst, type, op)                                         \
+    do                                                                         \
+    {                                                                          \
+        if ((vm)->dsp < 2) return ERR_DSTACK_UNDERFLOW;                        \
+        _Atomic type *ptr = (vm)->dstack[(vm)->dsp - 1].as_ptr;                \
+        type val = (type) (vm)->dstack[(vm)->dsp - 2].as_i64;                  \
+        if (!lopsinvm_atomic_cell((vm), ptr, sizeof(type))) return ERR_BAD_MEM_PTR; \
+                                                                               \
+        type old;                                                              \
+        WITH_RMW_ORDER((inst).operand.as_i64, old = op(ptr, val, mo));         \
+        (vm)->dsp--;                                                           \
+        (vm)->dstack[(vm)->dsp - 1].as_i64 = old;                              \
+        (vm)->ip++;                                                            \
+    } while (0)
+
+// `atomic.cas<N> order ( expected desired ptr -- old )`, which stored `desired` if old == expected
+#define ATOMIC_CAS(vm, inst, type)                                             \
+    do                                                                         \
+    {                                                                          \
+        if ((vm)->dsp < 3) return ERR_DSTACK_UNDERFLOW;                        \
+        _Atomic type *ptr = (vm)->dstack[(vm)->dsp - 1].as_ptr;                \
+        type desired = (type) (vm)->dstack[(vm)->dsp - 2].as_i64;              \
+        type old = (type) (vm)->dstack[(vm)->dsp - 3].as_i64;                  \
+        if (!lopsinvm_atomic_cell((vm), ptr, sizeof(type))) return ERR_BAD_MEM_PTR; \
+                                                                               \
+        WITH_RMW_ORDER((inst).operand.as_i64,                                  \
+            atomic_compare_exchange_strong_explicit(ptr, &old, desired, mo, mo_fail)); \
+        (vm)->dsp -= 2;                                                        \
+        (vm)->dstack[(vm)->dsp - 1].as_i64 = old;                              \
+        (vm)->ip++;                                                            \
+    } while (0)
+
+static LopsinErr lopsinvm_spawn(LopsinVM *, LopsinInst);
+static LopsinErr lopsinvm_join(LopsinVM *);
+static LopsinErr lopsinvm_fiber_exit(LopsinVM *);
+static bool lopsinvm_switch_fiber(LopsinVM *);
 
-    if (vm->ip >= vm->program.count) {
+// Runs the instruction at vm->ip. Returns ERR_HALTED after `hlt`, ERR_WOULD_BLOCK if a native
+// has to be retried later, and any other error as is.
+// Only called from lopsinvm_run_for(), so that it gets inlined into its loop.
+static LopsinErr lopsinvm_step(LopsinVM *vm)
+{
+    static_assert(COUNT_LOPSIN_INST_TYPES == 91, "Exhaustive handling of LopsinInstType's in lopsinvm_step()");
+
+    if (vm->ip >= vm->inst_count) {
         return ERR_BAD_INST_PTR;
     }
-    LopsinInst inst = vm->program.insts[vm->ip];
+    LopsinInst inst = vm->insts[vm->ip];
 
     if (vm->debug_mode) {
-        lopvm_dump_stack(stdout, vm);
+        lopvm_dump_stack(vm->out, vm);
 
-        fprintf(stdout, "Current instruction: %s ",
+        fprintf(vm->out, "Current instruction: %s ",
             LOPSIN_INST_TYPE_NAMES[inst.type]);
-        fprintf(stdout, "%"PRId64, inst.operand.as_i64);
-        fprintf(stdout, "\n");
-        fprintf(stdout, "==============================\n");
+        if (requires_immediate(inst.type)) {
+            fprintf(vm->out, "%"PRId32" ", inst.imm);
+        }
+        fprintf(vm->out, "%"PRId64, inst.operand.as_i64);
+        fprintf(vm->out, "\n");
+        fprintf(vm->out, "==============================\n");
     }
 
     switch (inst.type) {
@@ -267,13 +784,11 @@ LopsinErr lopsinvm_run_inst(LopsinVM *vm)
     } break;
 
     case LOPSIN_INST_HLT: {
-        vm->running = false;
+        return ERR_HALTED;
     } break;
 
     case LOPSIN_INST_PUSH: {
-        if (vm->dsp >= vm->dstack_cap) {
-            return ERR_DSTACK_OVERFLOW;
-        }
+        // overflow hits the guard page, see lopsinvm_start()
         vm->dstack[vm->dsp++] = inst.operand;
         vm->ip++;
     } break;
@@ -322,16 +837,14 @@ LopsinErr lopsinvm_run_inst(LopsinVM *vm)
             return ERR_DSTACK_UNDERFLOW;
         }
 
-        size_t swap_sz = operand * sizeof(LopsinValue);
-        LopsinValue *temp = NOTNULL(malloc(swap_sz));
-        memcpy(temp, &vm->dstack[vm->dsp - (2 * operand)], swap_sz);
-        memcpy(&vm->dstack[vm->dsp - (2 * operand)], &vm->dstack[vm->dsp - operand], swap_sz);
-        memcpy(&vm->dstack[vm->dsp - operand], temp, swap_sz);
-
-
-        // LopsinValue temp = vm->dstack[vm->dsp - 1];
-        // vm->dstack[vm->dsp - 1] = vm->dstack[vm->dsp - 2];
-        // vm->dstack[vm->dsp - 2] = temp;
+        // in place, a VM serving request after request can't leak a buffer per swap
+        LopsinValue *a = &vm->dstack[vm->dsp - (2 * operand)];
+        LopsinValue *b = &vm->dstack[vm->dsp - operand];
+        for (size_t i = 0; i < operand; i++) {
+            LopsinValue temp = a[i];
+            a[i] = b[i];
+            b[i] = temp;
+        }
 
         vm->ip++;
     } break;
@@ -340,7 +853,7 @@ LopsinErr lopsinvm_run_inst(LopsinVM *vm)
         if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
         uint8_t *ptr = vm->dstack[--vm->dsp].as_ptr;
 
-        if (!lopsinvm_chkmem(vm, ptr, NULL)) return ERR_BAD_MEM_PTR;
+        if (lopsinvm_readable_bytes(vm, ptr) < sizeof(*ptr)) return ERR_BAD_MEM_PTR;
 
         // there should be space, since we popped one
         assert(vm->dsp < vm->dstack_cap);
@@ -352,7 +865,7 @@ LopsinErr lopsinvm_run_inst(LopsinVM *vm)
         if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
         uint16_t *ptr = vm->dstack[--vm->dsp].as_ptr;
 
-        if (!lopsinvm_chkmem(vm, ptr, NULL)) return ERR_BAD_MEM_PTR;
+        if (lopsinvm_readable_bytes(vm, ptr) < sizeof(*ptr)) return ERR_BAD_MEM_PTR;
 
         // there should be space, since we popped one
         assert(vm->dsp < vm->dstack_cap);
@@ -364,7 +877,7 @@ LopsinErr lopsinvm_run_inst(LopsinVM *vm)
         if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
         uint32_t *ptr = vm->dstack[--vm->dsp].as_ptr;
 
-        if (!lopsinvm_chkmem(vm, ptr, NULL)) return ERR_BAD_MEM_PTR;
+        if (lopsinvm_readable_bytes(vm, ptr) < sizeof(*ptr)) return ERR_BAD_MEM_PTR;
 
         // there should be space, since we popped one
         assert(vm->dsp < vm->dstack_cap);
@@ -376,7 +889,7 @@ LopsinErr lopsinvm_run_inst(LopsinVM *vm)
         if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
         uint64_t *ptr = vm->dstack[--vm->dsp].as_ptr;
 
-        if (!lopsinvm_chkmem(vm, ptr, NULL)) return ERR_BAD_MEM_PTR;
+        if (lopsinvm_readable_bytes(vm, ptr) < sizeof(*ptr)) return ERR_BAD_MEM_PTR;
 
         // there should be space, since we popped one
         assert(vm->dsp < vm->dstack_cap);
@@ -625,155 +1138,1298 @@ LopsinErr lopsinvm_run_inst(LopsinVM *vm)
     } break;
 
     case LOPSIN_INST_CALL: {
-        if (vm->rsp >= vm->rstack_cap) return ERR_RSTACK_OVERFLOW;
-
+        // overflow hits the guard page, see lopsinvm_start()
         vm->rstack[vm->rsp++] = vm->ip + 1;
         vm->ip = inst.operand.as_i64;
     } break;
 
     case LOPSIN_INST_RET: {
-        if (vm->rsp <= 0) return ERR_RSTACK_UNDERFLOW;
+        if (vm->rsp <= 0) {
+            // returning from the entry point of a fiber ends it
+            return vm->fiber != 0 && vm->callbacks == 0 ? lopsinvm_fiber_exit(vm) : ERR_RSTACK_UNDERFLOW;
+        }
 
         vm->ip = vm->rstack[--vm->rsp];
     } break;
 
     case LOPSIN_INST_NCALL: {
-        LopsinNativeType idx = inst.operand.as_i64;
-        if (idx < 0 || idx > COUNT_LOPSIN_NATIVES) return ERR_INVALID_OPERAND;
+        uint64_t idx = inst.operand.as_i64;
+        if (idx >= vm->program->natives_count) return ERR_INVALID_OPERAND;
+
+        const LopsinNative *native = &vm->program->natives[idx];
 
-        LopsinNative native = LOPSIN_NATIVES[idx];
-        LopsinErr errlvl = (*native.proc)(vm);
+        // checked once here rather than by every native, see LopsinNativeProc
+        if (vm->dsp < native->arity) return ERR_DSTACK_UNDERFLOW;
+        size_t args = vm->dsp - native->arity;
+        if (args + native->results > vm->dstack_cap) return ERR_DSTACK_OVERFLOW;
+
+        LopsinErr errlvl = (*native->proc)(vm, &vm->dstack[args]);
         if (errlvl != ERR_OK) return errlvl;
 
+        vm->dsp = args + native->results;
         vm->ip++;
         // if the natives want to keep the ip they can just ip-- it.
     } break;
 
-    default: {
-        return ERR_ILLEGAL_INST;
-    }
-    }
+    case LOPSIN_INST_ENTER: {
+        if (inst.operand.as_i64 < 0) {
+            return ERR_INVALID_OPERAND;
+        }
 
-    return ERR_OK;
-}
+        const size_t count = (size_t) inst.operand.as_i64;
+        if (vm->lsp + count + 1 > vm->lstack_cap) {
+            return ERR_LSTACK_OVERFLOW;
+        }
 
-void lopsinvalue_print(FILE *stream, LopsinValue value)
-{
-    fprintf(stream, "%"PRId64"\t%lf\t%p",
-                    value.as_i64,
-                    value.as_f64,
-                    value.as_ptr);
-}
+        vm->lstack[vm->lsp].as_i64 = vm->fp;
+        vm->fp = vm->lsp + 1;
+        vm->lsp = vm->fp + count;
+        memset(&vm->lstack[vm->fp], 0, count * sizeof(LopsinValue));
 
-LopsinErr lopsinvm_start(LopsinVM *vm)
-{
-    LopsinErr err = 0;
+        vm->ip++;
+    } break;
 
-    vm->running = true;
+    case LOPSIN_INST_LEAVE: {
+        if (vm->fp == 0) return ERR_LSTACK_UNDERFLOW;
+
+        vm->lsp = vm->fp - 1;
+        vm->fp = vm->lstack[vm->lsp].as_i64;
+        vm->ip++;
+    } break;
 
-    while (vm->running) {
-        err = lopsinvm_run_inst(vm);
-        if (err) {
-            fprintf(stderr, "ERROR: At inst %zu: %s\n", vm->ip, ERR_AS_CSTR(err));
-            vm->running = false;
+    case LOPSIN_INST_LOCAL_GET: {
+        if ((uint64_t) inst.operand.as_i64 >= vm->lsp - vm->fp) {
+            return ERR_INVALID_OPERAND;
         }
-    }
 
-    return err;
-}
+        vm->dstack[vm->dsp++] = vm->lstack[vm->fp + inst.operand.as_i64];
+        vm->ip++;
+    } break;
 
-void lopsinvm_new(LopsinVM *out_vm)
-{
-    if (out_vm) *out_vm = (LopsinVM) {
-        .debug_mode = false,
-        .running = false,
+    case LOPSIN_INST_LOCAL_SET: {
+        if ((uint64_t) inst.operand.as_i64 >= vm->lsp - vm->fp) {
+            return ERR_INVALID_OPERAND;
+        }
 
-        .ip = 0,
-        .program = {
-            .insts = NULL,
-            .count = 0,
-            .cap = 0,
-        },
+        if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
 
-        .dsp = 0,
-        .dstack = NOTNULL(calloc(LOPSINVM_DEFAULT_DSTACK_CAP, sizeof(LopsinValue))),
-        .dstack_cap = LOPSINVM_DEFAULT_DSTACK_CAP,
+        vm->lstack[vm->fp + inst.operand.as_i64] = vm->dstack[--vm->dsp];
+        vm->ip++;
+    } break;
 
-        .rsp = 0,
-        .rstack = NOTNULL(calloc(LOPSINVM_DEFAULT_RSTACK_CAP, sizeof(size_t))),
-        .rstack_cap = LOPSINVM_DEFAULT_RSTACK_CAP,
+    case LOPSIN_INST_JIGT: {
+        COMPARE_AND_JUMP(vm, inst, i64, >);
+    } break;
 
-        .alloced = {0},
-        .alloced_count = 0,
-    };
-}
+    case LOPSIN_INST_JILT: {
+        COMPARE_AND_JUMP(vm, inst, i64, <);
+    } break;
 
-void lopsinvm_free(LopsinVM *vm)
-{
-    assert(!vm->running);
+    case LOPSIN_INST_JIGTE: {
+        COMPARE_AND_JUMP(vm, inst, i64, >=);
+    } break;
 
-    for (size_t i = 0; i < vm->alloced_count; i++) {
-        free(vm->alloced[i].ptr);
-    }
+    case LOPSIN_INST_JILTE: {
+        COMPARE_AND_JUMP(vm, inst, i64, <=);
+    } break;
 
-    free(vm->dstack);
-    free(vm->rstack);
-    free(vm->program.insts);
-}
+    case LOPSIN_INST_JIEQ: {
+        COMPARE_AND_JUMP(vm, inst, i64, ==);
+    } break;
 
-static inline bool sv_try_chop_by_sv_left(String_View *sv,
-                                   const String_View thicc_delim,
-                                   String_View *out)
-{
-    String_View window = sv_from_parts(sv->data, thicc_delim.count);
-    size_t i = 0;
-    while (i + thicc_delim.count < sv->count
-        && !(sv_eq(window, thicc_delim)))
-    {
-        i++;
-        window.data++;
-    }
+    case LOPSIN_INST_JINEQ: {
+        COMPARE_AND_JUMP(vm, inst, i64, !=);
+    } break;
 
-    String_View result = sv_from_parts(sv->data, i);
+    case LOPSIN_INST_JFGT: {
+        COMPARE_AND_JUMP(vm, inst, f64, >);
+    } break;
 
-    if (i + thicc_delim.count == sv->count) {
-        return false;
-    }
+    case LOPSIN_INST_JFLT: {
+        COMPARE_AND_JUMP(vm, inst, f64, <);
+    } break;
 
-    // Chop!
-    sv->data  += i + thicc_delim.count;
-    sv->count -= i + thicc_delim.count;
+    case LOPSIN_INST_JFGTE: {
+        COMPARE_AND_JUMP(vm, inst, f64, >=);
+    } break;
 
-    if (out) *out = result;
-    return true;
-}
+    case LOPSIN_INST_JFLTE: {
+        COMPARE_AND_JUMP(vm, inst, f64, <=);
+    } break;
 
-void lopsinvm_load_program_from_file(LopsinVM *vm, const char *path)
-{
-    Buffer *buf = new_buffer(0);
+    case LOPSIN_INST_JFEQ: {
+        COMPARE_AND_JUMP(vm, inst, f64, ==);
+    } break;
 
-    buffer_append_file(buf, path);
+    case LOPSIN_INST_JFNEQ: {
+        COMPARE_AND_JUMP(vm, inst, f64, !=);
+    } break;
 
-    String_View bytecode = sv_from_parts(buf->data, buf->size);
-    const String_View magic = SV_STATIC(LOPSINVM_BYTECODE_MAGIC);
+    case LOPSIN_INST_JIGTI: {
+        COMPARE_IMM_AND_JUMP(vm, inst, >);
+    } break;
+
+    case LOPSIN_INST_JILTI: {
+        COMPARE_IMM_AND_JUMP(vm, inst, <);
+    } break;
+
+    case LOPSIN_INST_JIGTEI: {
+        COMPARE_IMM_AND_JUMP(vm, inst, >=);
+    } break;
 
-    if (sv_try_chop_by_sv_left(&bytecode, magic, NULL)) {
-        size_t count = bytecode.count / sizeof(LopsinInst);
-        LopsinVMProgram program = {
-            .cap   = count,
-            .count = count,
-            .insts = NOTNULL(malloc(bytecode.count)),
-        };
+    case LOPSIN_INST_JILTEI: {
+        COMPARE_IMM_AND_JUMP(vm, inst, <=);
+    } break;
+
+    case LOPSIN_INST_JIEQI: {
+        COMPARE_IMM_AND_JUMP(vm, inst, ==);
+    } break;
+
+    case LOPSIN_INST_JINEQI: {
+        COMPARE_IMM_AND_JUMP(vm, inst, !=);
+    } break;
+
+    case LOPSIN_INST_JMPTAB: {
+        if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
 
-        memcpy(program.insts, bytecode.data, bytecode.count);
+        // the table itself was checked by lopsinvm_verify_program()
+        const LopsinJmpTab *table = (const LopsinJmpTab *)
+            ((const char *) vm->program->data + inst.operand.as_i64);
+        uint64_t idx = vm->dstack[--vm->dsp].as_i64;
 
-        vm->program = program;
+        vm->ip = idx < table->count ? table->targets[idx] : table->default_target;
+    } break;
+
+    case LOPSIN_INST_PUSHD: {
+        // the offset was checked by lopsinvm_verify_program()
+        vm->dstack[vm->dsp++].as_ptr = (char *) vm->program->data + inst.operand.as_i64;
+        vm->ip++;
+    } break;
+
+    case LOPSIN_INST_SPAWN: {
+        return lopsinvm_spawn(vm, inst);
+    } break;
+
+    case LOPSIN_INST_YIELD: {
+        vm->ip++;
+        if (vm->fibers != NULL && vm->callbacks == 0) lopsinvm_switch_fiber(vm);
+    } break;
+
+    case LOPSIN_INST_JOIN: {
+        return lopsinvm_join(vm);
+    } break;
+
+    case LOPSIN_INST_ATOMIC_LOAD32: {
+        ATOMIC_LOAD(vm, inst, uint32_t);
+    } break;
+
+    case LOPSIN_INST_ATOMIC_LOAD64: {
+        ATOMIC_LOAD(vm, inst, uint64_t);
+    } break;
+
+    case LOPSIN_INST_ATOMIC_STORE32: {
+        ATOMIC_STORE(vm, inst, uint32_t);
+    } break;
+
+    case LOPSIN_INST_ATOMIC_STORE64: {
+        ATOMIC_STORE(vm, inst, uint64_t);
+    } break;
+
+    case LOPSIN_INST_ATOMIC_ADD32: {
+        ATOMIC_RMW(vm, inst, uint32_t, atomic_fetch_add_explicit);
+    } break;
+
+    case LOPSIN_INST_ATOMIC_ADD64: {
+        ATOMIC_RMW(vm, inst, uint64_t, atomic_fetch_add_explicit);
+    } break;
+
+    case LOPSIN_INST_ATOMIC_XCHG32: {
+        ATOMIC_RMW(vm, inst, uint32_t, atomic_exchange_explicit);
+    } break;
+
+    case LOPSIN_INST_ATOMIC_XCHG64: {
+        ATOMIC_RMW(vm, inst, uint64_t, atomic_exchange_explicit);
+    } break;
+
+    case LOPSIN_INST_ATOMIC_CAS32: {
+        ATOMIC_CAS(vm, inst, uint32_t);
+    } break;
+
+    case LOPSIN_INST_ATOMIC_CAS64: {
+        ATOMIC_CAS(vm, inst, uint64_t);
+    } break;
+
+    default: {
+        return ERR_ILLEGAL_INST;
+    }
+    }
+
+    return ERR_OK;
+}
+
+void lopsinvalue_print(FILE *stream, LopsinValue value)
+{
+    fprintf(stream, "%"PRId64"\t%lf\t%p",
+                    value.as_i64,
+                    value.as_f64,
+                    value.as_ptr);
+}
+
+// The VM running on this thread, so that a fault on one of its guard pages can be turned into an error.
+static _Thread_local struct {
+    LopsinVM *vm;
+    sigjmp_buf env;
+} lopsinvm_running_here;
+
+static size_t lopsinvm_page_size;
+// What handled SIGSEGV before the VM did, for the faults that aren't on a guard page.
+static struct sigaction lopsinvm_previous_sigsegv;
+
+static bool is_guard_page(const void *stack, size_t cap, size_t elem_size, uintptr_t addr)
+{
+    uintptr_t guard = (uintptr_t) stack + cap * elem_size;
+    return guard <= addr && addr < guard + lopsinvm_page_size;
+}
+
+static void lopsinvm_handle_sigsegv(int sig, siginfo_t *info, void *ucontext)
+{
+    LopsinVM *vm = lopsinvm_running_here.vm;
+    uintptr_t addr = (uintptr_t) info->si_addr;
+
+    if (vm != NULL) {
+        if (is_guard_page(vm->dstack, vm->dstack_cap, sizeof(*vm->dstack), addr)) {
+            siglongjmp(lopsinvm_running_here.env, ERR_DSTACK_OVERFLOW);
+        }
+        if (is_guard_page(vm->rstack, vm->rstack_cap, sizeof(*vm->rstack), addr)) {
+            siglongjmp(lopsinvm_running_here.env, ERR_RSTACK_OVERFLOW);
+        }
+    }
+
+    // not ours, hand it to whoever the host installed
+    const struct sigaction *previous = &lopsinvm_previous_sigsegv;
+    if ((previous->sa_flags & SA_SIGINFO) != 0) {
+        previous->sa_sigaction(sig, info, ucontext);
+    } else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) {
+        previous->sa_handler(sig);
     } else {
-        fprintf(stderr, "ERROR: Could not load program from file %s: %s\n",
-                path, "Incorrect format");
+        // fault again and crash like we would have without the handler, a fault can't be ignored
+        signal(sig, SIG_DFL);
+    }
+}
+
+static void install_guard_handler_once(void)
+{
+    lopsinvm_page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+    // SA_NODEFER leaves SIGSEGV unblocked after jumping out of the handler,
+    // so sigsetjmp() doesn't need to save the signal mask (a syscall).
+    struct sigaction action = {0};
+    action.sa_sigaction = &lopsinvm_handle_sigsegv;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGSEGV, &action, &lopsinvm_previous_sigsegv) != 0) {
+        fprintf(stderr, "ERROR: Could not install SIGSEGV handler: %s\n", strerror(errno));
         exit(1);
     }
+}
+
+static void install_guard_handler(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, &install_guard_handler_once);
+}
+
+// Maps room for at least `count` elements of `elem_size` bytes, followed by a PROT_NONE guard page.
+// The whole pages before the guard are usable, and their element count is returned in out_cap.
+static void *map_stack(size_t count, size_t elem_size, size_t *out_cap)
+{
+    size_t page = lopsinvm_page_size;
+    size_t bytes = (count * elem_size + page - 1) / page * page;
+    if (bytes == 0) bytes = page;
+    assert(bytes % elem_size == 0);
+
+    char *stack = mmap(NULL, bytes + page, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map VM stack: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (mprotect(stack + bytes, page, PROT_NONE) != 0) {
+        fprintf(stderr, "ERROR: Could not protect VM stack guard page: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (out_cap) *out_cap = bytes / elem_size;
+    return stack;
+}
+
+static void unmap_stack(void *stack, size_t cap, size_t elem_size)
+{
+    munmap(stack, cap * elem_size + lopsinvm_page_size);
+}
+
+static void fiber_save(const LopsinVM *vm, LopsinFiber *fiber)
+{
+    fiber->ip = vm->ip;
+    fiber->dstack = vm->dstack;
+    fiber->dstack_cap = vm->dstack_cap;
+    fiber->dsp = vm->dsp;
+    fiber->rstack = vm->rstack;
+    fiber->rstack_cap = vm->rstack_cap;
+    fiber->rsp = vm->rsp;
+    fiber->lstack = vm->lstack;
+    fiber->lstack_cap = vm->lstack_cap;
+    fiber->lsp = vm->lsp;
+    fiber->fp = vm->fp;
+}
+
+static void fiber_load(LopsinVM *vm, const LopsinFiber *fiber)
+{
+    vm->ip = fiber->ip;
+    vm->dstack = fiber->dstack;
+    vm->dstack_cap = fiber->dstack_cap;
+    vm->dsp = fiber->dsp;
+    vm->rstack = fiber->rstack;
+    vm->rstack_cap = fiber->rstack_cap;
+    vm->rsp = fiber->rsp;
+    vm->lstack = fiber->lstack;
+    vm->lstack_cap = fiber->lstack_cap;
+    vm->lsp = fiber->lsp;
+    vm->fp = fiber->fp;
+}
+
+static uint64_t fiber_id(const LopsinVM *vm, size_t idx)
+{
+    return (uint64_t) vm->fibers[idx].generation << 32 | idx;
+}
+
+// Switches to the next runnable fiber after the running one, round robin.
+// Returns false if there is no other, in which case the running one keeps running.
+static bool lopsinvm_switch_fiber(LopsinVM *vm)
+{
+    for (size_t i = 1; i < vm->fibers_count; i++) {
+        size_t next = (vm->fiber + i) % vm->fibers_count;
+        if (vm->fibers[next].state != LOPSIN_FIBER_RUNNABLE) continue;
+
+        fiber_save(vm, &vm->fibers[vm->fiber]);
+        fiber_load(vm, &vm->fibers[next]);
+        vm->fiber = next;
+        return true;
+    }
+    return false;
+}
+
+void lopsinvm_rotate_fibers(LopsinVM *vm)
+{
+    assert(!vm->running);
+    if (vm->fibers != NULL) lopsinvm_switch_fiber(vm);
+}
+
+// Finds a slot for a new fiber, reusing the stacks of one that was joined if there is any.
+static size_t lopsinvm_fiber_slot(LopsinVM *vm)
+{
+    if (vm->fibers == NULL) {
+        vm->fibers_cap = LOPSINVM_FIBERS_INITIAL_CAP;
+        vm->fibers = NOTNULL(calloc(vm->fibers_cap, sizeof(LopsinFiber)));
+        // the fiber the VM started with, its state is saved on the first switch
+        vm->fibers[0].state = LOPSIN_FIBER_RUNNABLE;
+        vm->fibers_count = 1;
+        vm->fiber = 0;
+    }
+
+    for (size_t i = 1; i < vm->fibers_count; i++) {
+        if (vm->fibers[i].state == LOPSIN_FIBER_FREE) return i;
+    }
+
+    if (vm->fibers_count >= vm->fibers_cap) {
+        vm->fibers_cap *= 2;
+        vm->fibers = NOTNULL(realloc(vm->fibers, vm->fibers_cap * sizeof(LopsinFiber)));
+    }
+
+    LopsinFiber *fiber = &vm->fibers[vm->fibers_count];
+    *fiber = (LopsinFiber) {0};
+    fiber->dstack = map_stack(LOPSINVM_FIBER_DSTACK_CAP, sizeof(LopsinValue), &fiber->dstack_cap);
+    fiber->rstack = map_stack(LOPSINVM_FIBER_RSTACK_CAP, sizeof(size_t), &fiber->rstack_cap);
+    fiber->lstack = map_stack(LOPSINVM_FIBER_LSTACK_CAP, sizeof(LopsinValue), &fiber->lstack_cap);
+
+    return vm->fibers_count++;
+}
+
+// `spawn n L`
+static LopsinErr lopsinvm_spawn(LopsinVM *vm, LopsinInst inst)
+{
+    size_t argc = inst.imm;
+    if (vm->dsp < argc) return ERR_DSTACK_UNDERFLOW;
+
+    size_t idx = lopsinvm_fiber_slot(vm);
+    LopsinFiber *fiber = &vm->fibers[idx];
+    if (argc > fiber->dstack_cap) return ERR_DSTACK_OVERFLOW;
+
+    fiber->state = LOPSIN_FIBER_RUNNABLE;
+    fiber->generation++;
+    fiber->ip = inst.operand.as_i64;
+    fiber->rsp = 0;
+    fiber->lsp = 0;
+    fiber->fp = 0;
+
+    vm->dsp -= argc;
+    memcpy(fiber->dstack, &vm->dstack[vm->dsp], argc * sizeof(LopsinValue));
+    fiber->dsp = argc;
+
+    vm->dstack[vm->dsp++].as_i64 = fiber_id(vm, idx);
+    vm->ip++;
+    return ERR_OK;
+}
+
+// `join` doesn't move past itself until the fiber is done. A fiber waiting in it
+// runs it again once woken up, and finds the fiber done then.
+static LopsinErr lopsinvm_join(LopsinVM *vm)
+{
+    if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
+
+    uint64_t id = vm->dstack[vm->dsp - 1].as_i64;
+    size_t idx = id & UINT32_MAX;
+
+    // fiber 0 never returns, so it can't be joined
+    if (vm->fibers == NULL || idx == 0 || idx >= vm->fibers_count || idx == vm->fiber
+     || vm->fibers[idx].state == LOPSIN_FIBER_FREE || fiber_id(vm, idx) != id)
+    {
+        return ERR_BAD_FIBER;
+    }
+
+    LopsinFiber *fiber = &vm->fibers[idx];
+    if (fiber->state == LOPSIN_FIBER_DONE) {
+        vm->dstack[vm->dsp - 1] = fiber->result;
+        fiber->state = LOPSIN_FIBER_FREE;
+        vm->ip++;
+        return ERR_OK;
+    }
+
+    // the other fibers can't run until the native that called back returns
+    if (vm->callbacks > 0) return ERR_DEADLOCK;
+
+    LopsinFiber *self = &vm->fibers[vm->fiber];
+    self->state = LOPSIN_FIBER_JOINING;
+    self->joining = id;
+    if (!lopsinvm_switch_fiber(vm)) {
+        self->state = LOPSIN_FIBER_RUNNABLE;
+        return ERR_DEADLOCK;
+    }
+    return ERR_OK;
+}
+
+static LopsinErr lopsinvm_fiber_exit(LopsinVM *vm)
+{
+    LopsinFiber *self = &vm->fibers[vm->fiber];
+    self->state = LOPSIN_FIBER_DONE;
+    self->result = vm->dsp > 0 ? vm->dstack[vm->dsp - 1] : (LopsinValue) {0};
+
+    uint64_t id = fiber_id(vm, vm->fiber);
+    for (size_t i = 0; i < vm->fibers_count; i++) {
+        if (vm->fibers[i].state == LOPSIN_FIBER_JOINING && vm->fibers[i].joining == id) {
+            vm->fibers[i].state = LOPSIN_FIBER_RUNNABLE;
+        }
+    }
+
+    if (!lopsinvm_switch_fiber(vm)) return ERR_DEADLOCK;
+    return ERR_OK;
+}
+
+// Goes back to the fiber the VM started with, and unmaps the stacks of all the others.
+static void lopsinvm_drop_fibers(LopsinVM *vm)
+{
+    if (vm->fibers == NULL) return;
+
+    if (vm->fiber != 0) {
+        fiber_save(vm, &vm->fibers[vm->fiber]);
+        fiber_load(vm, &vm->fibers[0]);
+    }
+
+    for (size_t i = 1; i < vm->fibers_count; i++) {
+        LopsinFiber *fiber = &vm->fibers[i];
+        unmap_stack(fiber->dstack, fiber->dstack_cap, sizeof(*fiber->dstack));
+        unmap_stack(fiber->rstack, fiber->rstack_cap, sizeof(*fiber->rstack));
+        unmap_stack(fiber->lstack, fiber->lstack_cap, sizeof(*fiber->lstack));
+    }
+
+    free(vm->fibers);
+    vm->fibers = NULL;
+    vm->fibers_count = 0;
+    vm->fibers_cap = 0;
+    vm->fiber = 0;
+}
+
+// Pushes onto the data and return stacks don't compare against their caps. Instead, the
+// pages right after the stacks are PROT_NONE, and the fault of a push past the end is
+// turned into ERR_DSTACK_OVERFLOW or ERR_RSTACK_OVERFLOW here.
+LopsinRunStatus lopsinvm_run_for(LopsinVM *vm, size_t max_steps, LopsinErr *out_err)
+{
+    if (out_err) *out_err = ERR_OK;
+
+    if (vm->halted) {
+        if (out_err) *out_err = ERR_HALTED;
+        return LOPSIN_RUN_HALTED;
+    }
+
+    assert(!vm->running && "lopsinvm_run_for() is not reentrant");
+    assert(vm->insts != NULL && "No program attached");
+    vm->running = true;
+
+    // a native may run another VM (or call back into this one) on the same thread
+    LopsinVM *volatile outer = lopsinvm_running_here.vm;
+    sigjmp_buf outer_env;
+    if (outer != NULL) memcpy(outer_env, lopsinvm_running_here.env, sizeof(sigjmp_buf));
+    lopsinvm_running_here.vm = vm;
+
+    volatile LopsinRunStatus status = LOPSIN_RUN_BUDGET_EXHAUSTED;
+    volatile LopsinErr err = ERR_OK;
+
+    int fault = sigsetjmp(lopsinvm_running_here.env, 0);
+    if (fault != 0) {
+        status = LOPSIN_RUN_ERROR;
+        err = fault;
+        vm->halted = true;
+    } else {
+        // fibers that found their native would block in a row, see below
+        size_t blocked = 0;
+        // whether any of them can be woken up by another thread
+        bool wakeable = false;
+        vm->wakeable = false;
+
+        for (size_t steps = 0; steps < max_steps; steps++) {
+            LopsinErr step_err = lopsinvm_step(vm);
+            if (step_err == ERR_OK) {
+                blocked = 0;
+                wakeable = false;
+                continue;
+            }
+
+            if (step_err == ERR_HALTED) {
+                status = LOPSIN_RUN_HALTED;
+                vm->halted = true;
+            } else if (step_err == ERR_WOULD_BLOCK) {
+                wakeable = wakeable || vm->wakeable;
+                vm->wakeable = false;
+                // let the other fibers run, and only stop once they all would block
+                if (++blocked < vm->fibers_count && vm->callbacks == 0 && lopsinvm_switch_fiber(vm)) continue;
+                status = LOPSIN_RUN_WAITING;
+                vm->wakeable = wakeable;
+            } else {
+                status = LOPSIN_RUN_ERROR;
+                err = step_err;
+                vm->halted = true;
+            }
+            break;
+        }
+    }
+
+    lopsinvm_running_here.vm = outer;
+    if (outer != NULL) memcpy(lopsinvm_running_here.env, outer_env, sizeof(sigjmp_buf));
+    vm->running = false;
+
+    if (out_err) *out_err = err;
+    return status;
+}
+
+LopsinErr lopsinvm_run_inst(LopsinVM *vm)
+{
+    LopsinErr err;
+    lopsinvm_run_for(vm, 1, &err);
+    return err;
+}
+
+// Steps per lopsinvm_run_for() call in lopsinvm_start(), only to bound the time between
+// checks of the status. Nothing else needs to run in between.
+#define LOPSINVM_START_SLICE (1024 * 1024)
+
+// The subroutine returns to one past the last instruction, where the VM stops with ERR_BAD_INST_PTR.
+LopsinErr lopsinvm_call(LopsinVM *vm, size_t addr)
+{
+    assert(!vm->running);
+    assert(vm->insts != NULL && "No program attached");
+
+    if (vm->rsp >= vm->rstack_cap) return ERR_RSTACK_OVERFLOW;
+
+    size_t ip = vm->ip;
+    size_t rsp = vm->rsp;
+    bool halted = vm->halted;
+
+    vm->rstack[vm->rsp++] = vm->inst_count;
+    vm->ip = addr;
+    vm->halted = false;
+
+    LopsinErr err;
+    LopsinRunStatus status;
+    do {
+        status = lopsinvm_run_for(vm, LOPSINVM_START_SLICE, &err);
+    } while (status == LOPSIN_RUN_BUDGET_EXHAUSTED);
+
+    if (status == LOPSIN_RUN_HALTED) {
+        err = ERR_HALTED;
+    } else if (status == LOPSIN_RUN_WAITING) {
+        err = ERR_WOULD_BLOCK;
+    } else if (err == ERR_BAD_INST_PTR && vm->ip == vm->inst_count && vm->rsp == rsp) {
+        err = ERR_OK;
+    }
+
+    if (err != ERR_OK) return err;
+
+    vm->ip = ip;
+    vm->halted = halted;
+    return ERR_OK;
+}
+
+LopsinErr lopsinvm_callback(LopsinVM *vm, size_t addr)
+{
+    assert(vm->running && "Not called from a native");
+
+    vm->running = false;
+    vm->callbacks++;
+    LopsinErr err = lopsinvm_call(vm, addr);
+    vm->callbacks--;
+    vm->running = true;
+
+    // the native can't be retried from scratch once the subroutine did part of its work
+    if (err == ERR_WOULD_BLOCK) err = ERR_DEADLOCK;
+    return err;
+}
+
+enum {
+    LOPSINVM_AWAKE = 0,
+    LOPSINVM_PARKED,
+    LOPSINVM_WOKEN,
+};
+
+bool lopsinvm_park(LopsinVM *vm)
+{
+    int expected = LOPSINVM_AWAKE;
+    if (atomic_compare_exchange_strong(&vm->park, &expected, LOPSINVM_PARKED)) return true;
+
+    // woken while it was running
+    atomic_store(&vm->park, LOPSINVM_AWAKE);
+    return false;
+}
+
+void lopsinvm_wake(LopsinVM *vm)
+{
+    if (atomic_exchange(&vm->park, LOPSINVM_WOKEN) == LOPSINVM_PARKED) {
+        atomic_store(&vm->park, LOPSINVM_AWAKE);
+        if (vm->wake) vm->wake(vm, vm->wake_user);
+    }
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool woken;
+} Start_Waiter;
+
+static void lopsinvm_start_wake(LopsinVM *vm, void *user)
+{
+    (void) vm;
+    Start_Waiter *waiter = user;
+
+    pthread_mutex_lock(&waiter->lock);
+    waiter->woken = true;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+LopsinErr lopsinvm_start(LopsinVM *vm)
+{
+    LopsinErr err = ERR_OK;
+    LopsinRunStatus status;
+
+    Start_Waiter waiter = { .woken = false };
+    pthread_mutex_init(&waiter.lock, NULL);
+    pthread_cond_init(&waiter.cond, NULL);
+    assert(vm->wake == NULL && "lopsinvm_start() waits for the VM to be woken up itself");
+    vm->wake = &lopsinvm_start_wake;
+    vm->wake_user = &waiter;
+
+    do {
+        status = lopsinvm_run_for(vm, LOPSINVM_START_SLICE, &err);
+        // so that a fiber that never yields can't starve the others
+        if (status == LOPSIN_RUN_BUDGET_EXHAUSTED) lopsinvm_rotate_fibers(vm);
+
+        if (status == LOPSIN_RUN_WAITING) {
+            // nothing else runs on this thread, and no other thread can make progress for it
+            if (!vm->wakeable) {
+                status = LOPSIN_RUN_ERROR;
+                err = ERR_DEADLOCK;
+                break;
+            }
+
+            if (lopsinvm_park(vm)) {
+                pthread_mutex_lock(&waiter.lock);
+                while (!waiter.woken) pthread_cond_wait(&waiter.cond, &waiter.lock);
+                waiter.woken = false;
+                pthread_mutex_unlock(&waiter.lock);
+            }
+        }
+    } while (status == LOPSIN_RUN_BUDGET_EXHAUSTED || status == LOPSIN_RUN_WAITING);
+
+    vm->wake = NULL;
+    vm->wake_user = NULL;
+    pthread_mutex_destroy(&waiter.lock);
+    pthread_cond_destroy(&waiter.cond);
+
+    if (status == LOPSIN_RUN_ERROR) {
+        fprintf(stderr, "ERROR: At inst %zu: %s\n", vm->ip, ERR_AS_CSTR(err));
+    }
+
+    return err;
+}
+
+void lopsinvm_new(LopsinVM *out_vm)
+{
+    lopsinvm_new_with_stacks(out_vm, LOPSINVM_DEFAULT_DSTACK_CAP, LOPSINVM_DEFAULT_RSTACK_CAP);
+}
+
+void lopsinvm_new_with_stacks(LopsinVM *out_vm, size_t dstack_cap, size_t rstack_cap)
+{
+    install_guard_handler();
+
+    if (out_vm == NULL) return;
+
+    LopsinValue *dstack = map_stack(dstack_cap, sizeof(LopsinValue), &dstack_cap);
+    size_t *rstack = map_stack(rstack_cap, sizeof(size_t), &rstack_cap);
+    // overflowing the locals stack is checked by `enter`, it is mapped only to commit its pages lazily
+    size_t lstack_cap;
+    LopsinValue *lstack = map_stack(LOPSINVM_DEFAULT_LSTACK_CAP, sizeof(LopsinValue), &lstack_cap);
+
+    *out_vm = (LopsinVM) {
+        .insts = NULL,
+        .inst_count = 0,
+        .ip = 0,
+
+        .dsp = 0,
+        .dstack = dstack,
+        .dstack_cap = dstack_cap,
+
+        .rsp = 0,
+        .rstack = rstack,
+        .rstack_cap = rstack_cap,
+
+        .debug_mode = false,
+        .running = false,
+        .halted = false,
+
+        .lsp = 0,
+        .fp = 0,
+        .lstack = lstack,
+        .lstack_cap = lstack_cap,
+
+        .program = NULL,
+
+        .in = stdin,
+        .out = stdout,
+
+        .heap = {0},
+
+        .fibers = NULL,
+        .fibers_count = 0,
+        .fibers_cap = 0,
+        .fiber = 0,
+
+        .chans = {0},
+
+        .maps = {0},
+
+        .vecs = {0},
+
+        .parent = NULL,
+        .callbacks = 0,
+
+        .park = LOPSINVM_AWAKE,
+        .wake = NULL,
+        .wake_user = NULL,
+        .wakeable = false,
+    };
+}
+
+// Frees everything the program left behind, but the stacks.
+static void lopsinvm_free_program_state(LopsinVM *vm)
+{
+    lopsinvm_drop_fibers(vm);
+
+    for (size_t i = 0; i < vm->chans.count; i++) {
+        LopsinChan *chan = vm->chans.items[i];
+        // the other end must not wake up a VM that is gone
+        LopsinVM *expected = vm;
+        atomic_compare_exchange_strong(&chan->send_waiter, &expected, NULL);
+        expected = vm;
+        atomic_compare_exchange_strong(&chan->recv_waiter, &expected, NULL);
+
+        lopsin_chan_release(chan);
+    }
+    handle_table_free(&vm->chans);
+
+    for (size_t i = 0; i < vm->maps.count; i++) {
+        lopsin_map_free(vm->maps.items[i]);
+    }
+    handle_table_free(&vm->maps);
+
+    // their elements are in the heap, freed below
+    for (size_t i = 0; i < vm->vecs.count; i++) {
+        free(vm->vecs.items[i]);
+    }
+    handle_table_free(&vm->vecs);
+
+    for (size_t i = 0; i < vm->heap.count; i++) {
+        free(vm->heap.chunks[i].ptr);
+    }
+    free(vm->heap.chunks);
+
+    if (vm->program) lopsin_program_release(vm->program);
+}
+
+void lopsinvm_free(LopsinVM *vm)
+{
+    assert(!vm->running);
+
+    lopsinvm_free_program_state(vm);
+
+    unmap_stack(vm->dstack, vm->dstack_cap, sizeof(*vm->dstack));
+    unmap_stack(vm->rstack, vm->rstack_cap, sizeof(*vm->rstack));
+    unmap_stack(vm->lstack, vm->lstack_cap, sizeof(*vm->lstack));
+}
+
+void lopsinvm_reset(LopsinVM *vm)
+{
+    assert(!vm->running);
+
+    lopsinvm_free_program_state(vm);
+
+    // the pages of the stacks stay committed, which is what makes reusing a VM cheap
+    LopsinVM reset = {
+        .dstack = vm->dstack,
+        .dstack_cap = vm->dstack_cap,
+        .rstack = vm->rstack,
+        .rstack_cap = vm->rstack_cap,
+        .lstack = vm->lstack,
+        .lstack_cap = vm->lstack_cap,
+        .debug_mode = vm->debug_mode,
+        .in = stdin,
+        .out = stdout,
+        .park = LOPSINVM_AWAKE,
+    };
+    *vm = reset;
+}
+
+// Pages of a stack that were touched and are backed by memory now.
+static size_t resident_stack_bytes(const void *stack, size_t cap, size_t elem_size)
+{
+    size_t page = lopsinvm_page_size;
+    size_t pages = cap * elem_size / page;
+
+    unsigned char vec[256];
+    size_t resident = 0;
+    for (size_t done = 0; done < pages; ) {
+        size_t n = pages - done < sizeof(vec) ? pages - done : sizeof(vec);
+        if (mincore((char *) stack + done * page, n * page, vec) != 0) return 0;
+        for (size_t i = 0; i < n; i++) {
+            if (vec[i] & 1) resident += page;
+        }
+        done += n;
+    }
+    return resident;
+}
+
+void lopsinvm_mem_stats(const LopsinVM *vm, LopsinVMStats *out)
+{
+    LopsinVMStats stats = {
+        .vm_bytes = sizeof(LopsinVM),
+        .stacks_resident = resident_stack_bytes(vm->dstack, vm->dstack_cap, sizeof(*vm->dstack))
+                         + resident_stack_bytes(vm->rstack, vm->rstack_cap, sizeof(*vm->rstack))
+                         + resident_stack_bytes(vm->lstack, vm->lstack_cap, sizeof(*vm->lstack)),
+        .stacks_reserved = vm->dstack_cap * sizeof(*vm->dstack)
+                         + vm->rstack_cap * sizeof(*vm->rstack)
+                         + vm->lstack_cap * sizeof(*vm->lstack),
+        .heap_table_bytes = vm->heap.cap * sizeof(Mem_Chunk),
+        .heap_bytes = 0,
+        .fiber_table_bytes = vm->fibers_cap * sizeof(LopsinFiber),
+    };
+
+    // the running fiber's stacks are the VM's, the others' are saved in the table
+    for (size_t i = 0; i < vm->fibers_count; i++) {
+        const LopsinFiber *fiber = &vm->fibers[i];
+        if (i == vm->fiber || fiber->dstack == NULL) continue;
+
+        stats.stacks_resident += resident_stack_bytes(fiber->dstack, fiber->dstack_cap, sizeof(*fiber->dstack))
+                               + resident_stack_bytes(fiber->rstack, fiber->rstack_cap, sizeof(*fiber->rstack))
+                               + resident_stack_bytes(fiber->lstack, fiber->lstack_cap, sizeof(*fiber->lstack));
+        stats.stacks_reserved += fiber->dstack_cap * sizeof(*fiber->dstack)
+                               + fiber->rstack_cap * sizeof(*fiber->rstack)
+                               + fiber->lstack_cap * sizeof(*fiber->lstack);
+    }
+
+    for (size_t i = 0; i < vm->heap.count; i++) {
+        stats.heap_bytes += vm->heap.chunks[i].bytes;
+    }
+
+    if (out) *out = stats;
+}
+
+static inline bool sv_try_chop_by_sv_left(String_View *sv,
+                                   const String_View thicc_delim,
+                                   String_View *out)
+{
+    String_View window = sv_from_parts(sv->data, thicc_delim.count);
+    size_t i = 0;
+    while (i + thicc_delim.count < sv->count
+        && !(sv_eq(window, thicc_delim)))
+    {
+        i++;
+        window.data++;
+    }
+
+    String_View result = sv_from_parts(sv->data, i);
+
+    if (i + thicc_delim.count == sv->count) {
+        return false;
+    }
+
+    // Chop!
+    sv->data  += i + thicc_delim.count;
+    sv->count -= i + thicc_delim.count;
+
+    if (out) *out = result;
+    return true;
+}
+
+static bool is_inst_ptr(const LopsinProgram *program, int64_t ip)
+{
+    return ip >= 0 && (uint64_t) ip < program->count;
+}
+
+static LopsinErr verify_jmptab(const LopsinProgram *program, int64_t offset)
+{
+    if (offset < 0 || offset % sizeof(uint64_t) != 0
+     || (uint64_t) offset + sizeof(LopsinJmpTab) > program->data_size)
+    {
+        return ERR_INVALID_OPERAND;
+    }
+
+    const LopsinJmpTab *table = (const LopsinJmpTab *) ((const char *) program->data + offset);
+    size_t available = (program->data_size - offset - sizeof(LopsinJmpTab)) / sizeof(uint64_t);
+    if (table->count > available) {
+        return ERR_INVALID_OPERAND;
+    }
+
+    if (!is_inst_ptr(program, table->default_target)) {
+        return ERR_BAD_INST_PTR;
+    }
+
+    for (uint64_t i = 0; i < table->count; i++) {
+        if (!is_inst_ptr(program, table->targets[i])) {
+            return ERR_BAD_INST_PTR;
+        }
+    }
+
+    return ERR_OK;
+}
+
+// Checks everything about the program that can be known before running it.
+// Returns the first problem found, and the index of the offending instruction in out_ip.
+LopsinErr lopsinvm_verify_program(const LopsinProgram *program, size_t *out_ip)
+{
+    static_assert(COUNT_LOPSIN_INST_TYPES == 91, "Exhaustive handling of LopsinInstType's in lopsinvm_verify_program()");
+
+    for (size_t ip = 0; ip < program->count; ip++) {
+        LopsinInst inst = program->insts[ip];
+        LopsinErr err = ERR_OK;
+
+        if (out_ip) *out_ip = ip;
+
+        if (inst.type >= COUNT_LOPSIN_INST_TYPES) {
+            return ERR_ILLEGAL_INST;
+        }
+
+        switch (inst.type) {
+        case LOPSIN_INST_DROP:
+        case LOPSIN_INST_ENTER: {
+            if (inst.operand.as_i64 < 0) err = ERR_INVALID_OPERAND;
+        } break;
+
+        case LOPSIN_INST_DUP:
+        case LOPSIN_INST_SWAP: {
+            if (inst.operand.as_i64 <= 0) err = ERR_INVALID_OPERAND;
+        } break;
+
+        case LOPSIN_INST_JMP:
+        case LOPSIN_INST_CJMP:
+        case LOPSIN_INST_CALL:
+        case LOPSIN_INST_JIGT:
+        case LOPSIN_INST_JILT:
+        case LOPSIN_INST_JIGTE:
+        case LOPSIN_INST_JILTE:
+        case LOPSIN_INST_JIEQ:
+        case LOPSIN_INST_JINEQ:
+        case LOPSIN_INST_JFGT:
+        case LOPSIN_INST_JFLT:
+        case LOPSIN_INST_JFGTE:
+        case LOPSIN_INST_JFLTE:
+        case LOPSIN_INST_JFEQ:
+        case LOPSIN_INST_JFNEQ:
+        case LOPSIN_INST_JIGTI:
+        case LOPSIN_INST_JILTI:
+        case LOPSIN_INST_JIGTEI:
+        case LOPSIN_INST_JILTEI:
+        case LOPSIN_INST_JIEQI:
+        case LOPSIN_INST_JINEQI: {
+            if (!is_inst_ptr(program, inst.operand.as_i64)) err = ERR_BAD_INST_PTR;
+        } break;
+
+        case LOPSIN_INST_RJMP:
+        case LOPSIN_INST_CRJMP: {
+            if (!is_inst_ptr(program, (int64_t) ip + inst.operand.as_i64)) err = ERR_BAD_INST_PTR;
+        } break;
+
+        case LOPSIN_INST_NCALL: {
+            if (inst.operand.as_i64 < 0 || (uint64_t) inst.operand.as_i64 >= program->natives_count) {
+                err = ERR_INVALID_OPERAND;
+            }
+        } break;
+
+        case LOPSIN_INST_JMPTAB: {
+            err = verify_jmptab(program, inst.operand.as_i64);
+        } break;
+
+        case LOPSIN_INST_PUSHD: {
+            if (inst.operand.as_i64 < 0 || (uint64_t) inst.operand.as_i64 > program->data_size) {
+                err = ERR_INVALID_OPERAND;
+            }
+        } break;
+
+        case LOPSIN_INST_SPAWN: {
+            if (inst.imm < 0) err = ERR_INVALID_OPERAND;
+            else if (!is_inst_ptr(program, inst.operand.as_i64)) err = ERR_BAD_INST_PTR;
+        } break;
+
+        case LOPSIN_INST_ATOMIC_LOAD32:
+        case LOPSIN_INST_ATOMIC_LOAD64: {
+            int64_t order = inst.operand.as_i64;
+            if (order != LOPSIN_MEMORY_ORDER_RELAXED && order != LOPSIN_MEMORY_ORDER_ACQUIRE
+             && order != LOPSIN_MEMORY_ORDER_SEQ_CST)
+            {
+                err = ERR_INVALID_OPERAND;
+            }
+        } break;
+
+        case LOPSIN_INST_ATOMIC_STORE32:
+        case LOPSIN_INST_ATOMIC_STORE64: {
+            int64_t order = inst.operand.as_i64;
+            if (order != LOPSIN_MEMORY_ORDER_RELAXED && order != LOPSIN_MEMORY_ORDER_RELEASE
+             && order != LOPSIN_MEMORY_ORDER_SEQ_CST)
+            {
+                err = ERR_INVALID_OPERAND;
+            }
+        } break;
+
+        case LOPSIN_INST_ATOMIC_ADD32:
+        case LOPSIN_INST_ATOMIC_ADD64:
+        case LOPSIN_INST_ATOMIC_XCHG32:
+        case LOPSIN_INST_ATOMIC_XCHG64:
+        case LOPSIN_INST_ATOMIC_CAS32:
+        case LOPSIN_INST_ATOMIC_CAS64: {
+            if (inst.operand.as_i64 < 0 || inst.operand.as_i64 >= COUNT_LOPSIN_MEMORY_ORDERS) {
+                err = ERR_INVALID_OPERAND;
+            }
+        } break;
+
+        default: break;
+        }
+
+        if (err != ERR_OK) return err;
+    }
+
+    return ERR_OK;
+}
+
+static bool load_error(const char *name, const char *reason)
+{
+    fprintf(stderr, "ERROR: Could not load program from file %s: %s\n",
+            name, reason);
+    return false;
+}
+
+bool lopsin_bytecode_parse(const void *bytes, size_t size, const char *name, LopsinBytecode *out)
+{
+    String_View bytecode = sv_from_parts(bytes, size);
+    const String_View magic = SV_STATIC(LOPSINVM_BYTECODE_MAGIC);
+
+    if (!sv_try_chop_by_sv_left(&bytecode, magic, NULL)) {
+        return load_error(name, "Incorrect format");
+    }
+
+    LopsinBytecodeHeader header;
+    if (bytecode.count < sizeof(header)) {
+        return load_error(name, "Truncated header");
+    }
+    memcpy(&header, bytecode.data, sizeof(header));
+    sv_chop_left(&bytecode, sizeof(header));
+
+    if (header.version != LOPSINVM_BYTECODE_VERSION) {
+        return load_error(name, "Unsupported bytecode version");
+    }
+
+    if (header.natives_size > bytecode.count
+     || header.data_size > bytecode.count - header.natives_size
+     || header.inst_count != (bytecode.count - header.natives_size - header.data_size) / sizeof(LopsinInst)
+     || (bytecode.count - header.natives_size - header.data_size) % sizeof(LopsinInst) != 0)
+    {
+        return load_error(name, "Section sizes do not match file size");
+    }
+
+    if (header.natives_size > 0 && bytecode.data[header.natives_size - 1] != '\0') {
+        return load_error(name, "Unterminated native name");
+    }
+
+    *out = (LopsinBytecode) {
+        .natives      = bytecode.data,
+        .natives_size = header.natives_size,
+        .data         = bytecode.data + header.natives_size,
+        .data_size    = header.data_size,
+        .insts        = bytecode.data + header.natives_size + header.data_size,
+        .inst_count   = header.inst_count,
+    };
+    return true;
+}
+
+// A program with the natives of bytecode resolved, and no instructions or data yet.
+static LopsinProgram *program_new(const LopsinBytecode *bytecode, const char *name)
+{
+    String_View names = sv_from_parts(bytecode->natives, bytecode->natives_size);
+
+    size_t natives_count = 0;
+    for (size_t i = 0; i < names.count; i++) {
+        if (names.data[i] == '\0') natives_count++;
+    }
+
+    LopsinProgram *program = NOTNULL(malloc(sizeof(LopsinProgram)));
+    *program = (LopsinProgram) {
+        .count         = bytecode->inst_count,
+        .natives       = NOTNULL(malloc(natives_count * sizeof(LopsinNative) + 1)),
+        .natives_count = natives_count,
+        .data_size     = bytecode->data_size,
+    };
+    atomic_init(&program->refcount, 1);
+
+    for (size_t i = 0; i < natives_count; i++) {
+        String_View native_name = sv_chop_by_delim(&names, '\0');
+        const LopsinNative *native = lopsin_find_native(native_name.data, native_name.count);
+        if (native == NULL) {
+            fprintf(stderr, "ERROR: Could not load program from file %s: Unknown native `"SV_Fmt"`\n",
+                    name, SV_Arg(native_name));
+            lopsin_program_release(program);
+            return NULL;
+        }
+        // the fields are const, so the entry can't be assigned
+        memcpy(&program->natives[i], native, sizeof(LopsinNative));
+    }
+
+    return program;
+}
+
+LopsinProgram *lopsin_program_load_from_memory(const void *bytes, size_t size, const char *name)
+{
+    LopsinBytecode bytecode;
+    if (!lopsin_bytecode_parse(bytes, size, name, &bytecode)) return NULL;
+
+    LopsinProgram *program = program_new(&bytecode, name);
+    if (program == NULL) return NULL;
+
+    program->insts = NOTNULL(malloc(bytecode.inst_count * sizeof(LopsinInst) + 1));
+    program->data = NOTNULL(malloc(bytecode.data_size + 1));
+    memcpy(program->insts, bytecode.insts, bytecode.inst_count * sizeof(LopsinInst));
+    memcpy(program->data, bytecode.data, bytecode.data_size);
+
+    size_t ip = 0;
+    LopsinErr err = lopsinvm_verify_program(program, &ip);
+    if (err != ERR_OK) {
+        fprintf(stderr, "ERROR: Could not load program from file %s: At inst %zu: %s\n",
+                name, ip, ERR_AS_CSTR(err));
+        lopsin_program_release(program);
+        return NULL;
+    }
+
+    return program;
+}
+
+LopsinProgram *lopsin_program_load_mapped(const LopsinBytecode *bytecode, void *mapping, size_t mapping_size, const char *name)
+{
+    assert((uintptr_t) bytecode->insts % alignof(LopsinInst) == 0);
+
+    LopsinProgram *program = program_new(bytecode, name);
+    if (program == NULL) return NULL;
+
+    // never written through, the program is read-only once loaded
+    program->insts = (LopsinInst *) bytecode->insts;
+    program->data = (void *) bytecode->data;
+    program->mapping = mapping;
+    program->mapping_size = mapping_size;
+
+    return program;
+}
+
+LopsinProgram *lopsin_program_load_from_file(const char *path)
+{
+    Buffer *buf = new_buffer(0);
+
+    buffer_append_file(buf, path);
+
+    LopsinProgram *program = lopsin_program_load_from_memory(buf->data, buf->size, path);
+    if (program == NULL) exit(1);
 
     buffer_clear(buf);
     buffer_free(buf);
+
+    return program;
+}
+
+LopsinProgram *lopsin_program_retain(LopsinProgram *program)
+{
+    atomic_fetch_add_explicit(&program->refcount, 1, memory_order_relaxed);
+    return program;
+}
+
+void lopsin_program_release(LopsinProgram *program)
+{
+    // acq_rel so that the last owner sees everything the others did with the program
+    if (atomic_fetch_sub_explicit(&program->refcount, 1, memory_order_acq_rel) == 1) {
+        if (program->mapping != NULL) {
+            munmap(program->mapping, program->mapping_size);
+        } else {
+            free(program->insts);
+            free(program->data);
+        }
+        free(program->natives);
+        free(program);
+    }
+}
+
+void lopsinvm_attach_program(LopsinVM *vm, LopsinProgram *program)
+{
+    assert(!vm->running);
+
+    lopsin_program_retain(program);
+    if (vm->program) lopsin_program_release(vm->program);
+
+    lopsinvm_drop_fibers(vm);
+
+    vm->program = program;
+    vm->insts = program->insts;
+    vm->inst_count = program->count;
+    vm->ip = 0;
+    vm->halted = false;
+}
+
+void lopsinvm_load_program_from_file(LopsinVM *vm, const char *path)
+{
+    LopsinProgram *program = lopsin_program_load_from_file(path);
+    lopsinvm_attach_program(vm, program);
+    lopsin_program_release(program);
 }
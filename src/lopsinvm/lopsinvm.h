@@ -10,6 +10,10 @@ Created 05 January 2022
 #include <stddef.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "handles.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -17,6 +21,7 @@ extern "C"
 #endif /* __cplusplus */
 
 #define LOPSINVM_BYTECODE_MAGIC "\105\114\117\120\122\151\102\141"
+#define LOPSINVM_BYTECODE_VERSION 2
 
 typedef union {
     int64_t as_i64;
@@ -34,6 +39,9 @@ typedef enum {
     ERR_RSTACK_UNDERFLOW,
     ERR_RSTACK_OVERFLOW,
 
+    ERR_LSTACK_UNDERFLOW,
+    ERR_LSTACK_OVERFLOW,
+
     ERR_ILLEGAL_INST,
     ERR_BAD_INST_PTR,
     ERR_BAD_MEM_PTR,
@@ -45,9 +53,34 @@ typedef enum {
 
     ERR_DIV_BY_ZERO,
 
+    /// Returned by a native that can't make progress yet, without popping anything or moving
+    /// the instruction pointer. lopsinvm_run_for() stops, and retries the native when resumed.
+    /// A native that will be woken up by another thread sets vm->wakeable too, otherwise
+    /// lopsinvm_start() takes the VM to be deadlocked.
+    ERR_WOULD_BLOCK,
+
+    ERR_BAD_FIBER,
+    ERR_DEADLOCK,
+    ERR_BAD_CHAN,
+    ERR_BAD_MAP,
+    ERR_BAD_VEC,
+
     COUNT_LOPSIN_ERRS
 } LopsinErr;
 
+typedef enum {
+    /// `hlt` was executed, or the VM had already halted.
+    LOPSIN_RUN_HALTED = 0,
+    /// max_steps instructions were executed, run it again to continue.
+    LOPSIN_RUN_BUDGET_EXHAUSTED,
+    /// A native returned ERR_WOULD_BLOCK, run it again once it can make progress.
+    LOPSIN_RUN_WAITING,
+    /// An instruction failed, the VM is halted.
+    LOPSIN_RUN_ERROR,
+
+    COUNT_LOPSIN_RUN_STATUSES
+} LopsinRunStatus;
+
 typedef enum {
     LOPSIN_INST_NOP = 0,
     LOPSIN_INST_HLT,
@@ -113,9 +146,72 @@ typedef enum {
     LOPSIN_INST_RET,
     LOPSIN_INST_NCALL,
 
+    LOPSIN_INST_ENTER,
+    LOPSIN_INST_LEAVE,
+    LOPSIN_INST_LOCAL_GET,
+    LOPSIN_INST_LOCAL_SET,
+
+    // fused compare-and-jump, equivalent to e.g. `igt cjmp L`
+    LOPSIN_INST_JIGT,
+    LOPSIN_INST_JILT,
+    LOPSIN_INST_JIGTE,
+    LOPSIN_INST_JILTE,
+    LOPSIN_INST_JIEQ,
+    LOPSIN_INST_JINEQ,
+
+    LOPSIN_INST_JFGT,
+    LOPSIN_INST_JFLT,
+    LOPSIN_INST_JFGTE,
+    LOPSIN_INST_JFLTE,
+    LOPSIN_INST_JFEQ,
+    LOPSIN_INST_JFNEQ,
+
+    // fused compare-with-immediate-and-jump, equivalent to e.g. `push K igt cjmp L`
+    LOPSIN_INST_JIGTI,
+    LOPSIN_INST_JILTI,
+    LOPSIN_INST_JIGTEI,
+    LOPSIN_INST_JILTEI,
+    LOPSIN_INST_JIEQI,
+    LOPSIN_INST_JINEQI,
+
+    // jump through a table in the data section, see LopsinJmpTab
+    LOPSIN_INST_JMPTAB,
+
+    // push the address of an offset into the data section
+    LOPSIN_INST_PUSHD,
+
+    // fibers, see LopsinFiber
+    LOPSIN_INST_SPAWN,
+    LOPSIN_INST_YIELD,
+    LOPSIN_INST_JOIN,
+
+    // atomic access to naturally aligned heap cells, the operand is a LopsinMemoryOrder
+    LOPSIN_INST_ATOMIC_LOAD32,
+    LOPSIN_INST_ATOMIC_LOAD64,
+    LOPSIN_INST_ATOMIC_STORE32,
+    LOPSIN_INST_ATOMIC_STORE64,
+    LOPSIN_INST_ATOMIC_ADD32,
+    LOPSIN_INST_ATOMIC_ADD64,
+    LOPSIN_INST_ATOMIC_XCHG32,
+    LOPSIN_INST_ATOMIC_XCHG64,
+    LOPSIN_INST_ATOMIC_CAS32,
+    LOPSIN_INST_ATOMIC_CAS64,
+
     COUNT_LOPSIN_INST_TYPES
 } LopsinInstType;
 
+/// Same meaning as C11's memory_order. Loads can't be `release` or `acq_rel`,
+/// and stores can't be `acquire` or `acq_rel`.
+typedef enum {
+    LOPSIN_MEMORY_ORDER_RELAXED = 0,
+    LOPSIN_MEMORY_ORDER_ACQUIRE,
+    LOPSIN_MEMORY_ORDER_RELEASE,
+    LOPSIN_MEMORY_ORDER_ACQ_REL,
+    LOPSIN_MEMORY_ORDER_SEQ_CST,
+
+    COUNT_LOPSIN_MEMORY_ORDERS
+} LopsinMemoryOrder;
+
 typedef enum {
     LOPSIN_NATIVE_PUTX,
     LOPSIN_NATIVE_PUTI,
@@ -125,64 +221,307 @@ typedef enum {
     LOPSIN_NATIVE_MALLOC,
     LOPSIN_NATIVE_FREE,
     LOPSIN_NATIVE_TIME,
+    LOPSIN_NATIVE_PUTS,
+    LOPSIN_NATIVE_CHAN_NEW,
+    LOPSIN_NATIVE_CHAN_SEND,
+    LOPSIN_NATIVE_CHAN_RECV,
+    LOPSIN_NATIVE_PFOR,
+    LOPSIN_NATIVE_VADD_I64,
+    LOPSIN_NATIVE_VADD_F64,
+    LOPSIN_NATIVE_VMUL_I64,
+    LOPSIN_NATIVE_VMUL_F64,
+    LOPSIN_NATIVE_VSCALE_I64,
+    LOPSIN_NATIVE_VSCALE_F64,
+    LOPSIN_NATIVE_VSUM_I64,
+    LOPSIN_NATIVE_VSUM_F64,
+    LOPSIN_NATIVE_VDOT_I64,
+    LOPSIN_NATIVE_VDOT_F64,
+    LOPSIN_NATIVE_VMIN_I64,
+    LOPSIN_NATIVE_VMIN_F64,
+    LOPSIN_NATIVE_VMAX_I64,
+    LOPSIN_NATIVE_VMAX_F64,
+    LOPSIN_NATIVE_MEMCPY,
+    LOPSIN_NATIVE_MEMMOVE,
+    LOPSIN_NATIVE_MEMSET,
+    LOPSIN_NATIVE_MEMCMP,
+    LOPSIN_NATIVE_SORT_I64,
+    LOPSIN_NATIVE_SORT_U64,
+    LOPSIN_NATIVE_SORT_F64,
+    LOPSIN_NATIVE_SORT_BY,
+    LOPSIN_NATIVE_MAP_NEW,
+    LOPSIN_NATIVE_MAP_NEW_BYTES,
+    LOPSIN_NATIVE_MAP_FREE,
+    LOPSIN_NATIVE_MAP_COUNT,
+    LOPSIN_NATIVE_MAP_PUT,
+    LOPSIN_NATIVE_MAP_GET,
+    LOPSIN_NATIVE_MAP_DEL,
+    LOPSIN_NATIVE_MAP_ITER,
+    LOPSIN_NATIVE_MAP_PUT_BYTES,
+    LOPSIN_NATIVE_MAP_GET_BYTES,
+    LOPSIN_NATIVE_MAP_DEL_BYTES,
+    LOPSIN_NATIVE_MAP_ITER_BYTES,
+    LOPSIN_NATIVE_REALLOC,
+    LOPSIN_NATIVE_VEC_NEW,
+    LOPSIN_NATIVE_VEC_FREE,
+    LOPSIN_NATIVE_VEC_PUSH,
+    LOPSIN_NATIVE_VEC_POP,
+    LOPSIN_NATIVE_VEC_GET,
+    LOPSIN_NATIVE_VEC_SET,
+    LOPSIN_NATIVE_VEC_LEN,
+    LOPSIN_NATIVE_VEC_DATA,
     COUNT_LOPSIN_NATIVES
 } LopsinNativeType;
 
 typedef struct {
     LopsinInstType type;
-    uint32_t _explicit_padding;
+    /// Secondary operand, see requires_immediate().
+    int32_t imm;
     LopsinValue operand;
 } LopsinInst;
 
 static_assert(sizeof(LopsinInst) == 16, "");
 
-#define LOPSINVM_DEFAULT_PROGRAM_COUNT 1024
-#define LOPSINVM_DEFAULT_DSTACK_CAP 1024
-#define LOPSINVM_DEFAULT_RSTACK_CAP 1024
-#define LOPSINVM_ALLOCED_CHUNKS_CAP 1024
+/// Follows the magic in a bytecode file, and is followed by the names of the natives the
+/// program calls (`natives_size` bytes of NUL terminated names, back to back), then
+/// `data_size` bytes of read-only data, then `inst_count` instructions.
+/// The operand of `ncall` is an index into the names.
+typedef struct {
+    uint64_t version;
+    uint64_t natives_size;
+    uint64_t data_size;
+    uint64_t inst_count;
+} LopsinBytecodeHeader;
+
+/// Layout of a jump table in the data section, at an 8-byte aligned offset.
+/// `jmptab` pops an index and jumps to targets[index], or to default_target
+/// if the index is out of range.
+typedef struct {
+    uint64_t count;
+    uint64_t default_target;
+    uint64_t targets[];
+} LopsinJmpTab;
 
+#define LOPSINVM_DEFAULT_PROGRAM_COUNT 1024
+// the data and return stacks are only reserved up front, pages are committed as they are touched
+#define LOPSINVM_DEFAULT_DSTACK_CAP (1024 * 1024)
+#define LOPSINVM_DEFAULT_RSTACK_CAP (1024 * 1024)
+#define LOPSINVM_DEFAULT_LSTACK_CAP 1024
+#define LOPSINVM_HEAP_INITIAL_CAP 16
+// fiber stacks are small, and kept around for the next `spawn` once a fiber was joined
+#define LOPSINVM_FIBER_DSTACK_CAP 4096
+#define LOPSINVM_FIBER_RSTACK_CAP 1024
+#define LOPSINVM_FIBER_LSTACK_CAP 256
+#define LOPSINVM_FIBERS_INITIAL_CAP 8
+
+typedef struct LopsinNative LopsinNative;
+
+/// A loaded and verified program. It is never modified after loading, so any number of
+/// VMs (on any threads) can run it at once. Reference counted, see lopsin_program_retain().
 typedef struct {
     LopsinInst *insts;
     size_t count;
-    size_t cap;
-} LopsinVMProgram;
+
+    /// The natives the program calls, resolved by name when it was loaded. `ncall i` calls natives[i].
+    LopsinNative *natives;
+    size_t natives_count;
+
+    /// Read-only data section. Readable through `pushd` addresses, but not writable.
+    void *data;
+    size_t data_size;
+
+    /// Set when insts and data are in a file mapping rather than malloc()ed, see lopsin_program_load_mapped().
+    void *mapping;
+    size_t mapping_size;
+
+    atomic_size_t refcount;
+} LopsinProgram;
+
+/// The sections of bytecode, pointing into it. See lopsin_bytecode_parse().
+typedef struct {
+    /// The names of the natives the program calls, each NUL-terminated, one after the other.
+    const char *natives;
+    size_t natives_size;
+
+    const void *data;
+    size_t data_size;
+
+    /// Not necessarily aligned for LopsinInst, it follows whatever comes before it in the file.
+    const void *insts;
+    size_t inst_count;
+} LopsinBytecode;
 
 typedef struct {
     void *ptr;
     size_t bytes;
+    /// Belongs to a native rather than the program, see lopsinvm_heap_realloc_owned().
+    bool owned;
 } Mem_Chunk;
 
+/// Memory allocated by the `malloc` native, sorted by address so that pointers can be
+/// looked up with a binary search. `chunks` is only allocated on the first `malloc`.
 typedef struct {
-    /// Data stack.
+    Mem_Chunk *chunks;
+    size_t count;
+    size_t cap;
+} LopsinHeap;
+
+typedef enum {
+    /// Joined, its stacks are ready to be reused by the next `spawn`.
+    LOPSIN_FIBER_FREE = 0,
+    LOPSIN_FIBER_RUNNABLE,
+    /// Waiting in `join` for the fiber `joining`.
+    LOPSIN_FIBER_JOINING,
+    /// Returned from its entry point, waiting to be joined.
+    LOPSIN_FIBER_DONE,
+} LopsinFiberState;
+
+/// A thread of execution inside a VM with its own stacks. `spawn n L` starts one at L,
+/// moving the top n values of the data stack over to it, and pushes its id. `yield` switches
+/// to the next runnable fiber, and `join` pops an id, waits for that fiber to return from
+/// its entry point, and pushes the value on top of its data stack (or 0).
+/// Fiber 0 is the one the VM started with. `hlt` in any fiber halts the whole VM.
+typedef struct {
+    LopsinFiberState state;
+    /// Bumped when the slot is reused, so that stale ids are caught by `join`.
+    uint32_t generation;
+    uint64_t joining;
+    LopsinValue result;
+
+    /// The VM's execution state, saved here while another fiber runs.
+    size_t ip;
     LopsinValue *dstack;
     size_t dstack_cap;
     size_t dsp;
-
-    /// Return stack.
     size_t *rstack;
     size_t rstack_cap;
     size_t rsp;
-
-    /// Program.
-    LopsinVMProgram program;
-
+    LopsinValue *lstack;
+    size_t lstack_cap;
+    size_t lsp;
+    size_t fp;
+} LopsinFiber;
+
+#define LOPSINVM_CACHE_LINE 64
+
+typedef struct LopsinVM LopsinVM;
+/// See lopsinvm_park().
+typedef void (*LopsinWakeProc)(LopsinVM *, void *user);
+
+/// See lopsinvm_chan.h
+typedef struct LopsinChan LopsinChan;
+/// See lopsinvm_map.h
+typedef struct LopsinMap LopsinMap;
+/// See lopsinvm_vec.h
+typedef struct LopsinVec LopsinVec;
+
+struct LopsinVM {
+    /// Hot execution state, touched by almost every instruction. Kept together in the
+    /// first cache line, so heap allocated VMs need aligned_alloc().
+    /// Instructions of the program, copied out of it to save an indirection per step.
+    alignas(LOPSINVM_CACHE_LINE) const LopsinInst *insts;
+    size_t inst_count;
     /// Instruction pointer.
     size_t ip;
 
-    /// Allocated memory chunks
-    Mem_Chunk alloced[LOPSINVM_ALLOCED_CHUNKS_CAP];
-    size_t alloced_count;
+    /// Data stack.
+    /// The data and return stacks are mmap'd with a PROT_NONE guard page right after
+    /// their last entry, see lopsinvm_run_for().
+    LopsinValue *dstack;
+    size_t dsp;
+
+    /// Return stack.
+    size_t *rstack;
+    size_t rsp;
 
     /// flags
     bool debug_mode;
+    /// Inside lopsinvm_run_for().
     bool running;
-} LopsinVM;
+    /// Executed `hlt` or failed, running it again does nothing.
+    bool halted;
 
-typedef LopsinErr (*LopsinNativeProc)(LopsinVM *);
+    /// Everything below is cold.
+    size_t dstack_cap;
+    size_t rstack_cap;
+
+    /// Locals stack.
+    /// `enter n` stores the caller's frame pointer at lstack[lsp], then
+    /// reserves n slots after it. The current frame is lstack[fp .. lsp).
+    LopsinValue *lstack;
+    size_t lstack_cap;
+    size_t lsp;
+    size_t fp;
+
+    /// Program, shared with other VMs.
+    LopsinProgram *program;
+
+    /// Streams used by natives, stdin and stdout by default.
+    /// VMs running on other threads should be given their own.
+    FILE *in;
+    FILE *out;
+
+    LopsinHeap heap;
+
+    /// Only allocated on the first `spawn`. The running fiber's state is in the VM itself.
+    LopsinFiber *fibers;
+    size_t fibers_count;
+    size_t fibers_cap;
+    /// Index of the running fiber.
+    size_t fiber;
+
+    /// Channels the program can use, by handle. See lopsinvm_add_chan().
+    Handle_Table chans;
+
+    /// Hash maps the program created, by handle, NULL once freed. See lopsinvm_add_map().
+    Handle_Table maps;
+
+    /// Growable arrays the program created, by handle, NULL once freed. See lopsinvm_add_vec().
+    Handle_Table vecs;
+
+    /// The VM whose heap this one borrowed to run a slice of a `pfor`, see lopsinvm_pfor.h.
+    /// Such a VM can't allocate or free memory.
+    const LopsinVM *parent;
+    /// How many natives are calling back into the program, see lopsinvm_callback().
+    size_t callbacks;
+
+    /// See lopsinvm_park(). `wake` is called from whichever thread wakes the VM up.
+    atomic_int park;
+    LopsinWakeProc wake;
+    void *wake_user;
+    /// Set by a native that returns ERR_WOULD_BLOCK on something that will call lopsinvm_wake()
+    /// from another thread. After LOPSIN_RUN_WAITING, whether any of the waiting fibers did.
+    bool wakeable;
+};
+
+static_assert(offsetof(LopsinVM, halted) < LOPSINVM_CACHE_LINE, "Hot fields of LopsinVM must fit in one cache line");
+
+/// What a VM costs, see lopsinvm_mem_stats().
 typedef struct {
+    /// sizeof(LopsinVM)
+    size_t vm_bytes;
+    /// Pages of the stacks (including those of fibers) that were touched, out of what was reserved.
+    size_t stacks_resident;
+    size_t stacks_reserved;
+    /// The table tracking allocated memory, and the memory itself.
+    size_t heap_table_bytes;
+    size_t heap_bytes;
+    size_t fiber_table_bytes;
+} LopsinVMStats;
+
+/// Natives get their `arity` arguments in args, deepest first, so that args[arity - 1] is the
+/// top of the stack, and write their `results` from args[0] up, over the arguments.
+/// `ncall` checks that the stack holds the arguments and has room for the results before
+/// calling the native, and only pops and pushes them once it returned ERR_OK, so a native
+/// that fails (or would block) leaves the stack as it was. Natives that call back into the
+/// program (see lopsinvm_callback()) must read their arguments before, and write their
+/// results after it, because it runs on the stack above the arguments.
+typedef LopsinErr (*LopsinNativeProc)(LopsinVM *, LopsinValue *args);
+struct LopsinNative {
     LopsinNativeProc proc;
     const char * const name;
-} LopsinNative;
+    uint8_t arity;
+    uint8_t results;
+};
 
 #define ERR_AS_CSTR(err) (LOPSIN_ERR_NAMES[err])
 
@@ -190,17 +529,98 @@ typedef struct {
 
 extern const char * const LOPSIN_INST_TYPE_NAMES[COUNT_LOPSIN_INST_TYPES];
 extern const char * const LOPSIN_ERR_NAMES[COUNT_LOPSIN_ERRS];
+extern const char * const LOPSIN_MEMORY_ORDER_NAMES[COUNT_LOPSIN_MEMORY_ORDERS];
+/// The natives every VM has. Programs refer to them by name, so that natives registered at
+/// runtime can be called in the same way, see lopsin_register_native().
 extern const LopsinNative LOPSIN_NATIVES[COUNT_LOPSIN_NATIVES];
 
 bool requires_operand(LopsinInstType insttype);
+bool requires_immediate(LopsinInstType insttype);
+bool is_atomic_inst(LopsinInstType insttype);
 void lopsinvalue_print(FILE *stream, LopsinValue);
 
+size_t lopsinvm_readable_bytes(const LopsinVM *, const void *ptr);
+/// Like lopsinvm_readable_bytes(), but only counts memory allocated by the VM.
+size_t lopsinvm_writable_bytes(const LopsinVM *, const void *ptr);
+
 void lopsinvm_new(LopsinVM *);
+/// Like lopsinvm_new(), with room for at least the given number of entries in each stack.
+void lopsinvm_new_with_stacks(LopsinVM *, size_t dstack_cap, size_t rstack_cap);
 void lopsinvm_free(LopsinVM *);
-
+/// Frees the program, memory, fibers, channels, maps and vectors of the VM, and sets it up as
+/// lopsinvm_new() would, without unmapping and mapping its stacks again.
+void lopsinvm_reset(LopsinVM *);
+void lopsinvm_mem_stats(const LopsinVM *, LopsinVMStats *out);
+
+/// Start tracking memory the VM's program can read and write, and that is freed along with the VM.
+void lopsinvm_heap_add(LopsinVM *, void *ptr, size_t bytes);
+/// Stops tracking the chunk starting at ptr. Returns false if there is none.
+bool lopsinvm_heap_remove(LopsinVM *, void *ptr);
+/// Resizes the chunk starting at *ptr with realloc(), and updates *ptr. A NULL *ptr allocates
+/// a new chunk. Fails with ERR_BAD_MEM_PTR if there is no such chunk, and leaves it as it was
+/// with ERR_OUT_OF_MEMORY.
+LopsinErr lopsinvm_heap_realloc(LopsinVM *, void **ptr, size_t bytes);
+/// Like lopsinvm_heap_realloc() and lopsinvm_heap_remove(), for chunks a native owns, like the
+/// elements of a vec. The program can read and write them, but lopsinvm_heap_realloc() and
+/// lopsinvm_heap_remove() (and so `realloc` and `free`) don't take them, and these only take them.
+LopsinErr lopsinvm_heap_realloc_owned(LopsinVM *, void **ptr, size_t bytes);
+bool lopsinvm_heap_remove_owned(LopsinVM *, void *ptr);
+
+/// Adds a native that programs loaded from then on can call by name, on top of LOPSIN_NATIVES.
+/// Returns false if there already is one with that name. Not thread-safe: register every
+/// native before loading programs, eg from a plugin, see lopsinvm_plugin.h.
+bool lopsin_register_native(const char *name, LopsinNativeProc proc, uint8_t arity, uint8_t results);
+/// The builtin or registered native with that name, NULL if there is none.
+const LopsinNative *lopsin_find_native(const char *name, size_t len);
+
+/// Loads and verifies a program, with a reference count of 1. Exits on failure.
+LopsinProgram *lopsin_program_load_from_file(const char *path);
+/// Like lopsin_program_load_from_file(), from bytecode in memory. Prints why and returns NULL
+/// on failure, name is only used in the message.
+LopsinProgram *lopsin_program_load_from_memory(const void *bytes, size_t size, const char *name);
+/// Checks the header of the bytecode and splits it into its sections, without copying or
+/// verifying them. Prints why and returns false on failure, like lopsin_program_load_from_memory().
+bool lopsin_bytecode_parse(const void *bytes, size_t size, const char *name, LopsinBytecode *out);
+/// Makes a program that runs the data and instructions of bytecode where they are, rather than
+/// copying and verifying them, so they must be aligned and verified already. They are in the
+/// mapping_size bytes mmap()ed at mapping, which the program unmaps once it is freed. Returns NULL
+/// if a native is missing, and leaves the mapping to the caller. Used by the cache, see lopsinvm_cache.h.
+LopsinProgram *lopsin_program_load_mapped(const LopsinBytecode *, void *mapping, size_t mapping_size, const char *name);
+LopsinProgram *lopsin_program_retain(LopsinProgram *);
+/// Frees the program once nothing holds on to it anymore.
+void lopsin_program_release(LopsinProgram *);
+LopsinErr lopsinvm_verify_program(const LopsinProgram *, size_t *out_ip);
+
+/// Makes the VM run the program (from the start), releasing the one it ran before.
+void lopsinvm_attach_program(LopsinVM *, LopsinProgram *);
+/// Loads a program only this VM uses.
 void lopsinvm_load_program_from_file(LopsinVM *, const char *path);
 
+/// Runs at most max_steps instructions in a tight loop. Can be called again to pick up
+/// exactly where it stopped, unless it returned LOPSIN_RUN_HALTED or LOPSIN_RUN_ERROR.
+/// out_err is set to the error for LOPSIN_RUN_ERROR, ERR_HALTED if the VM had already
+/// halted, and ERR_OK otherwise.
+LopsinRunStatus lopsinvm_run_for(LopsinVM *, size_t max_steps, LopsinErr *out_err);
+/// Call after lopsinvm_run_for() returned LOPSIN_RUN_WAITING. Returns true if the VM is
+/// parked now, and vm->wake will be called once it can make progress. Returns false if it was
+/// woken up in the meantime, and should just be run again.
+bool lopsinvm_park(LopsinVM *);
+/// Called by whatever a VM was waiting on (another VM sending on a channel, say) once it
+/// can make progress. Safe to call from any thread, and when the VM isn't parked.
+void lopsinvm_wake(LopsinVM *);
+/// Switches to the next runnable fiber, as if the running one executed `yield`.
+void lopsinvm_rotate_fibers(LopsinVM *);
+/// Runs a single instruction, like lopsinvm_run_for(vm, 1, &err).
 LopsinErr lopsinvm_run_inst(LopsinVM *);
+/// Runs the subroutine at addr until it returns, with whatever is on the data stack as its
+/// arguments, and leaves the VM where it was. Fails with ERR_HALTED if it executed `hlt`,
+/// and ERR_WOULD_BLOCK if it had to wait on something, in which case the VM is left as is.
+LopsinErr lopsinvm_call(LopsinVM *, size_t addr);
+/// Like lopsinvm_call(), for a native to call a subroutine of the VM running it.
+/// The native is stuck until the subroutine returns, so no other fiber can run in the
+/// meantime: `yield` does nothing, and waiting in `join` or on a native fails with ERR_DEADLOCK.
+LopsinErr lopsinvm_callback(LopsinVM *, size_t addr);
+/// Runs until the program halts or fails, and reports the error on stderr.
 LopsinErr lopsinvm_start(LopsinVM *);
 
 #ifdef __cplusplus
@@ -0,0 +1,472 @@
+#define _GNU_SOURCE
+
+#include "./lopsinvm_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define LOPSIN_CACHE_MAGIC "LOPCACHE"
+#define LOPSIN_CACHE_SUFFIX ".lopsinvmc"
+// sections start on a cache line, which is plenty for LopsinInst
+#define LOPSIN_CACHE_ALIGN 64
+#define LOPSIN_CACHE_BUILD_ID_CAP 64
+
+static_assert(LOPSIN_CACHE_ALIGN % alignof(LopsinInst) == 0, "Cached instructions must be aligned");
+
+/// The start of an entry. Offsets are from the start of the file.
+typedef struct {
+    char magic[sizeof(LOPSIN_CACHE_MAGIC) - 1];
+    uint32_t format;
+    uint32_t build_id_size;
+    uint8_t build_id[LOPSIN_CACHE_BUILD_ID_CAP];
+    /// Of the bytecode the entry was made from, with what comes before its magic.
+    uint64_t bytecode_size;
+    uint64_t bytecode_hash;
+    uint64_t natives_offset;
+    uint64_t natives_size;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t insts_offset;
+    uint64_t inst_count;
+} Cache_Header;
+
+typedef struct {
+    uint8_t bytes[LOPSIN_CACHE_BUILD_ID_CAP];
+    uint32_t size;
+    /// Of the bytes, the entries of this build are keyed by hashes seeded with it.
+    uint64_t seed;
+} Cache_Build_Id;
+
+static Cache_Build_Id cache_build_id;
+static pthread_once_t cache_build_id_once = PTHREAD_ONCE_INIT;
+
+// Not a cryptographic hash, entries are compared to the bytecode before they are used, this only
+// names them. A word at a time, so that hashing a program costs much less than verifying it.
+static uint64_t hash_bytes(uint64_t seed, const void *bytes, size_t len)
+{
+    const unsigned char *p = bytes;
+    uint64_t x = seed ^ ((uint64_t) len * 0x9e3779b97f4a7c15);
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        x = (x ^ word) * 0x9e3779b97f4a7c15;
+        x ^= x >> 32;
+    }
+    for (; i < len; i++) {
+        x = (x ^ p[i]) * 0x100000001b3;
+    }
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccd;
+    x ^= x >> 33;
+    return x;
+}
+
+static size_t align_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+// Looks for the GNU build ID note of the executable, which is the first object listed.
+static int find_build_id(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    (void) size;
+    Cache_Build_Id *id = arg;
+
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_NOTE) continue;
+
+        size_t align = phdr->p_align == 8 ? 8 : 4;
+        const char *note = (const char *) (uintptr_t) (info->dlpi_addr + phdr->p_vaddr);
+        const char *end = note + phdr->p_memsz;
+
+        while ((size_t) (end - note) >= sizeof(ElfW(Nhdr))) {
+            ElfW(Nhdr) nhdr;
+            memcpy(&nhdr, note, sizeof(nhdr));
+
+            const char *name = note + sizeof(nhdr);
+            size_t desc_offset = align_up(nhdr.n_namesz, align);
+            size_t next_offset = desc_offset + align_up(nhdr.n_descsz, align);
+            if (next_offset > (size_t) (end - name)) break;
+
+            if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == sizeof("GNU")
+             && memcmp(name, "GNU", sizeof("GNU")) == 0
+             && nhdr.n_descsz > 0 && nhdr.n_descsz <= LOPSIN_CACHE_BUILD_ID_CAP)
+            {
+                memcpy(id->bytes, name + desc_offset, nhdr.n_descsz);
+                id->size = nhdr.n_descsz;
+                return 1;
+            }
+
+            note = name + next_offset;
+        }
+    }
+
+    return 1;
+}
+
+static void init_build_id(void)
+{
+    dl_iterate_phdr(find_build_id, &cache_build_id);
+
+    // linked without a build ID, the time this file was compiled at is the best there is,
+    // nobuild compiles every file of the VM each time
+    if (cache_build_id.size == 0) {
+        const char fallback[] = __DATE__ " " __TIME__;
+        memcpy(cache_build_id.bytes, fallback, sizeof(fallback));
+        cache_build_id.size = sizeof(fallback);
+    }
+
+    cache_build_id.seed = hash_bytes(LOPSIN_CACHE_FORMAT_VERSION, cache_build_id.bytes, cache_build_id.size);
+}
+
+static const Cache_Build_Id *build_id(void)
+{
+    pthread_once(&cache_build_id_once, init_build_id);
+    return &cache_build_id;
+}
+
+char *lopsin_cache_default_dir(void)
+{
+    const char *dir = getenv(LOPSIN_CACHE_DIR_ENV);
+    if (dir != NULL) {
+        if (*dir == '\0') return NULL;
+        size_t len = strlen(dir);
+        return memcpy(NOTNULL(malloc(len + 1)), dir, len + 1);
+    }
+
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *sub = "lopsinvm";
+    if (base == NULL || *base != '/') {
+        base = getenv("HOME");
+        sub = ".cache/lopsinvm";
+        if (base == NULL || *base == '\0') return NULL;
+    }
+
+    size_t len = strlen(base) + 1 + strlen(sub) + 1;
+    char *path = NOTNULL(malloc(len));
+    snprintf(path, len, "%s/%s", base, sub);
+    return path;
+}
+
+// Whether the file is ours, and only we can write to it.
+static bool owned_by_us(const struct stat *st)
+{
+    return st->st_uid == geteuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+// Creates dir and the directories leading to it, only accessible to us, and checks that an
+// existing one is safe to keep entries in.
+static bool ensure_dir(const char *dir)
+{
+    size_t len = strlen(dir);
+    char *path = NOTNULL(malloc(len + 1));
+    memcpy(path, dir, len + 1);
+
+    for (size_t i = 1; i <= len; i++) {
+        if (path[i] != '/' && path[i] != '\0') continue;
+        path[i] = '\0';
+        if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+            free(path);
+            return false;
+        }
+        path[i] = dir[i];
+    }
+    free(path);
+
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) return false;
+    if (!owned_by_us(&st)) {
+        fprintf(stderr, "WARNING: Not caching programs in %s: Someone else can write to it\n", dir);
+        return false;
+    }
+    return true;
+}
+
+static char *entry_path(const char *dir, uint64_t hash)
+{
+    size_t len = strlen(dir) + 1 + 16 + sizeof(LOPSIN_CACHE_SUFFIX);
+    char *path = NOTNULL(malloc(len));
+    snprintf(path, len, "%s/%016" PRIx64 LOPSIN_CACHE_SUFFIX, dir, hash);
+    return path;
+}
+
+// Whether the header is that of an entry this build made.
+static bool header_of_this_build(const Cache_Header *header)
+{
+    const Cache_Build_Id *id = build_id();
+    return memcmp(header->magic, LOPSIN_CACHE_MAGIC, sizeof(header->magic)) == 0
+        && header->format == LOPSIN_CACHE_FORMAT_VERSION
+        && header->build_id_size == id->size
+        && memcmp(header->build_id, id->bytes, id->size) == 0;
+}
+
+// Whether the section at offset fits in the entry, and is aligned.
+static bool section_ok(uint64_t offset, uint64_t size, size_t entry_size)
+{
+    return offset % LOPSIN_CACHE_ALIGN == 0 && offset <= entry_size && size <= entry_size - offset;
+}
+
+// The program of the entry at path, if it was made from the same bytecode by this build.
+// Sets *found when it was, even if the program could not be made.
+static LopsinProgram *load_entry(const char *path, const LopsinBytecode *bytecode,
+                                 uint64_t hash, size_t size, const char *name, bool *found)
+{
+    *found = false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !owned_by_us(&st)
+     || (size_t) st.st_size < sizeof(Cache_Header))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // populated right away, every page is compared below
+    size_t entry_size = st.st_size;
+    void *mapping = mmap(NULL, entry_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+
+    const Cache_Header *header = mapping;
+    const char *entry = mapping;
+
+    if (!header_of_this_build(header)
+     || header->bytecode_size != size
+     || header->bytecode_hash != hash
+     || header->natives_size != bytecode->natives_size
+     || header->data_size != bytecode->data_size
+     || header->inst_count != bytecode->inst_count
+     || !section_ok(header->natives_offset, header->natives_size, entry_size)
+     || !section_ok(header->data_offset, header->data_size, entry_size)
+     || !section_ok(header->insts_offset, header->inst_count * sizeof(LopsinInst), entry_size)
+     || memcmp(entry + header->natives_offset, bytecode->natives, bytecode->natives_size) != 0
+     || memcmp(entry + header->data_offset, bytecode->data, bytecode->data_size) != 0
+     || memcmp(entry + header->insts_offset, bytecode->insts, bytecode->inst_count * sizeof(LopsinInst)) != 0)
+    {
+        munmap(mapping, entry_size);
+        return NULL;
+    }
+
+    *found = true;
+
+    LopsinBytecode cached = {
+        .natives      = entry + header->natives_offset,
+        .natives_size = header->natives_size,
+        .data         = entry + header->data_offset,
+        .data_size    = header->data_size,
+        .insts        = entry + header->insts_offset,
+        .inst_count   = header->inst_count,
+    };
+    LopsinProgram *program = lopsin_program_load_mapped(&cached, mapping, entry_size, name);
+    if (program == NULL) munmap(mapping, entry_size);
+    return program;
+}
+
+static bool pwrite_all(int fd, const void *bytes, size_t len, uint64_t offset)
+{
+    const char *p = bytes;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+typedef struct {
+    char *name;
+    uint64_t size;
+    time_t used;
+} Cache_Entry;
+
+static int compare_entries_by_use(const void *a, const void *b)
+{
+    time_t x = ((const Cache_Entry *) a)->used;
+    time_t y = ((const Cache_Entry *) b)->used;
+    return (x > y) - (x < y);
+}
+
+// Removes the entries of other builds, which would never be used again, and then the least
+// recently used ones until the rest fits in LOPSIN_CACHE_MAX_BYTES. Only called after storing
+// an entry, so that hits never pay for it. A VM that mapped a removed entry keeps it until it
+// unmaps it, and another VM removing the same entries at the same time is harmless.
+static void prune_entries(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+    int fd_dir = dirfd(d);
+
+    Cache_Entry *entries = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    uint64_t total = 0;
+
+    const size_t suffix_len = sizeof(LOPSIN_CACHE_SUFFIX) - 1;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        // the temporary files of entries being stored end in something else
+        size_t len = strlen(ent->d_name);
+        if (len < suffix_len || strcmp(ent->d_name + len - suffix_len, LOPSIN_CACHE_SUFFIX) != 0) continue;
+
+        int fd = openat(fd_dir, ent->d_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) continue;
+
+        struct stat st;
+        Cache_Header header;
+        bool ours = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && owned_by_us(&st);
+        bool current = ours && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                    && header_of_this_build(&header);
+        close(fd);
+
+        if (!ours) continue;
+        if (!current) {
+            unlinkat(fd_dir, ent->d_name, 0);
+            continue;
+        }
+
+        if (count >= cap) {
+            cap = cap == 0 ? 16 : cap * 2;
+            entries = NOTNULL(realloc(entries, cap * sizeof(Cache_Entry)));
+        }
+        entries[count++] = (Cache_Entry) {
+            .name = memcpy(NOTNULL(malloc(len + 1)), ent->d_name, len + 1),
+            .size = st.st_size,
+            .used = st.st_atime,
+        };
+        total += st.st_size;
+    }
+
+    if (total > LOPSIN_CACHE_MAX_BYTES) {
+        qsort(entries, count, sizeof(Cache_Entry), compare_entries_by_use);
+        for (size_t i = 0; i < count && total > LOPSIN_CACHE_MAX_BYTES; i++) {
+            if (unlinkat(fd_dir, entries[i].name, 0) == 0) total -= entries[i].size;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) free(entries[i].name);
+    free(entries);
+    closedir(d);
+}
+
+// Writes the entry for verified bytecode at path, through a temporary file renamed over it.
+static void store_entry(const char *dir, const char *path, const LopsinBytecode *bytecode,
+                        uint64_t hash, size_t size)
+{
+    if (!ensure_dir(dir)) return;
+
+    const Cache_Build_Id *id = build_id();
+    Cache_Header header = {
+        .format        = LOPSIN_CACHE_FORMAT_VERSION,
+        .build_id_size = id->size,
+        .bytecode_size = size,
+        .bytecode_hash = hash,
+        .natives_size  = bytecode->natives_size,
+        .data_size     = bytecode->data_size,
+        .inst_count    = bytecode->inst_count,
+    };
+    memcpy(header.magic, LOPSIN_CACHE_MAGIC, sizeof(header.magic));
+    memcpy(header.build_id, id->bytes, id->size);
+    header.natives_offset = align_up(sizeof(header), LOPSIN_CACHE_ALIGN);
+    header.data_offset = align_up(header.natives_offset + header.natives_size, LOPSIN_CACHE_ALIGN);
+    header.insts_offset = align_up(header.data_offset + header.data_size, LOPSIN_CACHE_ALIGN);
+    uint64_t insts_size = header.inst_count * sizeof(LopsinInst);
+
+    size_t tmp_len = strlen(path) + sizeof(".XXXXXX");
+    char *tmp = NOTNULL(malloc(tmp_len));
+    snprintf(tmp, tmp_len, "%s.XXXXXX", path);
+
+    // mkostemp() creates it readable and writable by us only
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) {
+        free(tmp);
+        return;
+    }
+
+    // the padding between sections is left to ftruncate(), which zeroes it
+    bool ok = ftruncate(fd, header.insts_offset + insts_size) == 0
+           && pwrite_all(fd, &header, sizeof(header), 0)
+           && pwrite_all(fd, bytecode->natives, header.natives_size, header.natives_offset)
+           && pwrite_all(fd, bytecode->data, header.data_size, header.data_offset)
+           && pwrite_all(fd, bytecode->insts, insts_size, header.insts_offset)
+           // on disk before it has its name, a crash can't leave a truncated entry behind
+           && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+
+    if (!ok || rename(tmp, path) != 0) unlink(tmp);
+    free(tmp);
+
+    prune_entries(dir);
+}
+
+LopsinProgram *lopsin_cache_load_from_memory(const char *dir, const void *bytes, size_t size, const char *name)
+{
+    if (dir == NULL || size < LOPSIN_CACHE_MIN_BYTES) {
+        return lopsin_program_load_from_memory(bytes, size, name);
+    }
+
+    LopsinBytecode bytecode;
+    if (!lopsin_bytecode_parse(bytes, size, name, &bytecode)) return NULL;
+
+    uint64_t hash = hash_bytes(build_id()->seed, bytes, size);
+    char *path = entry_path(dir, hash);
+
+    bool found = false;
+    LopsinProgram *program = load_entry(path, &bytecode, hash, size, name, &found);
+    if (found) {
+        free(path);
+        return program;
+    }
+
+    program = lopsin_program_load_from_memory(bytes, size, name);
+    if (program != NULL) store_entry(dir, path, &bytecode, hash, size);
+
+    free(path);
+    return program;
+}
+
+LopsinProgram *lopsin_cache_load_from_file(const char *dir, const char *path)
+{
+    if (dir == NULL) return lopsin_program_load_from_file(path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return lopsin_program_load_from_file(path);
+
+    // hashed and compared in place, no need for a copy of it
+    struct stat st;
+    void *bytes = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t) st.st_size >= LOPSIN_CACHE_MIN_BYTES) {
+        bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    }
+    close(fd);
+
+    // small programs, pipes and the like are read as usual
+    if (bytes == MAP_FAILED) return lopsin_program_load_from_file(path);
+
+    LopsinProgram *program = lopsin_cache_load_from_memory(dir, bytes, st.st_size, path);
+    munmap(bytes, st.st_size);
+    if (program == NULL) exit(1);
+
+    return program;
+}
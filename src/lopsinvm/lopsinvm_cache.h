@@ -0,0 +1,56 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_CACHE_H_
+#define LOPSINVM_CACHE_H_
+
+#include <stddef.h>
+
+#include "./lopsinvm.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/// `lopsinvm` keeps the programs it verified in a cache directory, so that running one again maps
+/// it from there rather than copying and verifying it. An entry is the verified program with its
+/// sections aligned, to be run in place, and is keyed by a hash of the bytecode and the build ID
+/// of the VM, so that a rebuilt VM never uses the entries of another build.
+///
+/// An entry is only used if its sections are the same bytes as the program being loaded, so a
+/// hash collision or a damaged entry costs a load, never runs the wrong program. Entries are
+/// written to a temporary file and renamed into place, and never modified after that, so a VM
+/// sees either a whole entry or none, and the one it mapped doesn't change under it. Entries
+/// must belong to the user running the VM and not be writable by anyone else, and the directory
+/// can be removed at any time.
+///
+/// Whenever an entry is stored, the entries of other builds are removed, and then the least
+/// recently used ones (as far as their access time tells) while all of them take more than
+/// LOPSIN_CACHE_MAX_BYTES.
+///
+/// Problems with the cache are not errors, the program is loaded without it instead.
+
+#define LOPSIN_CACHE_FORMAT_VERSION 1
+#define LOPSIN_CACHE_DIR_ENV "LOPSINVM_CACHE_DIR"
+// below this, mapping an entry costs about as much as verifying the program
+#define LOPSIN_CACHE_MIN_BYTES (64 * 1024)
+#define LOPSIN_CACHE_MAX_BYTES (1024 * 1024 * 1024)
+
+/// The cache directory to use when none was given: $LOPSINVM_CACHE_DIR, $XDG_CACHE_HOME/lopsinvm
+/// or ~/.cache/lopsinvm, malloc()ed. NULL if there is none, or $LOPSINVM_CACHE_DIR is set to an
+/// empty string, which turns the cache off.
+char *lopsin_cache_default_dir(void);
+
+/// Like lopsin_program_load_from_memory(), through the cache in dir, which is created if it
+/// doesn't exist. A NULL dir loads without the cache.
+LopsinProgram *lopsin_cache_load_from_memory(const char *dir, const void *bytes, size_t size, const char *name);
+/// Like lopsin_program_load_from_file(), through the cache in dir. Exits on failure.
+LopsinProgram *lopsin_cache_load_from_file(const char *dir, const char *path);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LOPSINVM_CACHE_H_ */
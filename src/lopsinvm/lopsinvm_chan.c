@@ -0,0 +1,139 @@
+#include "./lopsinvm_chan.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+LopsinChan *lopsin_chan_new(size_t cap)
+{
+    size_t pow2 = 1;
+    while (pow2 < cap) pow2 *= 2;
+
+    size_t bytes = sizeof(LopsinChan) + pow2 * sizeof(LopsinValue);
+    bytes = (bytes + LOPSINVM_CACHE_LINE - 1) / LOPSINVM_CACHE_LINE * LOPSINVM_CACHE_LINE;
+
+    LopsinChan *chan = NOTNULL(aligned_alloc(LOPSINVM_CACHE_LINE, bytes));
+    atomic_init(&chan->tail, 0);
+    atomic_init(&chan->head, 0);
+    atomic_init(&chan->send_waiter, NULL);
+    atomic_init(&chan->recv_waiter, NULL);
+    atomic_init(&chan->refcount, 1);
+    chan->mask = pow2 - 1;
+
+    return chan;
+}
+
+LopsinChan *lopsin_chan_retain(LopsinChan *chan)
+{
+    atomic_fetch_add_explicit(&chan->refcount, 1, memory_order_relaxed);
+    return chan;
+}
+
+void lopsin_chan_release(LopsinChan *chan)
+{
+    if (atomic_fetch_sub_explicit(&chan->refcount, 1, memory_order_acq_rel) == 1) {
+        free(chan);
+    }
+}
+
+bool lopsin_chan_is_shared(LopsinChan *chan)
+{
+    return atomic_load_explicit(&chan->refcount, memory_order_relaxed) > 1;
+}
+
+// Wakes up the VM parked on the other end, if there is one.
+//
+// The sender publishes a value and then looks for a parked receiver, while a receiver
+// registers itself and then looks for a value again (and the other way around for space).
+// Both are seq_cst, so at least one of them sees the other and no wake up is lost.
+static void wake_waiter(LopsinVM *_Atomic *waiter)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    LopsinVM *vm = atomic_load_explicit(waiter, memory_order_relaxed);
+    if (vm != NULL && atomic_compare_exchange_strong(waiter, &vm, NULL)) {
+        lopsinvm_wake(vm);
+    }
+}
+
+static bool try_send(LopsinChan *chan, LopsinValue value)
+{
+    size_t tail = atomic_load_explicit(&chan->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&chan->head, memory_order_acquire);
+    if (tail - head > chan->mask) return false;
+
+    chan->values[tail & chan->mask] = value;
+    atomic_store_explicit(&chan->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static bool try_recv(LopsinChan *chan, LopsinValue *out)
+{
+    size_t head = atomic_load_explicit(&chan->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&chan->tail, memory_order_acquire);
+    if (head == tail) return false;
+
+    *out = chan->values[head & chan->mask];
+    atomic_store_explicit(&chan->head, head + 1, memory_order_release);
+    return true;
+}
+
+LopsinErr lopsin_chan_send(LopsinChan *chan, LopsinVM *sender, LopsinValue value)
+{
+    // only fibers of this VM can be on the other end, and they run when this one yields
+    if (!lopsin_chan_is_shared(chan)) {
+        return try_send(chan, value) ? ERR_OK : ERR_WOULD_BLOCK;
+    }
+
+    if (!try_send(chan, value)) {
+        atomic_store(&chan->send_waiter, sender);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        // the receiver may have made room before it could see us waiting
+        if (!try_send(chan, value)) {
+            sender->wakeable = true;
+            return ERR_WOULD_BLOCK;
+        }
+
+        LopsinVM *expected = sender;
+        atomic_compare_exchange_strong(&chan->send_waiter, &expected, NULL);
+    }
+
+    wake_waiter(&chan->recv_waiter);
+    return ERR_OK;
+}
+
+LopsinErr lopsin_chan_recv(LopsinChan *chan, LopsinVM *receiver, LopsinValue *out)
+{
+    if (!lopsin_chan_is_shared(chan)) {
+        return try_recv(chan, out) ? ERR_OK : ERR_WOULD_BLOCK;
+    }
+
+    if (!try_recv(chan, out)) {
+        atomic_store(&chan->recv_waiter, receiver);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (!try_recv(chan, out)) {
+            receiver->wakeable = true;
+            return ERR_WOULD_BLOCK;
+        }
+
+        LopsinVM *expected = receiver;
+        atomic_compare_exchange_strong(&chan->recv_waiter, &expected, NULL);
+    }
+
+    wake_waiter(&chan->send_waiter);
+    return ERR_OK;
+}
+
+int64_t lopsinvm_add_chan(LopsinVM *vm, LopsinChan *chan)
+{
+    return handle_table_add(&vm->chans, lopsin_chan_retain(chan));
+}
+
+LopsinChan *lopsinvm_get_chan(const LopsinVM *vm, int64_t handle)
+{
+    return handle_table_get(&vm->chans, handle);
+}
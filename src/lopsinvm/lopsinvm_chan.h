@@ -0,0 +1,61 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_CHAN_H_
+#define LOPSINVM_CHAN_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "./lopsinvm.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/// A bounded FIFO of values, lock-free as long as at most one thread sends and at most one
+/// thread receives at a time (any number of fibers of one VM count as one thread).
+/// Reference counted; a VM holds a reference to every channel it has a handle for.
+struct LopsinChan {
+    /// Next slot to send into, only written by the sender.
+    alignas(LOPSINVM_CACHE_LINE) atomic_size_t tail;
+    /// Next slot to receive from, only written by the receiver.
+    alignas(LOPSINVM_CACHE_LINE) atomic_size_t head;
+
+    /// VMs that found the channel full or empty, and parked.
+    /// Only used when the channel is shared between VMs, see lopsin_chan_is_shared().
+    alignas(LOPSINVM_CACHE_LINE) LopsinVM *_Atomic send_waiter;
+    LopsinVM *_Atomic recv_waiter;
+
+    atomic_size_t refcount;
+    /// The capacity is a power of two, minus one.
+    size_t mask;
+    LopsinValue values[];
+};
+
+/// Room for at least `cap` values, with a reference count of 1.
+LopsinChan *lopsin_chan_new(size_t cap);
+LopsinChan *lopsin_chan_retain(LopsinChan *);
+void lopsin_chan_release(LopsinChan *);
+/// Whether more than one VM holds the channel, so that the other end may be on another thread.
+bool lopsin_chan_is_shared(LopsinChan *);
+
+/// Return ERR_WOULD_BLOCK if the channel is full (or empty). If the channel is shared,
+/// the VM is woken up with lopsinvm_wake() once that changed.
+LopsinErr lopsin_chan_send(LopsinChan *, LopsinVM *sender, LopsinValue);
+LopsinErr lopsin_chan_recv(LopsinChan *, LopsinVM *receiver, LopsinValue *out);
+
+/// Gives the VM's program a handle to the channel, taking a reference to it.
+/// Hand the same channel to two VMs to connect them.
+int64_t lopsinvm_add_chan(LopsinVM *, LopsinChan *);
+/// NULL if the handle is not one of the VM's.
+LopsinChan *lopsinvm_get_chan(const LopsinVM *, int64_t handle);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LOPSINVM_CHAN_H_ */
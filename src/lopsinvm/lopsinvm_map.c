@@ -0,0 +1,277 @@
+#include "./lopsinvm_map.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "util.h"
+
+#define LOPSIN_MAP_MIN_CAP 16
+// Slots of the old table moved by every put or delete while the map grows. Anything above
+// 2 drains it before the new table fills up, see map_reserve().
+#define LOPSIN_MAP_MOVE_STEP 16
+
+// Hashes are never 0 or 1, which mark free slots.
+#define SLOT_EMPTY 0
+#define SLOT_DELETED 1
+
+typedef struct {
+    uint64_t hash;
+    /// The key itself, or a Map_Bytes * the map owns.
+    uint64_t key;
+    LopsinValue value;
+} Map_Slot;
+
+typedef struct {
+    size_t len;
+    unsigned char bytes[];
+} Map_Bytes;
+
+typedef struct {
+    Map_Slot *slots;
+    /// 0, or a power of two.
+    size_t cap;
+    size_t live;
+    /// Live and deleted slots. Kept under 3/4 of cap, so that probes always end.
+    size_t used;
+} Map_Table;
+
+struct LopsinMap {
+    bool bytes_keys;
+    Map_Table table;
+    /// The table being moved into `table`, whose cap is 0 once it's done.
+    /// A key is never in both.
+    Map_Table old;
+    /// Slots of `old` moved so far.
+    size_t moved;
+};
+
+// splitmix64's finalizer, so that keys differing in their high bits don't all probe
+// from the same slot.
+static uint64_t hash_i64(int64_t key)
+{
+    uint64_t x = key;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111eb;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t key_hash(const LopsinMap *map, LopsinMapKey key)
+{
+    uint64_t hash = map->bytes_keys ? fnv1a_hash(key.bytes, key.len) : hash_i64(key.i);
+    return hash > SLOT_DELETED ? hash : hash + 2;
+}
+
+static bool key_equals(const LopsinMap *map, uint64_t slot_key, LopsinMapKey key)
+{
+    if (!map->bytes_keys) return slot_key == (uint64_t) key.i;
+
+    const Map_Bytes *bytes = (const Map_Bytes *) (uintptr_t) slot_key;
+    return bytes->len == key.len && (key.len == 0 || memcmp(bytes->bytes, key.bytes, key.len) == 0);
+}
+
+static Map_Slot *table_find(const LopsinMap *map, const Map_Table *table, uint64_t hash, LopsinMapKey key)
+{
+    if (table->live == 0) return NULL;
+
+    size_t mask = table->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        Map_Slot *slot = &table->slots[i];
+        if (slot->hash == SLOT_EMPTY) return NULL;
+        if (slot->hash == hash && key_equals(map, slot->key, key)) return slot;
+    }
+}
+
+// The key must not be in the table already.
+static void table_insert(Map_Table *table, uint64_t hash, uint64_t key, LopsinValue value)
+{
+    size_t mask = table->cap - 1;
+    size_t i = hash & mask;
+    while (table->slots[i].hash > SLOT_DELETED) i = (i + 1) & mask;
+
+    if (table->slots[i].hash == SLOT_EMPTY) table->used++;
+    table->live++;
+    table->slots[i] = (Map_Slot) { .hash = hash, .key = key, .value = value };
+}
+
+static void move_slots(LopsinMap *map, size_t n)
+{
+    while (n-- > 0 && map->old.cap != 0) {
+        Map_Slot *slot = &map->old.slots[map->moved++];
+        if (slot->hash > SLOT_DELETED) {
+            table_insert(&map->table, slot->hash, slot->key, slot->value);
+            // still in the way of the probes for the keys after it
+            slot->hash = SLOT_DELETED;
+            map->old.live--;
+        }
+
+        if (map->moved == map->old.cap) {
+            free(map->old.slots);
+            map->old = (Map_Table) {0};
+            map->moved = 0;
+        }
+    }
+}
+
+// Makes room in `table` for one more key, along with whatever `old` still holds.
+// The new table is at least twice as large as the map, so it takes cap / 4 puts to fill
+// it up again, while the old one (at most as large) is drained in old cap / MOVE_STEP.
+static void map_reserve(LopsinMap *map)
+{
+    if (map->table.used + map->old.live + 1 <= map->table.cap / 4 * 3) return;
+
+    // only happens when most of the map was deleted since it last grew
+    move_slots(map, SIZE_MAX);
+
+    size_t cap = LOPSIN_MAP_MIN_CAP;
+    while (cap < (map->table.live + 1) * 2) cap *= 2;
+
+    map->old = map->table;
+    map->moved = 0;
+    map->table = (Map_Table) {
+        .slots = NOTNULL(calloc(cap, sizeof(Map_Slot))),
+        .cap = cap,
+    };
+}
+
+static void free_key(LopsinMap *map, uint64_t key)
+{
+    if (map->bytes_keys) free((void *) (uintptr_t) key);
+}
+
+static void free_table(LopsinMap *map, Map_Table *table)
+{
+    if (map->bytes_keys) {
+        for (size_t i = 0; i < table->cap; i++) {
+            if (table->slots[i].hash > SLOT_DELETED) free_key(map, table->slots[i].key);
+        }
+    }
+    free(table->slots);
+}
+
+LopsinMap *lopsin_map_new(bool bytes_keys)
+{
+    LopsinMap *map = NOTNULL(calloc(1, sizeof(LopsinMap)));
+    map->bytes_keys = bytes_keys;
+    return map;
+}
+
+void lopsin_map_free(LopsinMap *map)
+{
+    if (map == NULL) return;
+    free_table(map, &map->table);
+    free_table(map, &map->old);
+    free(map);
+}
+
+bool lopsin_map_has_bytes_keys(const LopsinMap *map)
+{
+    return map->bytes_keys;
+}
+
+size_t lopsin_map_count(const LopsinMap *map)
+{
+    return map->table.live + map->old.live;
+}
+
+bool lopsin_map_get(const LopsinMap *map, LopsinMapKey key, LopsinValue *out)
+{
+    uint64_t hash = key_hash(map, key);
+    const Map_Slot *slot = table_find(map, &map->table, hash, key);
+    if (slot == NULL) slot = table_find(map, &map->old, hash, key);
+    if (slot == NULL) return false;
+
+    *out = slot->value;
+    return true;
+}
+
+void lopsin_map_put(LopsinMap *map, LopsinMapKey key, LopsinValue value)
+{
+    uint64_t hash = key_hash(map, key);
+
+    // an entry still in the old table gets its new value moved along with it
+    Map_Slot *slot = table_find(map, &map->table, hash, key);
+    if (slot == NULL) slot = table_find(map, &map->old, hash, key);
+    if (slot != NULL) {
+        slot->value = value;
+        return;
+    }
+
+    uint64_t stored = key.i;
+    if (map->bytes_keys) {
+        Map_Bytes *bytes = NOTNULL(malloc(sizeof(Map_Bytes) + key.len));
+        bytes->len = key.len;
+        if (key.len > 0) memcpy(bytes->bytes, key.bytes, key.len);
+        stored = (uintptr_t) bytes;
+    }
+
+    map_reserve(map);
+    table_insert(&map->table, hash, stored, value);
+    move_slots(map, LOPSIN_MAP_MOVE_STEP);
+}
+
+bool lopsin_map_del(LopsinMap *map, LopsinMapKey key)
+{
+    uint64_t hash = key_hash(map, key);
+
+    Map_Table *table = &map->table;
+    Map_Slot *slot = table_find(map, table, hash, key);
+    if (slot == NULL) {
+        table = &map->old;
+        slot = table_find(map, table, hash, key);
+    }
+    if (slot == NULL) return false;
+
+    free_key(map, slot->key);
+    slot->hash = SLOT_DELETED;
+    table->live--;
+
+    move_slots(map, LOPSIN_MAP_MOVE_STEP);
+    return true;
+}
+
+bool lopsin_map_next(LopsinMap *map, size_t *cursor, LopsinMapKey *key, LopsinValue *value)
+{
+    // iterating over one table is simpler, and it only happens once per growth
+    move_slots(map, SIZE_MAX);
+
+    for (size_t i = *cursor; i < map->table.cap; i++) {
+        const Map_Slot *slot = &map->table.slots[i];
+        if (slot->hash <= SLOT_DELETED) continue;
+
+        if (map->bytes_keys) {
+            const Map_Bytes *bytes = (const Map_Bytes *) (uintptr_t) slot->key;
+            *key = (LopsinMapKey) { .bytes = bytes->bytes, .len = bytes->len };
+        } else {
+            *key = (LopsinMapKey) { .i = slot->key };
+        }
+        *value = slot->value;
+        *cursor = i + 1;
+        return true;
+    }
+
+    *cursor = map->table.cap;
+    return false;
+}
+
+int64_t lopsinvm_add_map(LopsinVM *vm, LopsinMap *map)
+{
+    return handle_table_add(&vm->maps, map);
+}
+
+LopsinMap *lopsinvm_get_map(const LopsinVM *vm, int64_t handle)
+{
+    return handle_table_get(&vm->maps, handle);
+}
+
+bool lopsinvm_remove_map(LopsinVM *vm, int64_t handle)
+{
+    LopsinMap *map = handle_table_remove(&vm->maps, handle);
+    if (map == NULL) return false;
+
+    lopsin_map_free(map);
+    return true;
+}
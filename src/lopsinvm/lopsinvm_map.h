@@ -0,0 +1,60 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_MAP_H_
+#define LOPSINVM_MAP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "./lopsinvm.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/// An open-addressing hash map from keys to values, where the keys are either all integers,
+/// or all byte strings (which the map keeps copies of).
+///
+/// It grows incrementally: once it is 3/4 full, it allocates a table twice the size, and
+/// every later put or delete moves a few slots of the old table over, so that no single
+/// operation has to rehash the whole map.
+
+/// `i` for maps of integers, `bytes` and `len` for maps of byte strings.
+typedef struct {
+    int64_t i;
+    const void *bytes;
+    size_t len;
+} LopsinMapKey;
+
+LopsinMap *lopsin_map_new(bool bytes_keys);
+void lopsin_map_free(LopsinMap *);
+bool lopsin_map_has_bytes_keys(const LopsinMap *);
+size_t lopsin_map_count(const LopsinMap *);
+
+/// Returns whether the key was found.
+bool lopsin_map_get(const LopsinMap *, LopsinMapKey, LopsinValue *out);
+void lopsin_map_put(LopsinMap *, LopsinMapKey, LopsinValue);
+bool lopsin_map_del(LopsinMap *, LopsinMapKey);
+
+/// Gives the entry after *cursor, which starts at 0, and advances it. Returns false once
+/// there are no more. The key's bytes belong to the map.
+/// Entries put while iterating may or may not be seen, and may reorder the remaining
+/// ones, so that some are skipped or seen twice. Deleting the entry just given is fine.
+bool lopsin_map_next(LopsinMap *, size_t *cursor, LopsinMapKey *key, LopsinValue *value);
+
+/// Gives the VM's program a handle to the map, which the VM then owns.
+int64_t lopsinvm_add_map(LopsinVM *, LopsinMap *);
+/// NULL if the handle is not one of the VM's.
+LopsinMap *lopsinvm_get_map(const LopsinVM *, int64_t handle);
+/// Frees the map, after which the handle may be given to another one.
+bool lopsinvm_remove_map(LopsinVM *, int64_t handle);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LOPSINVM_MAP_H_ */
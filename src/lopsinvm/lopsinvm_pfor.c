@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+
+#include "./lopsinvm_pfor.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+
+typedef struct {
+    const LopsinVM *parent;
+    size_t sub;
+    LopsinValue arg;
+    int64_t lo;
+    /// hi - lo, counted as unsigned so that the whole range of int64_t works.
+    uint64_t count;
+    uint64_t chunk;
+
+    /// Offset from lo of the next slice nobody took yet.
+    _Atomic uint64_t next;
+    /// First error, ERR_OK while there is none.
+    atomic_int err;
+} Pfor_Job;
+
+static struct {
+    pthread_once_t once;
+    size_t workers;
+    bool workers_set;
+
+    /// Held by the one `pfor` using the pool, and by lopsin_pfor_shutdown().
+    pthread_mutex_t busy;
+    /// Started by the first `pfor` that uses the pool, see start_workers().
+    pthread_t *threads;
+    size_t threads_count;
+    /// The generation the running workers started at, so that they only take jobs after it.
+    uint64_t started_at;
+
+    pthread_mutex_t lock;
+    pthread_cond_t started;
+    pthread_cond_t finished;
+    Pfor_Job *job;
+    uint64_t generation;
+    /// Workers still running slices of the current job.
+    size_t running;
+    /// Set with the generation bumped to make the workers exit, see lopsin_pfor_shutdown().
+    bool stopping;
+} pfor_pool = {
+    .once = PTHREAD_ONCE_INIT,
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .started = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+};
+
+// Every thread that runs slices keeps a VM around for them, with its stacks mapped once.
+static pthread_key_t pfor_vm_key;
+
+static void free_pfor_vm(void *vm)
+{
+    lopsinvm_free(vm);
+    free(vm);
+}
+
+static LopsinVM *pfor_vm(void)
+{
+    LopsinVM *vm = pthread_getspecific(pfor_vm_key);
+    if (vm == NULL) {
+        vm = NOTNULL(aligned_alloc(LOPSINVM_CACHE_LINE, sizeof(LopsinVM)));
+        lopsinvm_new(vm);
+        pthread_setspecific(pfor_vm_key, vm);
+    }
+    return vm;
+}
+
+// Borrowed for the duration of the job, the parent is stuck in `pfor` until then.
+static void borrow_parent(LopsinVM *vm, const LopsinVM *parent)
+{
+    vm->program = parent->program;
+    vm->insts = parent->insts;
+    vm->inst_count = parent->inst_count;
+    vm->heap = parent->heap;
+    vm->in = parent->in;
+    vm->out = parent->out;
+    vm->parent = parent;
+}
+
+// Gives back what the VM borrowed, and frees whatever the slice left behind on it (fibers it
+// didn't join, maybe with the stacks of one of them in place, or anything a failed call left),
+// so that none of it carries over to the next slice, or the next program.
+static void reset_slice_vm(LopsinVM *vm)
+{
+    vm->program = NULL;
+    vm->heap = (LopsinHeap) {0};
+    lopsinvm_reset(vm);
+}
+
+static void run_slices(Pfor_Job *job)
+{
+    LopsinVM *vm = pfor_vm();
+
+    while (atomic_load_explicit(&job->err, memory_order_relaxed) == ERR_OK) {
+        uint64_t offset = atomic_fetch_add_explicit(&job->next, job->chunk, memory_order_relaxed);
+        if (offset >= job->count) break;
+        uint64_t size = job->count - offset < job->chunk ? job->count - offset : job->chunk;
+
+        borrow_parent(vm, job->parent);
+        vm->dstack[vm->dsp++] = job->arg;
+        vm->dstack[vm->dsp++].as_i64 = (int64_t) ((uint64_t) job->lo + offset);
+        vm->dstack[vm->dsp++].as_i64 = (int64_t) ((uint64_t) job->lo + offset + size);
+
+        LopsinErr err = lopsinvm_call(vm, job->sub);
+        if (err != ERR_OK) {
+            int expected = ERR_OK;
+            atomic_compare_exchange_strong(&job->err, &expected, err);
+        }
+
+        reset_slice_vm(vm);
+    }
+}
+
+static void *pfor_worker(void *arg)
+{
+    (void) arg;
+    uint64_t seen = pfor_pool.started_at;
+
+    for (;;) {
+        pthread_mutex_lock(&pfor_pool.lock);
+        while (pfor_pool.generation == seen) {
+            pthread_cond_wait(&pfor_pool.started, &pfor_pool.lock);
+        }
+        seen = pfor_pool.generation;
+        Pfor_Job *job = pfor_pool.job;
+        bool stopping = pfor_pool.stopping;
+        pthread_mutex_unlock(&pfor_pool.lock);
+
+        // its VM is freed along with the thread, see pfor_vm_key
+        if (stopping) break;
+
+        run_slices(job);
+
+        pthread_mutex_lock(&pfor_pool.lock);
+        if (--pfor_pool.running == 0) pthread_cond_signal(&pfor_pool.finished);
+        pthread_mutex_unlock(&pfor_pool.lock);
+    }
+
+    return NULL;
+}
+
+static void init_pool(void)
+{
+    pthread_key_create(&pfor_vm_key, &free_pfor_vm);
+
+    if (!pfor_pool.workers_set) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        pfor_pool.workers = cores > 1 ? (size_t) cores - 1 : 0;
+    }
+}
+
+// Called with pfor_pool.busy held, so that the pool starts (or stops) once at a time.
+static void start_workers(void)
+{
+    pfor_pool.threads = NOTNULL(malloc(pfor_pool.workers * sizeof(pthread_t)));
+    // before the threads exist, they read it without the lock
+    pfor_pool.started_at = pfor_pool.generation;
+
+    for (size_t i = 0; i < pfor_pool.workers; i++) {
+        int ret = pthread_create(&pfor_pool.threads[i], NULL, &pfor_worker, NULL);
+        if (ret != 0) {
+            fprintf(stderr, "ERROR: Could not start pfor worker: %s\n", strerror(ret));
+            exit(1);
+        }
+    }
+    pfor_pool.threads_count = pfor_pool.workers;
+}
+
+void lopsin_pfor_shutdown(void)
+{
+    // so that there is a key to look the calling thread's VM up with
+    pthread_once(&pfor_pool.once, &init_pool);
+    pthread_mutex_lock(&pfor_pool.busy);
+
+    if (pfor_pool.threads_count > 0) {
+        pthread_mutex_lock(&pfor_pool.lock);
+        pfor_pool.stopping = true;
+        pfor_pool.generation++;
+        pthread_cond_broadcast(&pfor_pool.started);
+        pthread_mutex_unlock(&pfor_pool.lock);
+
+        for (size_t i = 0; i < pfor_pool.threads_count; i++) {
+            pthread_join(pfor_pool.threads[i], NULL);
+        }
+
+        free(pfor_pool.threads);
+        pfor_pool.threads = NULL;
+        pfor_pool.threads_count = 0;
+        pfor_pool.stopping = false;
+    }
+
+    // the calling thread may have run slices too
+    LopsinVM *vm = pthread_getspecific(pfor_vm_key);
+    if (vm != NULL) {
+        free_pfor_vm(vm);
+        pthread_setspecific(pfor_vm_key, NULL);
+    }
+
+    pthread_mutex_unlock(&pfor_pool.busy);
+}
+
+void lopsin_pfor_set_workers(size_t workers)
+{
+    pfor_pool.workers = workers;
+    pfor_pool.workers_set = true;
+}
+
+LopsinErr lopsinvm_pfor(LopsinVM *vm, size_t sub, LopsinValue arg, int64_t lo, int64_t hi, int64_t chunk)
+{
+    assert(chunk > 0);
+    if (vm->parent != NULL) return ERR_NATIVE_ERROR;
+    if (lo >= hi) return ERR_OK;
+
+    pthread_once(&pfor_pool.once, &init_pool);
+
+    Pfor_Job job = {
+        .parent = vm,
+        .sub = sub,
+        .arg = arg,
+        .lo = lo,
+        .count = (uint64_t) hi - (uint64_t) lo,
+        .chunk = chunk,
+    };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.err, ERR_OK);
+
+    // a single slice isn't worth waking the pool for
+    bool pooled = pfor_pool.workers > 0 && job.count > job.chunk
+               && pthread_mutex_trylock(&pfor_pool.busy) == 0;
+
+    if (pooled) {
+        if (pfor_pool.threads_count == 0) start_workers();
+
+        pthread_mutex_lock(&pfor_pool.lock);
+        pfor_pool.job = &job;
+        pfor_pool.running = pfor_pool.workers;
+        pfor_pool.generation++;
+        pthread_cond_broadcast(&pfor_pool.started);
+        pthread_mutex_unlock(&pfor_pool.lock);
+    }
+
+    run_slices(&job);
+
+    if (pooled) {
+        pthread_mutex_lock(&pfor_pool.lock);
+        while (pfor_pool.running > 0) {
+            pthread_cond_wait(&pfor_pool.finished, &pfor_pool.lock);
+        }
+        pfor_pool.job = NULL;
+        pthread_mutex_unlock(&pfor_pool.lock);
+
+        pthread_mutex_unlock(&pfor_pool.busy);
+    }
+
+    return atomic_load(&job.err);
+}
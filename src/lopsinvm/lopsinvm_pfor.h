@@ -0,0 +1,50 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_PFOR_H_
+#define LOPSINVM_PFOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "./lopsinvm.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/// Calls the subroutine at `sub` as ( arg start end -- ) for every `chunk` sized slice of [lo, hi),
+/// spread over a pool of worker threads and the calling one, and returns once all of them
+/// returned. Returns the first error any of them failed with, in which case the remaining
+/// slices are skipped.
+///
+/// Each thread runs its slices on a VM of its own, which shares the program and the heap of
+/// `vm`, so the subroutine:
+///  - can read anything `vm` can, and write to memory `vm` allocated, as long as no two slices
+///    write to the same bytes (they would race, and one of the writes is lost) other than with
+///    the `atomic.*` instructions;
+///  - can't `malloc`, `free` or create maps, vectors or channels (ERR_NATIVE_ERROR), nor use
+///    the channels, maps and vectors of `vm` (ERR_BAD_CHAN, ERR_BAD_MAP, ERR_BAD_VEC) or `pfor`;
+///  - starts with nothing but its arguments on the stacks, and should join any fiber it spawns
+///    before returning (the fibers it doesn't join are dropped, as is whatever it leaves on the
+///    stacks, whether or not it fails);
+///  - writes to the same stream as `vm`, in no particular order between slices.
+///
+/// Only one `pfor` uses the pool at a time, others run all their slices on the calling thread.
+LopsinErr lopsinvm_pfor(LopsinVM *vm, size_t sub, LopsinValue arg, int64_t lo, int64_t hi, int64_t chunk);
+
+/// How many threads the pool starts, besides the ones calling lopsinvm_pfor().
+/// Only has an effect before the first `pfor`. Defaults to one less than the number of cores.
+void lopsin_pfor_set_workers(size_t workers);
+/// Stops the threads of the pool and joins them, once the `pfor` using it (if any) returned,
+/// and frees the VM the calling thread ran slices on. The next `pfor` starts the pool again.
+/// Call it before exiting, and never from a slice.
+void lopsin_pfor_shutdown(void);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LOPSINVM_PFOR_H_ */
@@ -0,0 +1,41 @@
+#include "./lopsinvm_plugin.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void plugin_error(const char *path, const char *reason)
+{
+    fprintf(stderr, "ERROR: Could not load plugin %s: %s\n", path, reason);
+    exit(1);
+}
+
+void lopsin_plugin_load(const char *path)
+{
+    // a bare name would be looked up in the library path rather than the working directory
+    const char *open_path = path;
+    char *relative = NULL;
+    if (strchr(path, '/') == NULL) {
+        size_t len = strlen(path);
+        relative = malloc(len + 3);
+        if (relative == NULL) plugin_error(path, "Out of memory");
+        memcpy(relative, "./", 2);
+        memcpy(relative + 2, path, len + 1);
+        open_path = relative;
+    }
+
+    void *lib = dlopen(open_path, RTLD_NOW | RTLD_LOCAL);
+    free(relative);
+    if (lib == NULL) plugin_error(path, dlerror());
+
+    // ISO C can't convert the void * dlsym() returns to a function pointer, but POSIX guarantees it works
+    LopsinPluginInitProc init;
+    void *sym = dlsym(lib, LOPSIN_PLUGIN_INIT_NAME);
+    if (sym == NULL) plugin_error(path, "No " LOPSIN_PLUGIN_INIT_NAME "() in it");
+    memcpy(&init, &sym, sizeof(init));
+
+    if (!init(LOPSIN_PLUGIN_ABI_VERSION)) {
+        plugin_error(path, "Its init function failed, it may be built for another version of the VM, or reuse the name of a native");
+    }
+}
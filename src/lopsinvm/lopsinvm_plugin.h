@@ -0,0 +1,41 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_PLUGIN_H_
+#define LOPSINVM_PLUGIN_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "./lopsinvm.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/// A plugin is a shared library that adds natives to the VM. It includes lopsinvm.h, and
+/// exports an init function named LOPSIN_PLUGIN_INIT_NAME, which registers its natives with
+/// lopsin_register_native(). Programs call them by name with `ncall`, like the builtin ones.
+///
+/// Natives get the LopsinVM itself, and can call any lopsinvm_* function (the VM exports
+/// them), so a plugin must be built against the same lopsinvm.h as the VM that loads it.
+/// LOPSIN_PLUGIN_ABI_VERSION changes whenever something a native can see does.
+
+#define LOPSIN_PLUGIN_ABI_VERSION 2
+#define LOPSIN_PLUGIN_INIT_NAME "lopsin_plugin_init"
+
+/// Called once, with the ABI version of the VM loading the plugin. Returns false if the plugin
+/// can't be used, eg because it was built for another version.
+typedef bool (*LopsinPluginInitProc)(uint32_t abi_version);
+
+/// Loads the plugin at path and runs its init function. Exits on failure, like loading a program
+/// does. Plugins are never unloaded, and must be loaded before the programs that use them.
+void lopsin_plugin_load(const char *path);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LOPSINVM_PLUGIN_H_ */
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+
+#include "./lopsinvm_sched.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+
+typedef LopsinSched Sched;
+typedef LopsinSchedWorker Worker;
+typedef LopsinSchedTask Task;
+
+// How long an idle worker sleeps before looking for work to steal again,
+// in case it missed a wake up from a worker with VMs to spare.
+#define LOPSIN_SCHED_IDLE_NS (10 * 1000 * 1000)
+
+// Returns how many VMs the worker holds now.
+static size_t worker_push(Worker *worker, Task *task)
+{
+    pthread_mutex_lock(&worker->lock);
+    // a worker never holds more than max_pending VMs
+    assert(worker->count < worker->cap);
+    worker->tasks[(worker->head + worker->count) % worker->cap] = task;
+    size_t count = ++worker->count;
+    pthread_mutex_unlock(&worker->lock);
+    return count;
+}
+
+static bool worker_pop_head(Worker *worker, Task **out)
+{
+    pthread_mutex_lock(&worker->lock);
+    bool found = worker->count > 0;
+    if (found) {
+        *out = worker->tasks[worker->head];
+        worker->head = (worker->head + 1) % worker->cap;
+        worker->count--;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+static bool worker_pop_tail(Worker *worker, Task **out)
+{
+    pthread_mutex_lock(&worker->lock);
+    bool found = worker->count > 0;
+    if (found) {
+        worker->count--;
+        *out = worker->tasks[(worker->head + worker->count) % worker->cap];
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+static bool find_task(Worker *self, Task **out)
+{
+    if (worker_pop_head(self, out)) return true;
+
+    Sched *sched = self->sched;
+    for (size_t i = 1; i < sched->workers_count; i++) {
+        Worker *victim = &sched->workers[(self->id + i) % sched->workers_count];
+        if (worker_pop_tail(victim, out)) return true;
+    }
+
+    return false;
+}
+
+static void task_done(Sched *sched, Task *task, LopsinRunStatus status, LopsinErr err)
+{
+    task->vm->wake = NULL;
+    task->vm->wake_user = NULL;
+    if (task->done) task->done(task->vm, status, err, task->user);
+    free(task);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->pending--;
+    pthread_cond_signal(&sched->not_full);
+    if (sched->pending == 0) pthread_cond_broadcast(&sched->all_done);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *self = arg;
+    Sched *sched = self->sched;
+
+    for (;;) {
+        Task *task;
+
+        if (!find_task(self, &task)) {
+            pthread_mutex_lock(&sched->lock);
+
+            // submissions push while holding sched->lock, so none can be missed between here and the wait
+            bool found = find_task(self, &task);
+            if (!found && sched->stopping) {
+                pthread_mutex_unlock(&sched->lock);
+                break;
+            }
+
+            if (!found) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += LOPSIN_SCHED_IDLE_NS;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+
+                atomic_fetch_add(&sched->sleeping, 1);
+                pthread_cond_timedwait(&sched->work_available, &sched->lock, &deadline);
+                atomic_fetch_sub(&sched->sleeping, 1);
+
+                pthread_mutex_unlock(&sched->lock);
+                continue;
+            }
+
+            pthread_mutex_unlock(&sched->lock);
+        }
+
+        LopsinErr err;
+        LopsinRunStatus status = lopsinvm_run_for(task->vm, sched->budget, &err);
+
+        // nothing can ever wake it up, so parking it would keep the scheduler from finishing
+        if (status == LOPSIN_RUN_WAITING && !task->vm->wakeable) {
+            status = LOPSIN_RUN_ERROR;
+            err = ERR_DEADLOCK;
+        }
+
+        switch (status) {
+            case LOPSIN_RUN_WAITING:
+            case LOPSIN_RUN_BUDGET_EXHAUSTED: {
+                if (status == LOPSIN_RUN_BUDGET_EXHAUSTED) {
+                    lopsinvm_rotate_fibers(task->vm);
+                } else if (lopsinvm_park(task->vm)) {
+                    // sched_wake() queues it again, and may already have
+                    break;
+                }
+
+                size_t count = worker_push(self, task);
+
+                // let an idle worker steal what this one has to spare
+                if (count > 1 && atomic_load(&sched->sleeping) > 0) {
+                    pthread_mutex_lock(&sched->lock);
+                    pthread_cond_signal(&sched->work_available);
+                    pthread_mutex_unlock(&sched->lock);
+                }
+            } break;
+
+            case LOPSIN_RUN_HALTED:
+            case LOPSIN_RUN_ERROR: {
+                task_done(sched, task, status, err);
+            } break;
+
+            default: {
+                CRASH("Bad run status");
+            }
+        }
+    }
+
+    return NULL;
+}
+
+LopsinSched *lopsin_sched_new(size_t workers, size_t max_pending, size_t budget)
+{
+    assert(workers > 0);
+    assert(max_pending > 0);
+    assert(budget > 0);
+
+    Sched *sched = NOTNULL(calloc(1, sizeof(Sched)));
+    sched->workers = NOTNULL(calloc(workers, sizeof(Worker)));
+    sched->workers_count = workers;
+    sched->budget = budget;
+    sched->max_pending = max_pending;
+
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work_available, NULL);
+    pthread_cond_init(&sched->not_full, NULL);
+    pthread_cond_init(&sched->all_done, NULL);
+    atomic_init(&sched->sleeping, 0);
+
+    for (size_t i = 0; i < workers; i++) {
+        Worker *worker = &sched->workers[i];
+        worker->sched = sched;
+        worker->id = i;
+        worker->cap = max_pending;
+        worker->tasks = NOTNULL(calloc(max_pending, sizeof(Task *)));
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+
+    for (size_t i = 0; i < workers; i++) {
+        int ret = pthread_create(&sched->workers[i].thread, NULL, &worker_main, &sched->workers[i]);
+        if (ret != 0) {
+            fprintf(stderr, "ERROR: Could not start scheduler worker: %s\n", strerror(ret));
+            exit(1);
+        }
+    }
+
+    return sched;
+}
+
+// Expects sched->lock to be held. Every ring has room for all pending VMs.
+static void enqueue_locked(Sched *sched, Task *task)
+{
+    worker_push(&sched->workers[sched->next_worker], task);
+    sched->next_worker = (sched->next_worker + 1) % sched->workers_count;
+
+    pthread_cond_signal(&sched->work_available);
+}
+
+// Called from whichever thread made progress for a parked VM.
+static void sched_wake(LopsinVM *vm, void *user)
+{
+    (void) vm;
+    Task *task = user;
+    // once queued, another worker may run the VM to its end and free the task before we unlock
+    Sched *sched = task->sched;
+
+    pthread_mutex_lock(&sched->lock);
+    enqueue_locked(sched, task);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Expects sched->lock to be held, and room for one more VM.
+static void submit_locked(Sched *sched, LopsinVM *vm, LopsinSchedDoneProc done, void *user)
+{
+    assert(sched->pending < sched->max_pending);
+    assert(!vm->halted && "Submitted a VM that already halted");
+    assert(vm->wake == NULL && "Submitted a VM that is already running somewhere");
+
+    Task *task = NOTNULL(malloc(sizeof(Task)));
+    *task = (Task) { .vm = vm, .done = done, .user = user, .sched = sched };
+    vm->wake = &sched_wake;
+    vm->wake_user = task;
+
+    sched->pending++;
+    enqueue_locked(sched, task);
+}
+
+void lopsin_sched_submit(LopsinSched *sched, LopsinVM *vm, LopsinSchedDoneProc done, void *user)
+{
+    pthread_mutex_lock(&sched->lock);
+    while (sched->pending >= sched->max_pending) {
+        pthread_cond_wait(&sched->not_full, &sched->lock);
+    }
+    submit_locked(sched, vm, done, user);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+bool lopsin_sched_try_submit(LopsinSched *sched, LopsinVM *vm, LopsinSchedDoneProc done, void *user)
+{
+    pthread_mutex_lock(&sched->lock);
+    bool room = sched->pending < sched->max_pending;
+    if (room) {
+        submit_locked(sched, vm, done, user);
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return room;
+}
+
+void lopsin_sched_wait(LopsinSched *sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    while (sched->pending > 0) {
+        pthread_cond_wait(&sched->all_done, &sched->lock);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void lopsin_sched_free(LopsinSched *sched)
+{
+    lopsin_sched_wait(sched);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = true;
+    pthread_cond_broadcast(&sched->work_available);
+    pthread_mutex_unlock(&sched->lock);
+
+    // other workers may still be looking for something to steal until they are all joined
+    for (size_t i = 0; i < sched->workers_count; i++) {
+        pthread_join(sched->workers[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < sched->workers_count; i++) {
+        pthread_mutex_destroy(&sched->workers[i].lock);
+        free(sched->workers[i].tasks);
+    }
+
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->work_available);
+    pthread_cond_destroy(&sched->not_full);
+    pthread_cond_destroy(&sched->all_done);
+
+    free(sched->workers);
+    free(sched);
+}
@@ -0,0 +1,87 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_SCHED_H_
+#define LOPSINVM_SCHED_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "./lopsinvm.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+#define LOPSIN_SCHED_DEFAULT_BUDGET 10000
+#define LOPSIN_SCHED_DEFAULT_MAX_PENDING 4096
+
+/// Called on a worker thread once a VM halted or failed, after which the scheduler
+/// doesn't touch it anymore.
+typedef void (*LopsinSchedDoneProc)(LopsinVM *vm, LopsinRunStatus status, LopsinErr err, void *user);
+
+typedef struct LopsinSched LopsinSched;
+
+typedef struct {
+    LopsinVM *vm;
+    LopsinSchedDoneProc done;
+    void *user;
+    LopsinSched *sched;
+} LopsinSchedTask;
+
+typedef struct {
+    pthread_t thread;
+    LopsinSched *sched;
+    size_t id;
+
+    /// Ring buffer of runnable VMs. The worker takes from the head and puts
+    /// VMs that still have work to do back at the tail, thieves take from the tail.
+    /// VMs waiting on a channel are in none of them, until they are woken up.
+    pthread_mutex_t lock;
+    LopsinSchedTask **tasks;
+    size_t head;
+    size_t count;
+    size_t cap;
+} LopsinSchedWorker;
+
+/// Runs VMs on a pool of worker threads, `budget` instructions at a time
+/// (see lopsinvm_run_for()). A worker that runs out of VMs steals from the others.
+/// VMs that wait on something are parked, and queued again when woken up (see lopsinvm_park()).
+struct LopsinSched {
+    LopsinSchedWorker *workers;
+    size_t workers_count;
+    size_t budget;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t not_full;
+    pthread_cond_t all_done;
+
+    /// Submitted, and not done yet. Submitting blocks while it is at max_pending.
+    size_t pending;
+    size_t max_pending;
+    size_t next_worker;
+    atomic_size_t sleeping;
+    bool stopping;
+};
+
+LopsinSched *lopsin_sched_new(size_t workers, size_t max_pending, size_t budget);
+/// Hands the VM over to the scheduler, blocking while max_pending VMs are already in flight.
+/// The program must already be loaded. `done` may be NULL.
+void lopsin_sched_submit(LopsinSched *, LopsinVM *, LopsinSchedDoneProc done, void *user);
+/// Like lopsin_sched_submit(), but returns false instead of blocking.
+bool lopsin_sched_try_submit(LopsinSched *, LopsinVM *, LopsinSchedDoneProc done, void *user);
+/// Blocks until every submitted VM is done. VMs that wait on each other forever are never done.
+void lopsin_sched_wait(LopsinSched *);
+/// Waits for every submitted VM, then stops the workers.
+void lopsin_sched_free(LopsinSched *);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LOPSINVM_SCHED_H_ */
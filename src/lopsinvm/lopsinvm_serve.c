@@ -0,0 +1,472 @@
+#define _GNU_SOURCE
+
+#include "./lopsinvm_serve.h"
+#include "./lopsinvm.h"
+#include "./lopsinvm_cache.h"
+
+#include <assert.h>
+#include <errno.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "util.h"
+
+// Programs a worker keeps loaded. Past either limit, the ones loaded the longest ago are dropped.
+#define LOPSIN_SERVE_CACHE_CAP 64
+#define LOPSIN_SERVE_CACHE_MAX_BYTES (256 * 1024 * 1024)
+// A file changed less than this many seconds before it was read may change again without its
+// timestamps showing it, as they are only updated once per clock tick.
+#define LOPSIN_SERVE_STAT_SLACK_SEC 2
+#define LOPSIN_SERVE_BACKLOG 128
+#define LOPSIN_SERVE_READ_CHUNK 4096
+
+/// What fstat() says about a file, which is enough to tell it did not change since it was read.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+} Serve_File_Id;
+
+typedef struct {
+    uint64_t hash;
+    /// The bytecode the program was loaded from, compared in full when the hashes match.
+    void *bytes;
+    size_t size;
+    LopsinProgram *program;
+    /// Requests for the file the program was last read from skip reading it again.
+    Serve_File_Id file;
+    bool has_file;
+} Serve_Cached;
+
+/// A FIFO of the programs a worker loaded.
+typedef struct {
+    Serve_Cached entries[LOPSIN_SERVE_CACHE_CAP];
+    size_t first;
+    size_t count;
+    /// Of the bytecode and the programs loaded from it.
+    size_t bytes;
+    /// Where programs that are not in the FIFO are looked for before being verified, NULL for
+    /// nowhere, see lopsinvm_cache.h. Shared by the workers, and with `lopsinvm` itself.
+    const char *dir;
+} Serve_Cache;
+
+static volatile sig_atomic_t serve_stopping = 0;
+
+static void serve_stop(int sig)
+{
+    (void) sig;
+    serve_stopping = 1;
+}
+
+static void close_fds(int *fds, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+// Reads all of fd into a malloc'd buffer. Sets errno on failure.
+static void *read_fd(int fd, size_t *out_size)
+{
+    size_t size = 0, cap = 0;
+    char *bytes = NULL;
+
+    for (;;) {
+        if (cap - size < LOPSIN_SERVE_READ_CHUNK) {
+            cap = cap == 0 ? LOPSIN_SERVE_READ_CHUNK : cap * 2;
+            bytes = NOTNULL(realloc(bytes, cap));
+        }
+
+        ssize_t n = read(fd, bytes + size, cap - size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            int saved = errno;
+            free(bytes);
+            errno = saved;
+            return NULL;
+        }
+        if (n == 0) break;
+        size += n;
+    }
+
+    *out_size = size;
+    return bytes;
+}
+
+static bool timespec_eq(struct timespec a, struct timespec b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Whether fd is a regular file that has not changed for a while, and what identifies it.
+static bool file_id(int fd, Serve_File_Id *out)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec - st.st_ctim.tv_sec < LOPSIN_SERVE_STAT_SLACK_SEC) return false;
+
+    *out = (Serve_File_Id) {
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .size = st.st_size,
+        .mtime = st.st_mtim,
+        .ctime = st.st_ctim,
+    };
+    return true;
+}
+
+static bool file_id_eq(const Serve_File_Id *a, const Serve_File_Id *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+        && timespec_eq(a->mtime, b->mtime) && timespec_eq(a->ctime, b->ctime);
+}
+
+static Serve_Cached *cache_at(Serve_Cache *cache, size_t i)
+{
+    return &cache->entries[(cache->first + i) % LOPSIN_SERVE_CACHE_CAP];
+}
+
+static size_t cached_bytes(const Serve_Cached *entry)
+{
+    return entry->size + entry->program->count * sizeof(LopsinInst) + entry->program->data_size;
+}
+
+static void cache_drop_oldest(Serve_Cache *cache)
+{
+    Serve_Cached *entry = cache_at(cache, 0);
+    cache->bytes -= cached_bytes(entry);
+    free(entry->bytes);
+    // a VM running it keeps it alive
+    lopsin_program_release(entry->program);
+
+    cache->first = (cache->first + 1) % LOPSIN_SERVE_CACHE_CAP;
+    cache->count--;
+}
+
+// The program in fd, loaded from the cache if it was seen before, NULL if it could not be read
+// or loaded, in which case the reason was printed. The cache holds on to the program.
+static LopsinProgram *cache_load(Serve_Cache *cache, int fd, const char *name)
+{
+    Serve_File_Id file = {0};
+    bool has_file = file_id(fd, &file);
+
+    if (has_file) {
+        for (size_t i = 0; i < cache->count; i++) {
+            Serve_Cached *entry = cache_at(cache, i);
+            if (entry->has_file && file_id_eq(&entry->file, &file)) return entry->program;
+        }
+    }
+
+    size_t size;
+    void *bytes = read_fd(fd, &size);
+    if (bytes == NULL) {
+        fprintf(stderr, "ERROR: Could not read file %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    uint64_t hash = fnv1a_hash(bytes, size);
+    for (size_t i = 0; i < cache->count; i++) {
+        Serve_Cached *entry = cache_at(cache, i);
+        if (entry->hash == hash && entry->size == size && memcmp(entry->bytes, bytes, size) == 0) {
+            free(bytes);
+            // the same program from another file, or the file was touched
+            entry->file = file;
+            entry->has_file = has_file;
+            return entry->program;
+        }
+    }
+
+    LopsinProgram *program = lopsin_cache_load_from_memory(cache->dir, bytes, size, name);
+    if (program == NULL) {
+        free(bytes);
+        return NULL;
+    }
+
+    Serve_Cached added = {
+        .hash = hash,
+        .bytes = bytes,
+        .size = size,
+        .program = program,
+        .file = file,
+        .has_file = has_file,
+    };
+    size_t added_bytes = cached_bytes(&added);
+    while (cache->count > 0 && (cache->count == LOPSIN_SERVE_CACHE_CAP
+                                || cache->bytes + added_bytes > LOPSIN_SERVE_CACHE_MAX_BYTES))
+    {
+        cache_drop_oldest(cache);
+    }
+
+    *cache_at(cache, cache->count++) = added;
+    cache->bytes += added_bytes;
+    return program;
+}
+
+// Receives a whole request, along with exactly COUNT_LOPSIN_SERVE_FDS descriptors.
+static bool recv_request(int conn, LopsinServeRequest *req, int fds[COUNT_LOPSIN_SERVE_FDS])
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * COUNT_LOPSIN_SERVE_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t n;
+    do n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC); while (n < 0 && errno == EINTR);
+    if (n <= 0) return false;
+
+    size_t received = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (received < COUNT_LOPSIN_SERVE_FDS) fds[received++] = fd;
+            else close(fd);
+        }
+    }
+
+    // the descriptors only come with the first part of the request
+    size_t got = n;
+    while (got < sizeof(*req)) {
+        n = recv(conn, (char *) req + got, sizeof(*req) - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+
+    if (got < sizeof(*req) || received < COUNT_LOPSIN_SERVE_FDS || (msg.msg_flags & MSG_CTRUNC)
+     || req->version != LOPSIN_SERVE_PROTOCOL_VERSION)
+    {
+        close_fds(fds, received);
+        return false;
+    }
+
+    req->name[LOPSIN_SERVE_NAME_CAP - 1] = '\0';
+    return true;
+}
+
+static void serve_connection(LopsinVM *vm, Serve_Cache *cache, int conn, int saved_stderr)
+{
+    LopsinServeRequest req;
+    int fds[COUNT_LOPSIN_SERVE_FDS];
+    // a client that doesn't speak the protocol just gets its connection closed
+    if (!recv_request(conn, &req, fds)) return;
+
+    // everything printed while running the request goes to the client, like it would
+    // if it ran `lopsinvm` itself
+    fflush(stderr);
+    dup2(fds[LOPSIN_SERVE_FD_STDERR], STDERR_FILENO);
+
+    LopsinServeResponse response = { .status = 1 };
+    LopsinProgram *program = cache_load(cache, fds[LOPSIN_SERVE_FD_PROGRAM], req.name);
+
+    FILE *in = NULL, *out = NULL;
+    if (program != NULL) {
+        in = fdopen(fds[LOPSIN_SERVE_FD_STDIN], "r");
+        if (in != NULL) fds[LOPSIN_SERVE_FD_STDIN] = -1;
+        out = fdopen(fds[LOPSIN_SERVE_FD_STDOUT], "w");
+        if (out != NULL) fds[LOPSIN_SERVE_FD_STDOUT] = -1;
+
+        if (in == NULL || out == NULL) {
+            fprintf(stderr, "ERROR: Could not open the streams of %s: %s\n", req.name, strerror(errno));
+        } else {
+            vm->in = in;
+            vm->out = out;
+            lopsinvm_attach_program(vm, program);
+            response.status = lopsinvm_start(vm);
+            // frees whatever the program left behind right away, rather than before the next one
+            lopsinvm_reset(vm);
+#ifdef __GLIBC__
+            // and gives it back to the system, a big program would otherwise leave the worker big
+            malloc_trim(0);
+#endif
+        }
+    }
+
+    if (in != NULL) fclose(in);
+    if (out != NULL) fclose(out);
+
+    fflush(stderr);
+    dup2(saved_stderr, STDERR_FILENO);
+    close_fds(fds, COUNT_LOPSIN_SERVE_FDS);
+
+    // the client may be gone already, there is nothing to do about it
+    while (send(conn, &response, sizeof(response), MSG_NOSIGNAL) < 0 && errno == EINTR);
+}
+
+static void worker_main(int listener, const LopsinServeConfig *config)
+{
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    // writing to a client that hung up fails instead
+    signal(SIGPIPE, SIG_IGN);
+
+    int saved_stderr = dup(STDERR_FILENO);
+    if (saved_stderr < 0) {
+        fprintf(stderr, "ERROR: Could not duplicate stderr: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    LopsinVM vm;
+    lopsinvm_new_with_stacks(&vm, config->dstack_size, config->rstack_size);
+    vm.debug_mode = config->debug_mode;
+
+    static Serve_Cache cache;
+    cache.dir = config->cache_dir;
+
+    for (;;) {
+        int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "ERROR: Could not accept connection: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        serve_connection(&vm, &cache, conn, saved_stderr);
+        close(conn);
+    }
+}
+
+static pid_t spawn_worker(int listener, const LopsinServeConfig *config)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "ERROR: Could not fork worker: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        worker_main(listener, config);
+        exit(0);
+    }
+
+    return pid;
+}
+
+// Binds a listening socket at path, replacing a stale one left there.
+static int serve_listen(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t len = strlen(path);
+    if (len >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: Socket path %s is too long\n", path);
+        return -1;
+    }
+    memcpy(addr.sun_path, path, len + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // only a socket nothing listens on anymore is removed, anything else makes bind() fail
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "ERROR: A server is already listening on %s\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "ERROR: Could not bind socket to %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, LOPSIN_SERVE_BACKLOG) != 0) {
+        fprintf(stderr, "ERROR: Could not listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    return fd;
+}
+
+int lopsin_serve(const char *path, const LopsinServeConfig *config)
+{
+    assert(config->workers > 0);
+
+    int listener = serve_listen(path);
+    if (listener < 0) return 1;
+
+    // no SA_RESTART, so that waitpid() below returns once asked to stop
+    struct sigaction action = {0};
+    action.sa_handler = &serve_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    pid_t *workers = NOTNULL(calloc(config->workers, sizeof(pid_t)));
+    for (size_t i = 0; i < config->workers; i++) {
+        workers[i] = spawn_worker(listener, config);
+    }
+
+    fprintf(stderr, "INFO: Serving on %s with %zu workers\n", path, config->workers);
+
+    while (!serve_stopping) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            // every worker failed to start
+            break;
+        }
+
+        // a worker only dies if a program brought it down, the others kept serving meanwhile
+        for (size_t i = 0; i < config->workers; i++) {
+            if (workers[i] != pid) continue;
+
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "WARNING: Worker %d was killed by signal %d\n", (int) pid, WTERMSIG(status));
+            } else {
+                fprintf(stderr, "WARNING: Worker %d exited with status %d\n", (int) pid, WEXITSTATUS(status));
+            }
+            workers[i] = serve_stopping ? -1 : spawn_worker(listener, config);
+        }
+    }
+
+    for (size_t i = 0; i < config->workers; i++) {
+        if (workers[i] > 0) kill(workers[i], SIGTERM);
+    }
+    for (size_t i = 0; i < config->workers; i++) {
+        if (workers[i] > 0) waitpid(workers[i], NULL, 0);
+    }
+
+    free(workers);
+    close(listener);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_SERVE_H_
+#define LOPSINVM_SERVE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/// `lopsinvm --serve <socket>` forks worker processes that take turns accepting connections on
+/// a Unix domain socket. Each one runs the programs it is sent in the same VM, one after the
+/// other, and keeps the programs it loaded, so that running one again skips reading it from
+/// disk, verifying it and setting up the VM. `lopsinrun` is the client.
+///
+/// A request is a LopsinServeRequest, with the descriptors of the program and of the streams
+/// it runs with attached (SCM_RIGHTS), in the order of LopsinServeFd. The worker reads the
+/// program from its descriptor, so it only runs programs the client could open. Once the
+/// program is done, it answers with a LopsinServeResponse and closes the connection.
+
+#define LOPSIN_SERVE_PROTOCOL_VERSION 1
+#define LOPSIN_SERVE_NAME_CAP 256
+
+typedef enum {
+    LOPSIN_SERVE_FD_PROGRAM = 0,
+    LOPSIN_SERVE_FD_STDIN,
+    LOPSIN_SERVE_FD_STDOUT,
+    LOPSIN_SERVE_FD_STDERR,
+    COUNT_LOPSIN_SERVE_FDS,
+} LopsinServeFd;
+
+typedef struct {
+    uint32_t version;
+    /// The path the client opened the program from, NUL-terminated. Only used in error messages.
+    char name[LOPSIN_SERVE_NAME_CAP];
+} LopsinServeRequest;
+
+typedef struct {
+    /// What `lopsinvm <program>` would have exited with.
+    int32_t status;
+} LopsinServeResponse;
+
+typedef struct {
+    /// Worker processes, ie how many programs can run at once.
+    size_t workers;
+    size_t dstack_size;
+    size_t rstack_size;
+    bool debug_mode;
+    /// Where the workers cache the programs they verified, NULL for none, see lopsinvm_cache.h.
+    const char *cache_dir;
+} LopsinServeConfig;
+
+/// Serves requests on a socket bound at path until SIGINT or SIGTERM, and returns the exit
+/// status of the server. A socket left at path by a server that is gone is replaced.
+int lopsin_serve(const char *path, const LopsinServeConfig *);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LOPSINVM_SERVE_H_ */
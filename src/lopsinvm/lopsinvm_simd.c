@@ -0,0 +1,313 @@
+#include "./lopsinvm_simd.h"
+
+#include <math.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LOPSIN_SIMD_AVX2
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+static bool has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// Integer arithmetic wraps around, like it does on the data stack.
+static inline int64_t wrap_add(int64_t a, int64_t b) { return (int64_t) ((uint64_t) a + (uint64_t) b); }
+static inline int64_t wrap_mul(int64_t a, int64_t b) { return (int64_t) ((uint64_t) a * (uint64_t) b); }
+
+// The order every f64 reduction adds up its 4 lanes in, whichever path computed them.
+static inline double combine_lanes(const double lane[4])
+{
+    return (lane[0] + lane[1]) + (lane[2] + lane[3]);
+}
+
+// vmin/vmax skip NaNs, so that the result is only NaN if every element is. They keep the min or
+// max of 4 interleaved lanes like the sums do, so that which of two equal values (-0 and +0) they
+// return doesn't depend on the CPU either.
+static inline bool minmax_f64_takes(double x, double m, bool max)
+{
+    return isnan(m) || (max ? x > m : x < m);
+}
+
+// Combines the lanes, then goes on with a[i..n).
+static double minmax_f64_finish(const double lane[4], const double *a, size_t i, size_t n, bool max)
+{
+    double m = lane[0];
+    for (size_t k = 1; k < 4; k++) {
+        if (minmax_f64_takes(lane[k], m, max)) m = lane[k];
+    }
+    for (; i < n; i++) {
+        if (minmax_f64_takes(a[i], m, max)) m = a[i];
+    }
+    return m;
+}
+
+static double minmax_f64(const double *a, size_t n, bool max)
+{
+    if (n < 4) {
+        double m = a[0];
+        for (size_t i = 1; i < n; i++) {
+            if (minmax_f64_takes(a[i], m, max)) m = a[i];
+        }
+        return m;
+    }
+
+    double lane[4] = { a[0], a[1], a[2], a[3] };
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        for (size_t k = 0; k < 4; k++) {
+            if (minmax_f64_takes(a[i + k], lane[k], max)) lane[k] = a[i + k];
+        }
+    }
+    return minmax_f64_finish(lane, a, i, n, max);
+}
+
+#ifdef LOPSIN_SIMD_AVX2
+
+AVX2 static void add_i64_avx2(int64_t *dst, const int64_t *a, const int64_t *b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) &a[i]);
+        __m256i y = _mm256_loadu_si256((const __m256i *) &b[i]);
+        _mm256_storeu_si256((__m256i *) &dst[i], _mm256_add_epi64(x, y));
+    }
+    for (; i < n; i++) dst[i] = wrap_add(a[i], b[i]);
+}
+
+AVX2 static void add_f64_avx2(double *dst, const double *a, const double *b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(&dst[i], _mm256_add_pd(_mm256_loadu_pd(&a[i]), _mm256_loadu_pd(&b[i])));
+    }
+    for (; i < n; i++) dst[i] = a[i] + b[i];
+}
+
+AVX2 static void mul_f64_avx2(double *dst, const double *a, const double *b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(&dst[i], _mm256_mul_pd(_mm256_loadu_pd(&a[i]), _mm256_loadu_pd(&b[i])));
+    }
+    for (; i < n; i++) dst[i] = a[i] * b[i];
+}
+
+AVX2 static void scale_f64_avx2(double *dst, const double *a, double k, size_t n)
+{
+    __m256d kv = _mm256_set1_pd(k);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(&dst[i], _mm256_mul_pd(_mm256_loadu_pd(&a[i]), kv));
+    }
+    for (; i < n; i++) dst[i] = a[i] * k;
+}
+
+AVX2 static int64_t sum_i64_avx2(const int64_t *a, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i *) &a[i]));
+    }
+
+    int64_t lane[4];
+    _mm256_storeu_si256((__m256i *) lane, acc);
+    int64_t sum = wrap_add(wrap_add(lane[0], lane[1]), wrap_add(lane[2], lane[3]));
+    for (; i < n; i++) sum = wrap_add(sum, a[i]);
+    return sum;
+}
+
+AVX2 static double sum_f64_avx2(const double *a, size_t n)
+{
+    __m256d acc = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_add_pd(acc, _mm256_loadu_pd(&a[i]));
+    }
+
+    double lane[4];
+    _mm256_storeu_pd(lane, acc);
+    double sum = combine_lanes(lane);
+    for (; i < n; i++) sum += a[i];
+    return sum;
+}
+
+AVX2 static double dot_f64_avx2(const double *a, const double *b, size_t n)
+{
+    __m256d acc = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_loadu_pd(&a[i]), _mm256_loadu_pd(&b[i])));
+    }
+
+    double lane[4];
+    _mm256_storeu_pd(lane, acc);
+    double sum = combine_lanes(lane);
+    for (; i < n; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+// AVX2 has no 64-bit integer min/max, so they compare and blend.
+AVX2 static int64_t minmax_i64_avx2(const int64_t *a, size_t n, bool max)
+{
+    int64_t m = a[0];
+    size_t i = 0;
+
+    if (n >= 4) {
+        __m256i acc = _mm256_loadu_si256((const __m256i *) a);
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) &a[i]);
+            __m256i take = max ? _mm256_cmpgt_epi64(v, acc) : _mm256_cmpgt_epi64(acc, v);
+            acc = _mm256_blendv_epi8(acc, v, take);
+        }
+
+        int64_t lane[4];
+        _mm256_storeu_si256((__m256i *) lane, acc);
+        m = lane[0];
+        for (size_t k = 1; k < 4; k++) {
+            if (max ? lane[k] > m : lane[k] < m) m = lane[k];
+        }
+    }
+
+    for (; i < n; i++) {
+        if (max ? a[i] > m : a[i] < m) m = a[i];
+    }
+    return m;
+}
+
+AVX2 static double minmax_f64_avx2(const double *a, size_t n, bool max)
+{
+    if (n < 4) return minmax_f64(a, n, max);
+
+    // the same comparisons as minmax_f64_takes(), rather than max_pd/min_pd which don't skip NaNs
+    __m256d acc = _mm256_loadu_pd(a);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(&a[i]);
+        __m256d beats = max ? _mm256_cmp_pd(v, acc, _CMP_GT_OQ) : _mm256_cmp_pd(v, acc, _CMP_LT_OQ);
+        __m256d take = _mm256_or_pd(beats, _mm256_cmp_pd(acc, acc, _CMP_UNORD_Q));
+        acc = _mm256_blendv_pd(acc, v, take);
+    }
+
+    double lane[4];
+    _mm256_storeu_pd(lane, acc);
+    return minmax_f64_finish(lane, a, i, n, max);
+}
+
+#define DISPATCH(name, ...) do { if (has_avx2()) return name##_avx2(__VA_ARGS__); } while (0)
+#define DISPATCH_VOID(name, ...) do { if (has_avx2()) { name##_avx2(__VA_ARGS__); return; } } while (0)
+#else
+#define DISPATCH(name, ...) do { } while (0)
+#define DISPATCH_VOID(name, ...) do { } while (0)
+#endif // LOPSIN_SIMD_AVX2
+
+void lopsin_simd_add_i64(int64_t *dst, const int64_t *a, const int64_t *b, size_t n)
+{
+    DISPATCH_VOID(add_i64, dst, a, b, n);
+    for (size_t i = 0; i < n; i++) dst[i] = wrap_add(a[i], b[i]);
+}
+
+void lopsin_simd_add_f64(double *dst, const double *a, const double *b, size_t n)
+{
+    DISPATCH_VOID(add_f64, dst, a, b, n);
+    for (size_t i = 0; i < n; i++) dst[i] = a[i] + b[i];
+}
+
+// AVX2 has no 64-bit integer multiply, the plain loops are as good as it gets.
+void lopsin_simd_mul_i64(int64_t *dst, const int64_t *a, const int64_t *b, size_t n)
+{
+    for (size_t i = 0; i < n; i++) dst[i] = wrap_mul(a[i], b[i]);
+}
+
+void lopsin_simd_mul_f64(double *dst, const double *a, const double *b, size_t n)
+{
+    DISPATCH_VOID(mul_f64, dst, a, b, n);
+    for (size_t i = 0; i < n; i++) dst[i] = a[i] * b[i];
+}
+
+void lopsin_simd_scale_i64(int64_t *dst, const int64_t *a, int64_t k, size_t n)
+{
+    for (size_t i = 0; i < n; i++) dst[i] = wrap_mul(a[i], k);
+}
+
+void lopsin_simd_scale_f64(double *dst, const double *a, double k, size_t n)
+{
+    DISPATCH_VOID(scale_f64, dst, a, k, n);
+    for (size_t i = 0; i < n; i++) dst[i] = a[i] * k;
+}
+
+int64_t lopsin_simd_sum_i64(const int64_t *a, size_t n)
+{
+    DISPATCH(sum_i64, a, n);
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++) sum = wrap_add(sum, a[i]);
+    return sum;
+}
+
+double lopsin_simd_sum_f64(const double *a, size_t n)
+{
+    DISPATCH(sum_f64, a, n);
+    double lane[4] = {0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (size_t k = 0; k < 4; k++) lane[k] += a[i + k];
+    }
+
+    double sum = combine_lanes(lane);
+    for (; i < n; i++) sum += a[i];
+    return sum;
+}
+
+int64_t lopsin_simd_dot_i64(const int64_t *a, const int64_t *b, size_t n)
+{
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++) sum = wrap_add(sum, wrap_mul(a[i], b[i]));
+    return sum;
+}
+
+double lopsin_simd_dot_f64(const double *a, const double *b, size_t n)
+{
+    DISPATCH(dot_f64, a, b, n);
+    double lane[4] = {0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (size_t k = 0; k < 4; k++) lane[k] += a[i + k] * b[i + k];
+    }
+
+    double sum = combine_lanes(lane);
+    for (; i < n; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+int64_t lopsin_simd_min_i64(const int64_t *a, size_t n)
+{
+    DISPATCH(minmax_i64, a, n, false);
+    int64_t m = a[0];
+    for (size_t i = 1; i < n; i++) if (a[i] < m) m = a[i];
+    return m;
+}
+
+int64_t lopsin_simd_max_i64(const int64_t *a, size_t n)
+{
+    DISPATCH(minmax_i64, a, n, true);
+    int64_t m = a[0];
+    for (size_t i = 1; i < n; i++) if (a[i] > m) m = a[i];
+    return m;
+}
+
+double lopsin_simd_min_f64(const double *a, size_t n)
+{
+    DISPATCH(minmax_f64, a, n, false);
+    return minmax_f64(a, n, false);
+}
+
+double lopsin_simd_max_f64(const double *a, size_t n)
+{
+    DISPATCH(minmax_f64, a, n, true);
+    return minmax_f64(a, n, true);
+}
@@ -0,0 +1,49 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_SIMD_H_
+#define LOPSINVM_SIMD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/// Kernels behind the `v*` natives. They use AVX2 when the CPU has it, and plain loops
+/// otherwise (which the compiler vectorizes for the baseline, eg SSE2 on x86-64).
+///
+/// Element-wise kernels write dst[i] = a[i] op b[i]. dst may be a or b, but must not
+/// overlap them otherwise.
+///
+/// Floating point sums are added up in 4 interleaved lanes on every CPU, so results
+/// are the same with and without AVX2, but may differ from a sequential loop.
+/// vmin/vmax skip NaNs, and only return NaN if every element is one. Of equal values
+/// (like -0 and +0), which one they return is the same with and without AVX2.
+
+void lopsin_simd_add_i64(int64_t *dst, const int64_t *a, const int64_t *b, size_t n);
+void lopsin_simd_add_f64(double *dst, const double *a, const double *b, size_t n);
+void lopsin_simd_mul_i64(int64_t *dst, const int64_t *a, const int64_t *b, size_t n);
+void lopsin_simd_mul_f64(double *dst, const double *a, const double *b, size_t n);
+void lopsin_simd_scale_i64(int64_t *dst, const int64_t *a, int64_t k, size_t n);
+void lopsin_simd_scale_f64(double *dst, const double *a, double k, size_t n);
+
+int64_t lopsin_simd_sum_i64(const int64_t *a, size_t n);
+double lopsin_simd_sum_f64(const double *a, size_t n);
+int64_t lopsin_simd_dot_i64(const int64_t *a, const int64_t *b, size_t n);
+double lopsin_simd_dot_f64(const double *a, const double *b, size_t n);
+
+/// n must be at least 1.
+int64_t lopsin_simd_min_i64(const int64_t *a, size_t n);
+int64_t lopsin_simd_max_i64(const int64_t *a, size_t n);
+double lopsin_simd_min_f64(const double *a, size_t n);
+double lopsin_simd_max_f64(const double *a, size_t n);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LOPSINVM_SIMD_H_ */
@@ -0,0 +1,320 @@
+#include "./lopsinvm_sort.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Below this many elements, pdqsort beats the 8 passes of the radix sort.
+#define LOPSIN_SORT_RADIX_MIN 128
+
+// pdqsort's tuning, see https://github.com/orlp/pdqsort
+#define INSERTION_SORT_MAX 24
+#define NINTHER_MIN 128
+#define PARTIAL_INSERTION_SORT_LIMIT 8
+
+typedef struct {
+    // NULL to compare the values as unsigned integers
+    LopsinSortLessProc less;
+    void *user;
+} Sort_Ctx;
+
+static inline bool less(const Sort_Ctx *ctx, uint64_t a, uint64_t b)
+{
+    if (ctx->less == NULL) return a < b;
+    return ctx->less(a, b, ctx->user);
+}
+
+static inline void swap(uint64_t *a, size_t i, size_t j)
+{
+    uint64_t t = a[i];
+    a[i] = a[j];
+    a[j] = t;
+}
+
+// Every loop below is bounded by the indices it walks, rather than by the order of the
+// elements like pdqsort's unguarded loops, so that an inconsistent order can't make it
+// run off the array.
+
+static void insertion_sort(const Sort_Ctx *ctx, uint64_t *a, size_t begin, size_t end)
+{
+    for (size_t i = begin + 1; i < end; i++) {
+        uint64_t x = a[i];
+        size_t j = i;
+        while (j > begin && less(ctx, x, a[j - 1])) {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = x;
+    }
+}
+
+// Gives up, returning false, once it moved more than PARTIAL_INSERTION_SORT_LIMIT elements.
+static bool partial_insertion_sort(const Sort_Ctx *ctx, uint64_t *a, size_t begin, size_t end)
+{
+    size_t moved = 0;
+    for (size_t i = begin + 1; i < end; i++) {
+        uint64_t x = a[i];
+        size_t j = i;
+        while (j > begin && less(ctx, x, a[j - 1])) {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = x;
+
+        moved += i - j;
+        if (moved > PARTIAL_INSERTION_SORT_LIMIT) return false;
+    }
+    return true;
+}
+
+static void sift_down(const Sort_Ctx *ctx, uint64_t *a, size_t root, size_t n)
+{
+    for (;;) {
+        size_t child = 2 * root + 1;
+        if (child >= n) return;
+        if (child + 1 < n && less(ctx, a[child], a[child + 1])) child++;
+        if (!less(ctx, a[root], a[child])) return;
+        swap(a, root, child);
+        root = child;
+    }
+}
+
+static void heap_sort(const Sort_Ctx *ctx, uint64_t *a, size_t n)
+{
+    for (size_t i = n / 2; i-- > 0;) sift_down(ctx, a, i, n);
+    for (size_t i = n; i-- > 1;) {
+        swap(a, 0, i);
+        sift_down(ctx, a, 0, i);
+    }
+}
+
+static void sort2(const Sort_Ctx *ctx, uint64_t *a, size_t i, size_t j)
+{
+    if (less(ctx, a[j], a[i])) swap(a, i, j);
+}
+
+// Leaves the median of the three in j.
+static void sort3(const Sort_Ctx *ctx, uint64_t *a, size_t i, size_t j, size_t k)
+{
+    sort2(ctx, a, i, j);
+    sort2(ctx, a, j, k);
+    sort2(ctx, a, i, j);
+}
+
+// Partitions [begin, end) around the pivot in a[begin]: smaller elements to its left, the
+// others to its right. Returns where the pivot ended up, and whether nothing had to move.
+static size_t partition_right(const Sort_Ctx *ctx, uint64_t *a, size_t begin, size_t end, bool *already_partitioned)
+{
+    uint64_t pivot = a[begin];
+    size_t first = begin + 1;
+    size_t last = end;
+
+    while (first < last && less(ctx, a[first], pivot)) first++;
+    while (last > first && !less(ctx, a[last - 1], pivot)) last--;
+
+    *already_partitioned = first >= last;
+
+    while (first < last) {
+        swap(a, first, last - 1);
+        first++;
+        last--;
+        while (first < last && less(ctx, a[first], pivot)) first++;
+        while (last > first && !less(ctx, a[last - 1], pivot)) last--;
+    }
+
+    size_t pivot_pos = first - 1;
+    a[begin] = a[pivot_pos];
+    a[pivot_pos] = pivot;
+    return pivot_pos;
+}
+
+// Like partition_right(), but elements equal to the pivot go to its left. Used when the
+// pivot equals the element right before the range, so that runs of equal elements are
+// done with in one pass.
+static size_t partition_left(const Sort_Ctx *ctx, uint64_t *a, size_t begin, size_t end)
+{
+    uint64_t pivot = a[begin];
+    size_t first = begin + 1;
+    size_t last = end;
+
+    while (last > first && less(ctx, pivot, a[last - 1])) last--;
+    while (first < last && !less(ctx, pivot, a[first])) first++;
+
+    while (first < last) {
+        swap(a, first, last - 1);
+        first++;
+        last--;
+        while (first < last && !less(ctx, pivot, a[first])) first++;
+        while (last > first && less(ctx, pivot, a[last - 1])) last--;
+    }
+
+    size_t pivot_pos = first - 1;
+    a[begin] = a[pivot_pos];
+    a[pivot_pos] = pivot;
+    return pivot_pos;
+}
+
+// Swaps a few elements of a badly unbalanced side around, to break the pattern that caused it.
+static void break_patterns(uint64_t *a, size_t begin, size_t end)
+{
+    size_t size = end - begin;
+    if (size < INSERTION_SORT_MAX) return;
+
+    swap(a, begin, begin + size / 4);
+    swap(a, end - 1, end - size / 4);
+    if (size > NINTHER_MIN) {
+        swap(a, begin + 1, begin + size / 4 + 1);
+        swap(a, begin + 2, begin + size / 4 + 2);
+        swap(a, end - 2, end - size / 4 - 1);
+        swap(a, end - 3, end - size / 4 - 2);
+    }
+}
+
+static void pdqsort_loop(const Sort_Ctx *ctx, uint64_t *a, size_t begin, size_t end, int bad_allowed, bool leftmost)
+{
+    for (;;) {
+        size_t size = end - begin;
+        if (size < INSERTION_SORT_MAX) {
+            insertion_sort(ctx, a, begin, end);
+            return;
+        }
+
+        // move the pivot to begin
+        size_t half = size / 2;
+        if (size > NINTHER_MIN) {
+            sort3(ctx, a, begin, begin + half, end - 1);
+            sort3(ctx, a, begin + 1, begin + half - 1, end - 2);
+            sort3(ctx, a, begin + 2, begin + half + 1, end - 3);
+            sort3(ctx, a, begin + half - 1, begin + half, begin + half + 1);
+            swap(a, begin, begin + half);
+        } else {
+            sort3(ctx, a, begin + half, begin, end - 1);
+        }
+
+        // everything left of the range is smaller than or equal to it, so if the pivot
+        // equals the element right before, the range holds many equal elements
+        if (!leftmost && !less(ctx, a[begin - 1], a[begin])) {
+            begin = partition_left(ctx, a, begin, end) + 1;
+            continue;
+        }
+
+        bool already_partitioned;
+        size_t pivot_pos = partition_right(ctx, a, begin, end, &already_partitioned);
+
+        size_t l_size = pivot_pos - begin;
+        size_t r_size = end - (pivot_pos + 1);
+
+        if (l_size < size / 8 || r_size < size / 8) {
+            if (--bad_allowed == 0) {
+                heap_sort(ctx, a + begin, size);
+                return;
+            }
+            break_patterns(a, begin, pivot_pos);
+            break_patterns(a, pivot_pos + 1, end);
+        } else if (already_partitioned
+                && partial_insertion_sort(ctx, a, begin, pivot_pos)
+                && partial_insertion_sort(ctx, a, pivot_pos + 1, end))
+        {
+            return;
+        }
+
+        pdqsort_loop(ctx, a, begin, pivot_pos, bad_allowed, leftmost);
+        begin = pivot_pos + 1;
+        leftmost = false;
+    }
+}
+
+static void pdqsort(const Sort_Ctx *ctx, uint64_t *a, size_t n)
+{
+    if (n < 2) return;
+
+    int log2 = 0;
+    while ((n >> log2) > 1) log2++;
+    pdqsort_loop(ctx, a, 0, n, log2, true);
+}
+
+// One counting pass per byte, skipping the bytes all keys share.
+// Returns false, leaving the array as is, if there is no memory for the scratch copy.
+static bool radix_sort(uint64_t *a, size_t n)
+{
+    uint64_t *scratch = malloc(n * sizeof(uint64_t));
+    if (scratch == NULL) return false;
+
+    size_t count[8][256] = {0};
+
+    for (size_t i = 0; i < n; i++) {
+        for (size_t byte = 0; byte < 8; byte++) {
+            count[byte][(a[i] >> (byte * 8)) & 0xff]++;
+        }
+    }
+
+    uint64_t *src = a, *dst = scratch;
+    for (size_t byte = 0; byte < 8; byte++) {
+        size_t shift = byte * 8;
+        if (count[byte][(a[0] >> shift) & 0xff] == n) continue;
+
+        size_t offset = 0;
+        for (size_t digit = 0; digit < 256; digit++) {
+            size_t c = count[byte][digit];
+            count[byte][digit] = offset;
+            offset += c;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            dst[count[byte][(src[i] >> shift) & 0xff]++] = src[i];
+        }
+
+        uint64_t *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != a) memcpy(a, src, n * sizeof(uint64_t));
+    free(scratch);
+    return true;
+}
+
+void lopsin_sort_u64(uint64_t *a, size_t n)
+{
+    if (n >= LOPSIN_SORT_RADIX_MIN && radix_sort(a, n)) return;
+
+    Sort_Ctx ctx = {0};
+    pdqsort(&ctx, a, n);
+}
+
+// Both are sorted as unsigned keys that compare the same as the values.
+
+#define SIGN_BIT ((uint64_t) 1 << 63)
+
+void lopsin_sort_i64(int64_t *a, size_t n)
+{
+    uint64_t *keys = (uint64_t *) a;
+    for (size_t i = 0; i < n; i++) keys[i] ^= SIGN_BIT;
+    lopsin_sort_u64(keys, n);
+    for (size_t i = 0; i < n; i++) keys[i] ^= SIGN_BIT;
+}
+
+void lopsin_sort_f64(double *a, size_t n)
+{
+    uint64_t *keys = (uint64_t *) a;
+
+    // negative numbers sort backwards as integers, so all of their bits are flipped
+    for (size_t i = 0; i < n; i++) {
+        uint64_t bits;
+        memcpy(&bits, &a[i], sizeof(bits));
+        keys[i] = bits & SIGN_BIT ? ~bits : bits | SIGN_BIT;
+    }
+    lopsin_sort_u64(keys, n);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t bits = keys[i] & SIGN_BIT ? keys[i] & ~SIGN_BIT : ~keys[i];
+        memcpy(&a[i], &bits, sizeof(bits));
+    }
+}
+
+void lopsin_sort_by(uint64_t *a, size_t n, LopsinSortLessProc less, void *user)
+{
+    Sort_Ctx ctx = {
+        .less = less,
+        .user = user,
+    };
+    pdqsort(&ctx, a, n);
+}
@@ -0,0 +1,34 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_SORT_H_
+#define LOPSINVM_SORT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/// Sorts in ascending order, with an LSD radix sort for large arrays and pdqsort otherwise.
+/// Doubles are sorted by IEEE 754 totalOrder: -NaN < -inf < ... < -0 < +0 < ... < +inf < +NaN.
+void lopsin_sort_u64(uint64_t *a, size_t n);
+void lopsin_sort_i64(int64_t *a, size_t n);
+void lopsin_sort_f64(double *a, size_t n);
+
+/// Returns whether a goes before b.
+typedef bool (*LopsinSortLessProc)(uint64_t a, uint64_t b, void *user);
+
+/// pdqsort with a caller-provided order. The order doesn't have to be consistent:
+/// the array always ends up a permutation of itself, just not necessarily sorted.
+void lopsin_sort_by(uint64_t *a, size_t n, LopsinSortLessProc less, void *user);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LOPSINVM_SORT_H_ */
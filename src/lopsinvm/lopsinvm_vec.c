@@ -0,0 +1,47 @@
+#include "./lopsinvm_vec.h"
+
+#include <stdlib.h>
+
+#include "util.h"
+
+#define LOPSIN_VEC_MIN_CAP 8
+
+LopsinErr lopsinvm_vec_reserve(LopsinVM *vm, LopsinVec *vec, size_t cap)
+{
+    if (cap <= vec->cap) return ERR_OK;
+
+    size_t new_cap = vec->cap < LOPSIN_VEC_MIN_CAP ? LOPSIN_VEC_MIN_CAP : vec->cap * 2;
+    if (new_cap < cap) new_cap = cap;
+    if (new_cap > SIZE_MAX / sizeof(LopsinValue)) return ERR_OUT_OF_MEMORY;
+
+    void *data = vec->data;
+    LopsinErr err = lopsinvm_heap_realloc_owned(vm, &data, new_cap * sizeof(LopsinValue));
+    if (err != ERR_OK) return err;
+
+    vec->data = data;
+    vec->cap = new_cap;
+    return ERR_OK;
+}
+
+int64_t lopsinvm_add_vec(LopsinVM *vm)
+{
+    return handle_table_add(&vm->vecs, NOTNULL(calloc(1, sizeof(LopsinVec))));
+}
+
+LopsinVec *lopsinvm_get_vec(const LopsinVM *vm, int64_t handle)
+{
+    return handle_table_get(&vm->vecs, handle);
+}
+
+bool lopsinvm_remove_vec(LopsinVM *vm, int64_t handle)
+{
+    LopsinVec *vec = handle_table_remove(&vm->vecs, handle);
+    if (vec == NULL) return false;
+
+    if (vec->data != NULL) {
+        lopsinvm_heap_remove_owned(vm, vec->data);
+        free(vec->data);
+    }
+    free(vec);
+    return true;
+}
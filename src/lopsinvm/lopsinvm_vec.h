@@ -0,0 +1,43 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_VEC_H_
+#define LOPSINVM_VEC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "./lopsinvm.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/// A growable array of cells. Its elements live in a chunk of the VM's heap, so the program
+/// can hand `vec_data` to any native that takes an array, until the vector grows again. The
+/// vector owns the chunk, so that `free` and `realloc` can't pull it from under it.
+struct LopsinVec {
+    /// NULL until the first push.
+    LopsinValue *data;
+    size_t len;
+    size_t cap;
+};
+
+/// Makes room for at least `cap` elements, doubling the capacity at least.
+LopsinErr lopsinvm_vec_reserve(LopsinVM *, LopsinVec *, size_t cap);
+
+/// Gives the VM's program a handle to a new, empty vector.
+int64_t lopsinvm_add_vec(LopsinVM *);
+/// NULL if the handle is not one of the VM's.
+LopsinVec *lopsinvm_get_vec(const LopsinVM *, int64_t handle);
+/// Frees the vector and its elements, after which the handle may be given to another one.
+bool lopsinvm_remove_vec(LopsinVM *, int64_t handle);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LOPSINVM_VEC_H_ */
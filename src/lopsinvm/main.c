@@ -1,21 +1,149 @@
 #include "lopsinvm.h"
+#include "lopsinvm_cache.h"
+#include "lopsinvm_chan.h"
+#include "lopsinvm_pfor.h"
+#include "lopsinvm_plugin.h"
+#include "lopsinvm_sched.h"
+#include "lopsinvm_serve.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "util.h"
 
 #define cstreq(a, b) (strcmp(a, b) == 0)
 
+// Room in each channel of the ring `--instances` connects its VMs with.
+#define LOPSINVM_INSTANCES_CHAN_CAP 64
+
 static void usage(FILE *stream, const char *program)
 {
     fprintf(stream, "USAGE: %s <input.lopsinvm> [OPTIONS]\n", program);
+    fprintf(stream, "       %s --serve <socket> [OPTIONS]\n", program);
     fprintf(stream,
         "OPTIONS:\n"
         "   --debug, -d             Enable debug mode\n"
-        "   --help,  -h             Display this help and exit\n");
+        "   --help,  -h             Display this help and exit\n"
+        "   --stats                 Report the memory used by the VM before and after running\n"
+        "   --dstack-size <n>       Room for at least n values on the data stack (default %d)\n"
+        "   --rstack-size <n>       Room for at least n return addresses on the return stack (default %d)\n"
+        "   --pfor-workers <n>      Threads `pfor` runs slices on, besides the calling one (default: cores - 1)\n"
+        "   --native-lib <path>     Load a plugin that adds natives, see lopsinvm_plugin.h (can be repeated)\n"
+        "   --cache-dir <dir>       Keep verified programs in dir, see lopsinvm_cache.h (default: $" LOPSIN_CACHE_DIR_ENV ",\n"
+        "                           $XDG_CACHE_HOME/lopsinvm or ~/.cache/lopsinvm)\n"
+        "   --no-cache              Verify the program on every run rather than caching it\n"
+        "   --instances <n>         Run n VMs of the program on the scheduler, in a ring of channels (see README)\n"
+        "   --sched-workers <n>     Threads `--instances` runs the VMs on (default: cores)\n"
+        "   --serve <socket>        Run the programs sent by `lopsinrun` to a Unix socket, see lopsinvm_serve.h\n"
+        "   --serve-workers <n>     Programs `--serve` runs at once, each in a process of its own (default: cores)\n",
+        LOPSINVM_DEFAULT_DSTACK_CAP, LOPSINVM_DEFAULT_RSTACK_CAP);
+}
+
+static size_t parse_count(const char *program, const char *flag, const char *value, bool allow_zero)
+{
+    if (value == NULL) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No value provided for `%s`\n", flag);
+        exit(1);
+    }
+
+    char *end = NULL;
+    unsigned long long count = strtoull(value, &end, 0);
+    if (*value == '\0' || *end != '\0' || (count == 0 && !allow_zero)) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: Invalid value `%s` for `%s`\n", value, flag);
+        exit(1);
+    }
+
+    return (size_t) count;
+}
+
+static void print_stats(FILE *stream, const char *when, const LopsinVM *vm)
+{
+    LopsinVMStats stats;
+    lopsinvm_mem_stats(vm, &stats);
+
+    fprintf(stream,
+        "%s VM:\n"
+        "   VM struct:    %zu bytes\n"
+        "   Stacks:       %zu bytes touched, of %zu reserved\n"
+        "   Heap table:   %zu bytes\n"
+        "   Heap:         %zu bytes\n"
+        "   Fiber table:  %zu bytes\n"
+        "   Total:        %zu bytes\n",
+        when,
+        stats.vm_bytes,
+        stats.stacks_resident, stats.stacks_reserved,
+        stats.heap_table_bytes,
+        stats.heap_bytes,
+        stats.fiber_table_bytes,
+        stats.vm_bytes + stats.stacks_resident + stats.heap_table_bytes + stats.heap_bytes + stats.fiber_table_bytes);
+}
+
+typedef struct {
+    size_t index;
+    LopsinErr err;
+} Instance;
+
+static void instance_done(LopsinVM *vm, LopsinRunStatus status, LopsinErr err, void *user)
+{
+    Instance *instance = user;
+    if (status == LOPSIN_RUN_ERROR) {
+        fprintf(stderr, "ERROR: Instance %zu: At inst %zu: %s\n", instance->index, vm->ip, ERR_AS_CSTR(err));
+        instance->err = err;
+    }
+}
+
+// Runs `count` VMs of the program on the scheduler. VM i starts with ( i count -- ) on its data
+// stack, receives from VM i - 1 on channel 0, and sends to VM i + 1 on channel 1, all the way
+// around. Returns the error of the first VM that failed, if any.
+static LopsinErr run_instances(LopsinProgram *program, size_t count, size_t workers,
+                               size_t dstack_size, size_t rstack_size, bool debug_mode)
+{
+    LopsinVM *vms = NOTNULL(aligned_alloc(LOPSINVM_CACHE_LINE, count * sizeof(LopsinVM)));
+    Instance *instances = NOTNULL(calloc(count, sizeof(Instance)));
+    LopsinChan **ring = NOTNULL(malloc(count * sizeof(LopsinChan *)));
+
+    for (size_t i = 0; i < count; i++) {
+        ring[i] = lopsin_chan_new(LOPSINVM_INSTANCES_CHAN_CAP);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        LopsinVM *vm = &vms[i];
+        lopsinvm_new_with_stacks(vm, dstack_size, rstack_size);
+        vm->debug_mode = debug_mode;
+        lopsinvm_attach_program(vm, program);
+        lopsinvm_add_chan(vm, ring[(i + count - 1) % count]);
+        lopsinvm_add_chan(vm, ring[i]);
+        vm->dstack[vm->dsp++].as_i64 = i;
+        vm->dstack[vm->dsp++].as_i64 = count;
+        instances[i].index = i;
+    }
+
+    // the VMs hold on to the channels from here
+    for (size_t i = 0; i < count; i++) {
+        lopsin_chan_release(ring[i]);
+    }
+
+    LopsinSched *sched = lopsin_sched_new(workers, count, LOPSIN_SCHED_DEFAULT_BUDGET);
+    for (size_t i = 0; i < count; i++) {
+        lopsin_sched_submit(sched, &vms[i], &instance_done, &instances[i]);
+    }
+    lopsin_sched_free(sched);
+
+    LopsinErr err = ERR_OK;
+    for (size_t i = 0; i < count; i++) {
+        if (err == ERR_OK) err = instances[i].err;
+        lopsinvm_free(&vms[i]);
+    }
+
+    free(ring);
+    free(instances);
+    free(vms);
+    return err;
 }
 
 int main(int argc, const char **argv)
@@ -28,8 +156,20 @@ int main(int argc, const char **argv)
 
     struct {
         const char *input_file;
+        const char *serve_socket;
+        size_t serve_workers;
+        size_t instances;
+        size_t sched_workers;
+        const char *cache_dir;
+        bool no_cache;
         bool debug_mode;
-    } args = {0};
+        bool stats;
+        size_t dstack_size;
+        size_t rstack_size;
+    } args = {
+        .dstack_size = LOPSINVM_DEFAULT_DSTACK_CAP,
+        .rstack_size = LOPSINVM_DEFAULT_RSTACK_CAP,
+    };
 
     while (*argv != NULL) {
         const char *arg = *argv++;
@@ -39,6 +179,49 @@ int main(int argc, const char **argv)
             exit(0);
         } else if (cstreq(arg, "--debug") || cstreq(arg, "-d")) {
             args.debug_mode = true;
+        } else if (cstreq(arg, "--stats")) {
+            args.stats = true;
+        } else if (cstreq(arg, "--dstack-size")) {
+            args.dstack_size = parse_count(program_name, arg, *argv, false);
+            argv++;
+        } else if (cstreq(arg, "--rstack-size")) {
+            args.rstack_size = parse_count(program_name, arg, *argv, false);
+            argv++;
+        } else if (cstreq(arg, "--pfor-workers")) {
+            lopsin_pfor_set_workers(parse_count(program_name, arg, *argv, true));
+            argv++;
+        } else if (cstreq(arg, "--instances")) {
+            args.instances = parse_count(program_name, arg, *argv, false);
+            argv++;
+        } else if (cstreq(arg, "--sched-workers")) {
+            args.sched_workers = parse_count(program_name, arg, *argv, false);
+            argv++;
+        } else if (cstreq(arg, "--serve")) {
+            if (*argv == NULL) {
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No value provided for `%s`\n", arg);
+                exit(1);
+            }
+            args.serve_socket = *argv++;
+        } else if (cstreq(arg, "--serve-workers")) {
+            args.serve_workers = parse_count(program_name, arg, *argv, false);
+            argv++;
+        } else if (cstreq(arg, "--cache-dir")) {
+            if (*argv == NULL) {
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No value provided for `%s`\n", arg);
+                exit(1);
+            }
+            args.cache_dir = *argv++;
+        } else if (cstreq(arg, "--no-cache")) {
+            args.no_cache = true;
+        } else if (cstreq(arg, "--native-lib")) {
+            if (*argv == NULL) {
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No value provided for `%s`\n", arg);
+                exit(1);
+            }
+            lopsin_plugin_load(*argv++);
         } else {
             // throw error if we already have an input file
             if (args.input_file != NULL) {
@@ -51,19 +234,64 @@ int main(int argc, const char **argv)
         }
     }
 
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t cores = online > 0 ? (size_t) online : 1;
+
+    char *default_cache_dir = NULL;
+    if (!args.no_cache && args.cache_dir == NULL) default_cache_dir = lopsin_cache_default_dir();
+    const char *cache_dir = args.no_cache ? NULL : args.cache_dir != NULL ? args.cache_dir : default_cache_dir;
+
+    if (args.serve_socket != NULL) {
+        if (args.input_file != NULL) {
+            usage(stderr, program_name);
+            fprintf(stderr, "ERROR: `--serve` runs the programs it is sent, not `%s`\n", args.input_file);
+            exit(1);
+        }
+
+        LopsinServeConfig config = {
+            .workers = args.serve_workers > 0 ? args.serve_workers : cores,
+            .dstack_size = args.dstack_size,
+            .rstack_size = args.rstack_size,
+            .debug_mode = args.debug_mode,
+            .cache_dir = cache_dir,
+        };
+        int status = lopsin_serve(args.serve_socket, &config);
+        free(default_cache_dir);
+        return status;
+    }
+
     if (args.input_file == NULL) {
         usage(stderr, program_name);
         fprintf(stderr, "ERROR: No input file provided\n");
         exit(1);
     }
 
-    static LopsinVM vm;
-    lopsinvm_new(&vm);
+    LopsinProgram *program = lopsin_cache_load_from_file(cache_dir, args.input_file);
+    free(default_cache_dir);
+
+    if (args.instances > 0) {
+        LopsinErr err = run_instances(program, args.instances, args.sched_workers > 0 ? args.sched_workers : cores,
+                                      args.dstack_size, args.rstack_size, args.debug_mode);
+        lopsin_program_release(program);
+        lopsin_pfor_shutdown();
+        return err;
+    }
+
+    LopsinVM vm;
+    lopsinvm_new_with_stacks(&vm, args.dstack_size, args.rstack_size);
     vm.debug_mode = args.debug_mode;
 
-    lopsinvm_load_program_from_file(&vm, args.input_file);
+    lopsinvm_attach_program(&vm, program);
+    lopsin_program_release(program);
+
+    if (args.stats) print_stats(stderr, "Idle", &vm);
 
     LopsinErr errlvl = lopsinvm_start(&vm);
 
+    if (args.stats) print_stats(stderr, "Finished", &vm);
+
+    lopsinvm_free(&vm);
+    lopsin_pfor_shutdown();
+
     return errlvl;
 }
@@ -12,15 +12,63 @@ extern "C"
 {
 #endif /* __cplusplus */
 
-static_assert(COUNT_LOPSIN_NATIVES == 8, "Exhaustive declaration of native functions");
-LopsinErr lopsin_native_putx   (LopsinVM *vm);
-LopsinErr lopsin_native_puti   (LopsinVM *vm);
-LopsinErr lopsin_native_putf   (LopsinVM *vm);
-LopsinErr lopsin_native_putc   (LopsinVM *vm);
-LopsinErr lopsin_native_read   (LopsinVM *vm);
-LopsinErr lopsin_native_malloc (LopsinVM *vm);
-LopsinErr lopsin_native_free   (LopsinVM *vm);
-LopsinErr lopsin_native_time   (LopsinVM *vm);
+static_assert(COUNT_LOPSIN_NATIVES == 56, "Exhaustive declaration of native functions");
+LopsinErr lopsin_native_putx   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_puti   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_putf   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_putc   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_read   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_malloc (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_free   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_time   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_puts   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_chan_new  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_chan_send (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_chan_recv (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_pfor   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vadd_i64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vadd_f64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vmul_i64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vmul_f64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vscale_i64(LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vscale_f64(LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vsum_i64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vsum_f64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vdot_i64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vdot_f64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vmin_i64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vmin_f64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vmax_i64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vmax_f64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_memcpy    (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_memmove   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_memset    (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_memcmp    (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_sort_i64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_sort_u64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_sort_f64  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_sort_by   (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_new        (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_new_bytes  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_free       (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_count      (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_put        (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_get        (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_del        (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_iter       (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_put_bytes  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_get_bytes  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_del_bytes  (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_map_iter_bytes (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_realloc        (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vec_new        (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vec_free       (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vec_push       (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vec_pop        (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vec_get        (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vec_set        (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vec_len        (LopsinVM *vm, LopsinValue *args);
+LopsinErr lopsin_native_vec_data       (LopsinVM *vm, LopsinValue *args);
 
 #ifdef __cplusplus
 }
@@ -36,95 +84,105 @@ LopsinErr lopsin_native_time   (LopsinVM *vm);
 #include <string.h>
 #include <errno.h>
 #include "./lopsinvm.h"
+#include "./lopsinvm_chan.h"
+#include "./lopsinvm_map.h"
+#include "./lopsinvm_vec.h"
+#include "./lopsinvm_pfor.h"
+#include "./lopsinvm_simd.h"
+#include "./lopsinvm_sort.h"
 
-static_assert(COUNT_LOPSIN_NATIVES == 8, "Exhaustive definition of native functions");
+static_assert(COUNT_LOPSIN_NATIVES == 56, "Exhaustive definition of native functions");
 
-LopsinErr lopsin_native_putx(LopsinVM *vm)
+// The VM checked the stack against the arity and results of every native in LOPSIN_NATIVES,
+// see LopsinNativeProc. The stack effect of each one is written above it.
+
+// ( x -- )
+LopsinErr lopsin_native_putx(LopsinVM *vm, LopsinValue *args)
 {
-    if (vm->dsp < 1) return ERR_DSTACK_OVERFLOW;
-    printf("%#lx", vm->dstack[--vm->dsp].as_i64);
+    fprintf(vm->out, "%#lx", args[0].as_i64);
     return ERR_OK;
 }
 
-LopsinErr lopsin_native_puti(LopsinVM *vm)
+// ( i -- )
+LopsinErr lopsin_native_puti(LopsinVM *vm, LopsinValue *args)
 {
-    if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
-    printf("%"PRId64, vm->dstack[--vm->dsp].as_i64);
+    fprintf(vm->out, "%"PRId64, args[0].as_i64);
     return ERR_OK;
 }
 
-LopsinErr lopsin_native_putf(LopsinVM *vm)
+// ( f -- )
+LopsinErr lopsin_native_putf(LopsinVM *vm, LopsinValue *args)
 {
-    if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
-    printf("%lf", vm->dstack[--vm->dsp].as_f64);
+    fprintf(vm->out, "%lf", args[0].as_f64);
     return ERR_OK;
 }
 
-LopsinErr lopsin_native_putc(LopsinVM *vm)
+// ( c -- )
+LopsinErr lopsin_native_putc(LopsinVM *vm, LopsinValue *args)
 {
-    if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
-    putc(vm->dstack[--vm->dsp].as_i64, stdout);
+    putc(args[0].as_i64, vm->out);
     return ERR_OK;
 }
 
-LopsinErr lopsin_native_read(LopsinVM *vm)
+// ( -- i )
+LopsinErr lopsin_native_read(LopsinVM *vm, LopsinValue *args)
 {
-    if (vm->dsp >= vm->dstack_cap) return ERR_DSTACK_OVERFLOW;
     int64_t x;
-    scanf("%"PRId64, &x);
-    vm->dstack[vm->dsp++] = (LopsinValue) { .as_i64 = x };
+    fscanf(vm->in, "%"PRId64, &x);
+    args[0].as_i64 = x;
     return ERR_OK;
 }
 
-LopsinErr lopsin_native_malloc(LopsinVM *vm)
+// ( bytes -- ptr )
+LopsinErr lopsin_native_malloc(LopsinVM *vm, LopsinValue *args)
 {
-    if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
-    size_t bytes = vm->dstack[--vm->dsp].as_i64;
-
-    assert(vm->alloced_count < LOPSINVM_ALLOCED_CHUNKS_CAP);
+    // the heap is borrowed from the VM running the `pfor`, see lopsinvm_pfor()
+    if (vm->parent != NULL) return ERR_NATIVE_ERROR;
+    size_t bytes = args[0].as_i64;
 
     void *ptr = malloc(bytes);
     if (ptr == NULL) return ERR_OUT_OF_MEMORY;
 
-    if (vm->dsp >= vm->dstack_cap) {
-        free(ptr);
-        return ERR_DSTACK_OVERFLOW;
-    }
-
-    vm->alloced[vm->alloced_count++] = (Mem_Chunk) { .ptr = ptr, .bytes = bytes, };
+    lopsinvm_heap_add(vm, ptr, bytes);
 
-    vm->dstack[vm->dsp++].as_ptr = ptr;
+    args[0].as_ptr = ptr;
     return ERR_OK;
 }
 
-LopsinErr lopsin_native_free(LopsinVM *vm)
+// ( ptr -- )
+LopsinErr lopsin_native_free(LopsinVM *vm, LopsinValue *args)
 {
-    if (vm->dsp < 1) return ERR_DSTACK_UNDERFLOW;
+    if (vm->parent != NULL) return ERR_NATIVE_ERROR;
 
-    void *ptr = vm->dstack[--vm->dsp].as_ptr;
+    void *ptr = args[0].as_ptr;
 
-    assert(vm->alloced_count > 0);
-    bool found = false;
-    for (size_t i = 0; i < vm->alloced_count; i++) {
-        if (found) {
-            vm->alloced[i - 1] = vm->alloced[i];
-        }
-        if (vm->alloced[i].ptr == ptr) {
-            found = true;
-            // this will get overwritten on the next iteration
-        }
-    }
-
-    if (!found) return ERR_BAD_MEM_PTR;
+    if (!lopsinvm_heap_remove(vm, ptr)) return ERR_BAD_MEM_PTR;
 
-    vm->alloced_count--;
     free(ptr);
     return ERR_OK;
 }
 
+// ( ptr bytes -- ptr' ), resizes memory allocated with `malloc`, moving it if it can't grow
+// in place. A ptr of 0 allocates new memory. On failure the memory is left as it was.
+LopsinErr lopsin_native_realloc(LopsinVM *vm, LopsinValue *args)
+{
+    if (vm->parent != NULL) return ERR_NATIVE_ERROR;
+    int64_t bytes = args[1].as_i64;
+    void *ptr = args[0].as_ptr;
+    if (bytes < 0) return ERR_INVALID_OPERAND;
+
+    LopsinErr err = lopsinvm_heap_realloc(vm, &ptr, bytes);
+    if (err != ERR_OK) return err;
+
+    args[0].as_ptr = ptr;
+    return ERR_OK;
+}
+
+// ( -- seconds )
 // TODO(#7): `time` native gives time in seconds, not milliseconds
-LopsinErr lopsin_native_time(LopsinVM *vm)
+LopsinErr lopsin_native_time(LopsinVM *vm, LopsinValue *args)
 {
+    (void) vm;
     static_assert(sizeof(time_t) <= sizeof(uint64_t), "Make sure time_t fits in VM stack");
     time_t cTime = time(NULL);
     if (cTime < 0) {
@@ -132,9 +190,608 @@ LopsinErr lopsin_native_time(LopsinVM *vm)
         return ERR_NATIVE_ERROR;
     }
 
-    if (vm->dsp >= vm->dstack_cap) return ERR_DSTACK_OVERFLOW;
+    args[0].as_i64 = cTime;
+    return ERR_OK;
+}
+
+// ( ptr -- ), prints the NUL terminated string at ptr
+LopsinErr lopsin_native_puts(LopsinVM *vm, LopsinValue *args)
+{
+    const char *str = args[0].as_ptr;
+
+    size_t available = lopsinvm_readable_bytes(vm, str);
+    const char *end = memchr(str, '\0', available);
+    if (end == NULL) return ERR_BAD_MEM_PTR;
+
+    fwrite(str, sizeof(char), end - str, vm->out);
+    return ERR_OK;
+}
+
+// ( cap -- chan )
+LopsinErr lopsin_native_chan_new(LopsinVM *vm, LopsinValue *args)
+{
+    if (vm->parent != NULL) return ERR_NATIVE_ERROR;
+
+    int64_t cap = args[0].as_i64;
+    if (cap <= 0 || cap > INT32_MAX) return ERR_INVALID_OPERAND;
+
+    LopsinChan *chan = lopsin_chan_new(cap);
+    args[0].as_i64 = lopsinvm_add_chan(vm, chan);
+    lopsin_chan_release(chan);
+    return ERR_OK;
+}
+
+// ( value chan -- )
+LopsinErr lopsin_native_chan_send(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinChan *chan = lopsinvm_get_chan(vm, args[1].as_i64);
+    if (chan == NULL) return ERR_BAD_CHAN;
+
+    return lopsin_chan_send(chan, vm, args[0]);
+}
+
+// ( chan -- value )
+LopsinErr lopsin_native_chan_recv(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinChan *chan = lopsinvm_get_chan(vm, args[0].as_i64);
+    if (chan == NULL) return ERR_BAD_CHAN;
+
+    return lopsin_chan_recv(chan, vm, &args[0]);
+}
+
+// ( sub arg lo hi chunk -- )
+LopsinErr lopsin_native_pfor(LopsinVM *vm, LopsinValue *args)
+{
+    int64_t chunk = args[4].as_i64;
+    int64_t hi = args[3].as_i64;
+    int64_t lo = args[2].as_i64;
+    LopsinValue arg = args[1];
+    int64_t sub = args[0].as_i64;
+
+    if (sub < 0 || (uint64_t) sub >= vm->inst_count) return ERR_BAD_INST_PTR;
+    if (chunk <= 0) return ERR_INVALID_OPERAND;
+
+    return lopsinvm_pfor(vm, sub, arg, lo, hi, chunk);
+}
+
+// Whether `len` cells of 8 bytes starting at ptr can be read (or written).
+static bool native_readable_cells(const LopsinVM *vm, const void *ptr, int64_t len)
+{
+    return len >= 0 && lopsinvm_readable_bytes(vm, ptr) / sizeof(LopsinValue) >= (uint64_t) len;
+}
+
+static bool native_writable_cells(const LopsinVM *vm, const void *ptr, int64_t len)
+{
+    return len >= 0 && lopsinvm_writable_bytes(vm, ptr) / sizeof(LopsinValue) >= (uint64_t) len;
+}
+
+// ( dst a b len -- ), dst[i] = a[i] op b[i]
+#define VECTOR_MAP_NATIVE(name, type, kernel)                                  \
+    LopsinErr lopsin_native_##name(LopsinVM *vm, LopsinValue *args)            \
+    {                                                                          \
+        int64_t len = args[3].as_i64;                                          \
+        const type *b = args[2].as_ptr;                                        \
+        const type *a = args[1].as_ptr;                                        \
+        type *dst = args[0].as_ptr;                                            \
+                                                                               \
+        if (len < 0) return ERR_INVALID_OPERAND;                               \
+        if (!native_readable_cells(vm, a, len) || !native_readable_cells(vm, b, len) \
+         || !native_writable_cells(vm, dst, len))                              \
+        {                                                                      \
+            return ERR_BAD_MEM_PTR;                                            \
+        }                                                                      \
+                                                                               \
+        kernel(dst, a, b, len);                                                \
+        return ERR_OK;                                                         \
+    }
+
+// ( dst a k len -- ), dst[i] = a[i] * k
+#define VECTOR_SCALE_NATIVE(name, type, as, kernel)                            \
+    LopsinErr lopsin_native_##name(LopsinVM *vm, LopsinValue *args)            \
+    {                                                                          \
+        int64_t len = args[3].as_i64;                                          \
+        type k = args[2].as;                                                   \
+        const type *a = args[1].as_ptr;                                        \
+        type *dst = args[0].as_ptr;                                            \
+                                                                               \
+        if (len < 0) return ERR_INVALID_OPERAND;                               \
+        if (!native_readable_cells(vm, a, len) || !native_writable_cells(vm, dst, len)) { \
+            return ERR_BAD_MEM_PTR;                                            \
+        }                                                                      \
+                                                                               \
+        kernel(dst, a, k, len);                                                \
+        return ERR_OK;                                                         \
+    }
+
+// ( a len -- result ), min_len is 1 for reductions that have no value for an empty array
+#define VECTOR_REDUCE_NATIVE(name, as, kernel, min_len)                        \
+    LopsinErr lopsin_native_##name(LopsinVM *vm, LopsinValue *args)            \
+    {                                                                          \
+        int64_t len = args[1].as_i64;                                          \
+        const void *a = args[0].as_ptr;                                        \
+                                                                               \
+        if (len < (min_len)) return ERR_INVALID_OPERAND;                       \
+        if (!native_readable_cells(vm, a, len)) return ERR_BAD_MEM_PTR;        \
+                                                                               \
+        args[0].as = kernel(a, len);                                           \
+        return ERR_OK;                                                         \
+    }
+
+// ( a b len -- result )
+#define VECTOR_DOT_NATIVE(name, as, kernel)                                    \
+    LopsinErr lopsin_native_##name(LopsinVM *vm, LopsinValue *args)            \
+    {                                                                          \
+        int64_t len = args[2].as_i64;                                          \
+        const void *b = args[1].as_ptr;                                        \
+        const void *a = args[0].as_ptr;                                        \
+                                                                               \
+        if (len < 0) return ERR_INVALID_OPERAND;                               \
+        if (!native_readable_cells(vm, a, len) || !native_readable_cells(vm, b, len)) { \
+            return ERR_BAD_MEM_PTR;                                            \
+        }                                                                      \
+                                                                               \
+        args[0].as = kernel(a, b, len);                                        \
+        return ERR_OK;                                                         \
+    }
+
+VECTOR_MAP_NATIVE(vadd_i64, int64_t, lopsin_simd_add_i64)
+VECTOR_MAP_NATIVE(vadd_f64, double, lopsin_simd_add_f64)
+VECTOR_MAP_NATIVE(vmul_i64, int64_t, lopsin_simd_mul_i64)
+VECTOR_MAP_NATIVE(vmul_f64, double, lopsin_simd_mul_f64)
+VECTOR_SCALE_NATIVE(vscale_i64, int64_t, as_i64, lopsin_simd_scale_i64)
+VECTOR_SCALE_NATIVE(vscale_f64, double, as_f64, lopsin_simd_scale_f64)
+VECTOR_REDUCE_NATIVE(vsum_i64, as_i64, lopsin_simd_sum_i64, 0)
+VECTOR_REDUCE_NATIVE(vsum_f64, as_f64, lopsin_simd_sum_f64, 0)
+VECTOR_DOT_NATIVE(vdot_i64, as_i64, lopsin_simd_dot_i64)
+VECTOR_DOT_NATIVE(vdot_f64, as_f64, lopsin_simd_dot_f64)
+VECTOR_REDUCE_NATIVE(vmin_i64, as_i64, lopsin_simd_min_i64, 1)
+VECTOR_REDUCE_NATIVE(vmin_f64, as_f64, lopsin_simd_min_f64, 1)
+VECTOR_REDUCE_NATIVE(vmax_i64, as_i64, lopsin_simd_max_i64, 1)
+VECTOR_REDUCE_NATIVE(vmax_f64, as_f64, lopsin_simd_max_f64, 1)
+
+// The memory natives check the whole range once, then hand it to libc.
+
+// ( dst src n -- ), the ranges must not overlap
+LopsinErr lopsin_native_memcpy(LopsinVM *vm, LopsinValue *args)
+{
+    int64_t n = args[2].as_i64;
+    const void *src = args[1].as_ptr;
+    void *dst = args[0].as_ptr;
+
+    if (n < 0) return ERR_INVALID_OPERAND;
+    if (lopsinvm_writable_bytes(vm, dst) < (uint64_t) n || lopsinvm_readable_bytes(vm, src) < (uint64_t) n) {
+        return ERR_BAD_MEM_PTR;
+    }
+    uintptr_t d = (uintptr_t) dst, s = (uintptr_t) src;
+    if (n > 0 && d < s + n && s < d + n) return ERR_INVALID_OPERAND;
+
+    memcpy(dst, src, n);
+    return ERR_OK;
+}
+
+// ( dst src n -- )
+LopsinErr lopsin_native_memmove(LopsinVM *vm, LopsinValue *args)
+{
+    int64_t n = args[2].as_i64;
+    const void *src = args[1].as_ptr;
+    void *dst = args[0].as_ptr;
+
+    if (n < 0) return ERR_INVALID_OPERAND;
+    if (lopsinvm_writable_bytes(vm, dst) < (uint64_t) n || lopsinvm_readable_bytes(vm, src) < (uint64_t) n) {
+        return ERR_BAD_MEM_PTR;
+    }
+
+    memmove(dst, src, n);
+    return ERR_OK;
+}
+
+// ( dst byte n -- )
+LopsinErr lopsin_native_memset(LopsinVM *vm, LopsinValue *args)
+{
+    int64_t n = args[2].as_i64;
+    int byte = (unsigned char) args[1].as_i64;
+    void *dst = args[0].as_ptr;
+
+    if (n < 0) return ERR_INVALID_OPERAND;
+    if (lopsinvm_writable_bytes(vm, dst) < (uint64_t) n) return ERR_BAD_MEM_PTR;
+
+    memset(dst, byte, n);
+    return ERR_OK;
+}
+
+// ( a b n -- cmp ), cmp is -1, 0 or 1 as the first differing byte of a is lower, or higher
+LopsinErr lopsin_native_memcmp(LopsinVM *vm, LopsinValue *args)
+{
+    int64_t n = args[2].as_i64;
+    const void *b = args[1].as_ptr;
+    const void *a = args[0].as_ptr;
+
+    if (n < 0) return ERR_INVALID_OPERAND;
+    if (lopsinvm_readable_bytes(vm, a) < (uint64_t) n || lopsinvm_readable_bytes(vm, b) < (uint64_t) n) {
+        return ERR_BAD_MEM_PTR;
+    }
+
+    int cmp = memcmp(a, b, n);
+    args[0].as_i64 = (cmp > 0) - (cmp < 0);
+    return ERR_OK;
+}
+
+// ( ptr len -- ), sorts len cells in place
+#define SORT_NATIVE(name, type, sort)                                          \
+    LopsinErr lopsin_native_##name(LopsinVM *vm, LopsinValue *args)            \
+    {                                                                          \
+        int64_t len = args[1].as_i64;                                          \
+        type *a = args[0].as_ptr;                                              \
+                                                                               \
+        if (len < 0) return ERR_INVALID_OPERAND;                               \
+        if (!native_writable_cells(vm, a, len)) return ERR_BAD_MEM_PTR;        \
+                                                                               \
+        sort(a, len);                                                          \
+        return ERR_OK;                                                         \
+    }
+
+SORT_NATIVE(sort_i64, int64_t, lopsin_sort_i64)
+SORT_NATIVE(sort_u64, uint64_t, lopsin_sort_u64)
+SORT_NATIVE(sort_f64, double, lopsin_sort_f64)
+
+typedef struct {
+    LopsinVM *vm;
+    size_t sub;
+    LopsinErr err;
+} Native_Sort_By;
+
+// Calls the comparator as ( a b -- a-goes-first ), eg `ilt`. Once it failed, every pair compares equal,
+// which lets the sort finish without calling it again.
+static bool native_sort_by_less(uint64_t a, uint64_t b, void *user)
+{
+    Native_Sort_By *ctx = user;
+    LopsinVM *vm = ctx->vm;
+    if (ctx->err != ERR_OK) return false;
+
+    if (vm->dsp + 2 > vm->dstack_cap) {
+        ctx->err = ERR_DSTACK_OVERFLOW;
+        return false;
+    }
+
+    size_t dsp = vm->dsp;
+    vm->dstack[vm->dsp++].as_i64 = a;
+    vm->dstack[vm->dsp++].as_i64 = b;
+
+    ctx->err = lopsinvm_callback(vm, ctx->sub);
+    if (ctx->err == ERR_OK && vm->dsp <= dsp) ctx->err = ERR_DSTACK_UNDERFLOW;
+    if (ctx->err != ERR_OK) return false;
+
+    // read like `cjmp` does, whatever else the comparator left is dropped
+    bool less = vm->dstack[vm->dsp - 1].as_boolean;
+    vm->dsp = dsp;
+    return less;
+}
+
+// ( ptr len cmp -- ), sorts len cells in place, in the order given by the subroutine
+// cmp ( a b -- a-goes-first )
+LopsinErr lopsin_native_sort_by(LopsinVM *vm, LopsinValue *args)
+{
+    int64_t sub = args[2].as_i64;
+    int64_t len = args[1].as_i64;
+    void *a = args[0].as_ptr;
+
+    if (sub < 0 || (uint64_t) sub >= vm->inst_count) return ERR_BAD_INST_PTR;
+    if (len < 0) return ERR_INVALID_OPERAND;
+    if (!native_writable_cells(vm, a, len)) return ERR_BAD_MEM_PTR;
+    if (len == 0) return ERR_OK;
+
+    // the comparator can write to or free the array, so it sorts a copy
+    uint64_t *copy = malloc(len * sizeof(uint64_t));
+    if (copy == NULL) return ERR_OUT_OF_MEMORY;
+    memcpy(copy, a, len * sizeof(uint64_t));
+
+    // the comparator runs on the stack above the arguments, which stay where they are
+    Native_Sort_By ctx = { .vm = vm, .sub = sub, .err = ERR_OK };
+    lopsin_sort_by(copy, len, &native_sort_by_less, &ctx);
+
+    if (ctx.err == ERR_OK && !native_writable_cells(vm, a, len)) ctx.err = ERR_BAD_MEM_PTR;
+    if (ctx.err == ERR_OK) memcpy(a, copy, len * sizeof(uint64_t));
+    free(copy);
+
+    return ctx.err;
+}
+
+// Maps belong to the VM that created them, so a `pfor` slice can't use its parent's.
+static LopsinErr native_map(const LopsinVM *vm, int64_t handle, bool bytes_keys, LopsinMap **out)
+{
+    *out = lopsinvm_get_map(vm, handle);
+    if (*out == NULL) return ERR_BAD_MAP;
+    if (lopsin_map_has_bytes_keys(*out) != bytes_keys) return ERR_INVALID_TYPE;
+    return ERR_OK;
+}
+
+// The key of the bytes variants is given as ( ptr len ), and copied into the map.
+static LopsinErr native_map_bytes_key(const LopsinVM *vm, const LopsinValue *ptr_len, LopsinMapKey *out)
+{
+    const void *ptr = ptr_len[0].as_ptr;
+    int64_t len = ptr_len[1].as_i64;
+    if (len < 0) return ERR_INVALID_OPERAND;
+    if (lopsinvm_readable_bytes(vm, ptr) < (uint64_t) len) return ERR_BAD_MEM_PTR;
+
+    *out = (LopsinMapKey) { .bytes = ptr, .len = len };
+    return ERR_OK;
+}
+
+// ( -- map ), a map of integer keys
+LopsinErr lopsin_native_map_new(LopsinVM *vm, LopsinValue *args)
+{
+    if (vm->parent != NULL) return ERR_NATIVE_ERROR;
+    args[0].as_i64 = lopsinvm_add_map(vm, lopsin_map_new(false));
+    return ERR_OK;
+}
+
+// ( -- map ), a map of byte string keys, see the *_bytes natives
+LopsinErr lopsin_native_map_new_bytes(LopsinVM *vm, LopsinValue *args)
+{
+    if (vm->parent != NULL) return ERR_NATIVE_ERROR;
+    args[0].as_i64 = lopsinvm_add_map(vm, lopsin_map_new(true));
+    return ERR_OK;
+}
+
+// ( map -- )
+LopsinErr lopsin_native_map_free(LopsinVM *vm, LopsinValue *args)
+{
+    return lopsinvm_remove_map(vm, args[0].as_i64) ? ERR_OK : ERR_BAD_MAP;
+}
+
+// ( map -- count )
+LopsinErr lopsin_native_map_count(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinMap *map = lopsinvm_get_map(vm, args[0].as_i64);
+    if (map == NULL) return ERR_BAD_MAP;
+
+    args[0].as_i64 = lopsin_map_count(map);
+    return ERR_OK;
+}
+
+// ( key value map -- )
+LopsinErr lopsin_native_map_put(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinMap *map;
+    LopsinErr err = native_map(vm, args[2].as_i64, false, &map);
+    if (err != ERR_OK) return err;
+
+    LopsinMapKey key = { .i = args[0].as_i64 };
+    lopsin_map_put(map, key, args[1]);
+    return ERR_OK;
+}
+
+// ( key map -- value found ), value is 0 if the key was not found
+LopsinErr lopsin_native_map_get(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinMap *map;
+    LopsinErr err = native_map(vm, args[1].as_i64, false, &map);
+    if (err != ERR_OK) return err;
+
+    LopsinMapKey key = { .i = args[0].as_i64 };
+    LopsinValue value = {0};
+    bool found = lopsin_map_get(map, key, &value);
+    args[0] = value;
+    args[1].as_i64 = found;
+    return ERR_OK;
+}
+
+// ( key map -- found )
+LopsinErr lopsin_native_map_del(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinMap *map;
+    LopsinErr err = native_map(vm, args[1].as_i64, false, &map);
+    if (err != ERR_OK) return err;
+
+    LopsinMapKey key = { .i = args[0].as_i64 };
+    args[0].as_i64 = lopsin_map_del(map, key);
+    return ERR_OK;
+}
+
+// Advances the cursor of map_iter and map_iter_bytes, which is 0 to start with and once done.
+static LopsinErr native_map_next(LopsinMap *map, int64_t cursor, int64_t *next, LopsinMapKey *key, LopsinValue *value)
+{
+    if (cursor < 0) return ERR_INVALID_OPERAND;
+
+    size_t at = cursor;
+    *next = lopsin_map_next(map, &at, key, value) ? (int64_t) at : 0;
+    if (*next == 0) {
+        *key = (LopsinMapKey) {0};
+        *value = (LopsinValue) {0};
+    }
+    return ERR_OK;
+}
+
+// ( cursor map -- next key value )
+LopsinErr lopsin_native_map_iter(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinMap *map;
+    LopsinErr err = native_map(vm, args[1].as_i64, false, &map);
+    if (err != ERR_OK) return err;
+
+    int64_t next;
+    LopsinMapKey key;
+    LopsinValue value;
+    err = native_map_next(map, args[0].as_i64, &next, &key, &value);
+    if (err != ERR_OK) return err;
+
+    args[0].as_i64 = next;
+    args[1].as_i64 = key.i;
+    args[2] = value;
+    return ERR_OK;
+}
+
+// ( ptr len value map -- )
+LopsinErr lopsin_native_map_put_bytes(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinMap *map;
+    LopsinErr err = native_map(vm, args[3].as_i64, true, &map);
+    if (err != ERR_OK) return err;
+
+    LopsinMapKey key;
+    err = native_map_bytes_key(vm, &args[0], &key);
+    if (err != ERR_OK) return err;
+
+    lopsin_map_put(map, key, args[2]);
+    return ERR_OK;
+}
+
+// ( ptr len map -- value found )
+LopsinErr lopsin_native_map_get_bytes(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinMap *map;
+    LopsinErr err = native_map(vm, args[2].as_i64, true, &map);
+    if (err != ERR_OK) return err;
+
+    LopsinMapKey key;
+    err = native_map_bytes_key(vm, &args[0], &key);
+    if (err != ERR_OK) return err;
+
+    LopsinValue value = {0};
+    bool found = lopsin_map_get(map, key, &value);
+    args[0] = value;
+    args[1].as_i64 = found;
+    return ERR_OK;
+}
+
+// ( ptr len map -- found )
+LopsinErr lopsin_native_map_del_bytes(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinMap *map;
+    LopsinErr err = native_map(vm, args[2].as_i64, true, &map);
+    if (err != ERR_OK) return err;
+
+    LopsinMapKey key;
+    err = native_map_bytes_key(vm, &args[0], &key);
+    if (err != ERR_OK) return err;
+
+    args[0].as_i64 = lopsin_map_del(map, key);
+    return ERR_OK;
+}
+
+// ( cursor buf cap map -- next len value ), copies the first cap bytes (at most) of the key
+// to buf, and gives its whole length
+LopsinErr lopsin_native_map_iter_bytes(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinMap *map;
+    LopsinErr err = native_map(vm, args[3].as_i64, true, &map);
+    if (err != ERR_OK) return err;
+
+    int64_t cap = args[2].as_i64;
+    void *buf = args[1].as_ptr;
+    if (cap < 0) return ERR_INVALID_OPERAND;
+    if (lopsinvm_writable_bytes(vm, buf) < (uint64_t) cap) return ERR_BAD_MEM_PTR;
+
+    int64_t next;
+    LopsinMapKey key;
+    LopsinValue value;
+    err = native_map_next(map, args[0].as_i64, &next, &key, &value);
+    if (err != ERR_OK) return err;
+
+    size_t n = key.len < (uint64_t) cap ? key.len : (uint64_t) cap;
+    if (n > 0) memcpy(buf, key.bytes, n);
+
+    args[0].as_i64 = next;
+    args[1].as_i64 = key.len;
+    args[2] = value;
+    return ERR_OK;
+}
+
+// Vectors belong to the VM that created them, like maps.
+static LopsinErr native_vec(const LopsinVM *vm, int64_t handle, LopsinVec **out)
+{
+    *out = lopsinvm_get_vec(vm, handle);
+    if (*out == NULL) return ERR_BAD_VEC;
+    return ERR_OK;
+}
+
+// ( -- vec )
+LopsinErr lopsin_native_vec_new(LopsinVM *vm, LopsinValue *args)
+{
+    if (vm->parent != NULL) return ERR_NATIVE_ERROR;
+    args[0].as_i64 = lopsinvm_add_vec(vm);
+    return ERR_OK;
+}
+
+// ( vec -- ), frees the vector along with its elements
+LopsinErr lopsin_native_vec_free(LopsinVM *vm, LopsinValue *args)
+{
+    return lopsinvm_remove_vec(vm, args[0].as_i64) ? ERR_OK : ERR_BAD_VEC;
+}
+
+// ( value vec -- )
+LopsinErr lopsin_native_vec_push(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinVec *vec;
+    LopsinErr err = native_vec(vm, args[1].as_i64, &vec);
+    if (err != ERR_OK) return err;
+
+    err = lopsinvm_vec_reserve(vm, vec, vec->len + 1);
+    if (err != ERR_OK) return err;
+
+    vec->data[vec->len++] = args[0];
+    return ERR_OK;
+}
+
+// ( vec -- value )
+LopsinErr lopsin_native_vec_pop(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinVec *vec;
+    LopsinErr err = native_vec(vm, args[0].as_i64, &vec);
+    if (err != ERR_OK) return err;
+    if (vec->len == 0) return ERR_INVALID_OPERAND;
+
+    args[0] = vec->data[--vec->len];
+    return ERR_OK;
+}
+
+// ( i vec -- value )
+LopsinErr lopsin_native_vec_get(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinVec *vec;
+    LopsinErr err = native_vec(vm, args[1].as_i64, &vec);
+    if (err != ERR_OK) return err;
+
+    uint64_t i = args[0].as_i64;
+    if (i >= vec->len) return ERR_INVALID_OPERAND;
+
+    args[0] = vec->data[i];
+    return ERR_OK;
+}
+
+// ( value i vec -- )
+LopsinErr lopsin_native_vec_set(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinVec *vec;
+    LopsinErr err = native_vec(vm, args[2].as_i64, &vec);
+    if (err != ERR_OK) return err;
+
+    uint64_t i = args[1].as_i64;
+    if (i >= vec->len) return ERR_INVALID_OPERAND;
+
+    vec->data[i] = args[0];
+    return ERR_OK;
+}
+
+// ( vec -- len )
+LopsinErr lopsin_native_vec_len(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinVec *vec = lopsinvm_get_vec(vm, args[0].as_i64);
+    if (vec == NULL) return ERR_BAD_VEC;
+
+    args[0].as_i64 = vec->len;
+    return ERR_OK;
+}
+
+// ( vec -- ptr ), the elements, valid until the vector grows or is freed.
+// 0 if nothing was ever pushed.
+LopsinErr lopsin_native_vec_data(LopsinVM *vm, LopsinValue *args)
+{
+    LopsinVec *vec;
+    LopsinErr err = native_vec(vm, args[0].as_i64, &vec);
+    if (err != ERR_OK) return err;
 
-    vm->dstack[vm->dsp++].as_i64 = cTime;
+    args[0].as_ptr = vec->data;
     return ERR_OK;
 }
 
@@ -7,11 +7,14 @@
 #define MODULE "lopsinvm"
 #define OUTFILE PATH(BINDIR, MODULE)
 
-#define MODULE_BUILD_CFLAGS BUILD_CFLAGS
-#define MODULE_DEBUG_CFLAGS DEBUG_CFLAGS
+// linked dynamically, so that it can load native plugins, see lopsinvm_plugin.h
+#define MODULE_BUILD_CFLAGS DYNAMIC_BUILD_CFLAGS
+#define MODULE_DEBUG_CFLAGS DYNAMIC_DEBUG_CFLAGS
 #define MODULE_INCLUDES C_INCLUDES
 
-#define EXTRA_SRCFILES  PATH(SRCDIR, "common", "util.c")
+#define EXTRA_SRCFILES                          \
+    PATH(SRCDIR, "common", "handles.c"),    \
+    PATH(SRCDIR, "common", "util.c")
 
 int main(int argc, const char **argv)
 {
@@ -0,0 +1,106 @@
+// Runs pairs of VMs on lopsin_sched, a producer sending 1..SCHED_TEST_VALUES over a small
+// channel to a consumer that sums them. Most sends and receives park one end of the pair and
+// wake it up from another worker, and every VM is freed by its done callback, so that
+// anything still touching a VM (or its task) after waking it up shows under ThreadSanitizer.
+
+#include "lopsinvm.h"
+#include "lopsinvm_chan.h"
+#include "lopsinvm_sched.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+#include "test.h"
+
+#define SCHED_TEST_PAIRS 200
+#define SCHED_TEST_VALUES 1000
+#define SCHED_TEST_CHAN_CAP 4
+#define SCHED_TEST_WORKERS 4
+#define SCHED_TEST_STACK_CAP 1024
+
+// ( -- ) sends 1..SCHED_TEST_VALUES on channel 0
+static const LopsinInst producer[] = {
+    INST(PUSH, 0),
+    INST(PUSH, 1), INST(ISUM, 0),
+    INST(DUP, 1), INST(PUSH, 0), INST(NCALL, 0),
+    INST(DUP, 1), INST(PUSH, SCHED_TEST_VALUES), INST(ILT, 0), INST(CJMP, 1),
+    INST(HLT, 0),
+};
+
+// ( -- sum ) of SCHED_TEST_VALUES values received on channel 0
+static const LopsinInst consumer[] = {
+    INST(PUSH, 0), INST(PUSH, 0),
+    INST(SWAP, 1), INST(PUSH, 0), INST(NCALL, 0), INST(ISUM, 0), INST(SWAP, 1),
+    INST(PUSH, 1), INST(ISUM, 0),
+    INST(DUP, 1), INST(PUSH, SCHED_TEST_VALUES), INST(ILT, 0), INST(CJMP, 2),
+    INST(DROP, 1),
+    INST(HLT, 0),
+};
+
+static atomic_size_t failures;
+static atomic_size_t summed;
+
+static void vm_done(LopsinVM *vm, LopsinRunStatus status, LopsinErr err, void *user)
+{
+    bool is_consumer = user != NULL;
+
+    if (status != LOPSIN_RUN_HALTED) {
+        fprintf(stderr, "FAIL: VM stopped with %s\n", ERR_AS_CSTR(err));
+        atomic_fetch_add(&failures, 1);
+    } else if (is_consumer) {
+        int64_t expected = (int64_t) SCHED_TEST_VALUES * (SCHED_TEST_VALUES + 1) / 2;
+        if (vm->dsp != 1 || vm->dstack[0].as_i64 != expected) {
+            fprintf(stderr, "FAIL: Consumer summed %" PRId64 ", expected %" PRId64 "\n",
+                    vm->dsp > 0 ? vm->dstack[0].as_i64 : 0, expected);
+            atomic_fetch_add(&failures, 1);
+        } else {
+            atomic_fetch_add(&summed, 1);
+        }
+    }
+
+    lopsinvm_free(vm);
+    free(vm);
+}
+
+static LopsinVM *new_vm(LopsinProgram *program, LopsinChan *chan)
+{
+    LopsinVM *vm = NOTNULL(aligned_alloc(LOPSINVM_CACHE_LINE, sizeof(LopsinVM)));
+    lopsinvm_new_with_stacks(vm, SCHED_TEST_STACK_CAP, SCHED_TEST_STACK_CAP);
+    lopsinvm_attach_program(vm, program);
+    lopsinvm_add_chan(vm, chan);
+    return vm;
+}
+
+int main(void)
+{
+    LopsinProgram *send = program_from_insts("chan_send", sizeof("chan_send"), producer, ARRAY_LEN(producer));
+    LopsinProgram *recv = program_from_insts("chan_recv", sizeof("chan_recv"), consumer, ARRAY_LEN(consumer));
+
+    LopsinSched *sched = lopsin_sched_new(SCHED_TEST_WORKERS, LOPSIN_SCHED_DEFAULT_MAX_PENDING, 64);
+
+    for (size_t i = 0; i < SCHED_TEST_PAIRS; i++) {
+        LopsinChan *chan = lopsin_chan_new(SCHED_TEST_CHAN_CAP);
+        LopsinVM *a = new_vm(send, chan);
+        LopsinVM *b = new_vm(recv, chan);
+        lopsin_chan_release(chan);
+
+        lopsin_sched_submit(sched, a, &vm_done, NULL);
+        // any non-NULL user marks the consumer
+        lopsin_sched_submit(sched, b, &vm_done, sched);
+    }
+
+    lopsin_sched_free(sched);
+    lopsin_program_release(send);
+    lopsin_program_release(recv);
+
+    size_t failed = atomic_load(&failures);
+    if (failed > 0 || atomic_load(&summed) != SCHED_TEST_PAIRS) {
+        fprintf(stderr, "FAIL: %zu of %d pairs summed right\n", atomic_load(&summed), SCHED_TEST_PAIRS);
+        return 1;
+    }
+
+    printf("OK: %d pairs\n", SCHED_TEST_PAIRS);
+    return 0;
+}
@@ -0,0 +1,75 @@
+// The VM handles SIGSEGV to turn faults on the guard pages of its stacks into errors. Any other
+// fault must still reach the handler the host installed before it.
+
+#define _GNU_SOURCE
+
+#include "lopsinvm.h"
+
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "test.h"
+
+static sigjmp_buf host_env;
+static volatile sig_atomic_t host_faults;
+
+static void host_handle_sigsegv(int sig, siginfo_t *info, void *ucontext)
+{
+    (void) sig;
+    (void) info;
+    (void) ucontext;
+    host_faults++;
+    siglongjmp(host_env, 1);
+}
+
+// ( -- ) pushes until the data stack overflows
+static const LopsinInst overflow[] = {
+    INST(PUSH, 0), INST(JMP, 0),
+};
+
+int main(void)
+{
+    struct sigaction action = {0};
+    action.sa_sigaction = &host_handle_sigsegv;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+
+    // the VM installs its handler on top of the host's here
+    LopsinProgram *program = program_from_insts("", 0, overflow, ARRAY_LEN(overflow));
+    LopsinVM vm;
+    lopsinvm_new(&vm);
+    lopsinvm_attach_program(&vm, program);
+    lopsin_program_release(program);
+
+    volatile char *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sigsetjmp(host_env, 1) == 0) {
+        *page = 1;
+        fprintf(stderr, "FAIL: Writing to a PROT_NONE page didn't fault\n");
+        return 1;
+    }
+    if (host_faults != 1) {
+        fprintf(stderr, "FAIL: The host's handler wasn't called for a fault of its own\n");
+        return 1;
+    }
+
+    fprintf(stderr, "Expecting a data stack overflow:\n");
+    LopsinErr err = lopsinvm_start(&vm);
+    lopsinvm_free(&vm);
+    if (err != ERR_DSTACK_OVERFLOW) {
+        fprintf(stderr, "FAIL: Overflowing the data stack returned %s, expected %s\n",
+                ERR_AS_CSTR(err), ERR_AS_CSTR(ERR_DSTACK_OVERFLOW));
+        return 1;
+    }
+    if (host_faults != 1) {
+        fprintf(stderr, "FAIL: The host's handler saw a fault on a guard page\n");
+        return 1;
+    }
+
+    printf("OK: Guard page faults handled, others forwarded\n");
+    return 0;
+}
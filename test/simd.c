@@ -0,0 +1,52 @@
+// Runs vmin and vmax over arrays with NaNs in them, which both the AVX2 kernels and the plain
+// loops skip: a NaN in any lane, including the first element, must not hide the values after it,
+// and the result is only NaN if every element is.
+
+#include "lopsinvm_simd.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "util.h"
+
+typedef struct {
+    const char *name;
+    double a[9];
+    size_t n;
+    double min;
+    double max;
+} Minmax_Case;
+
+static bool same(double x, double y)
+{
+    return (isnan(x) && isnan(y)) || x == y;
+}
+
+int main(void)
+{
+    const Minmax_Case cases[] = {
+        { "NaN in the middle",      { 1, 2, 3, 4, NAN, 5, 6, 7 },       8, 1, 7 },
+        { "NaN first in a lane",    { 1, NAN, 3, 4, 5, 100, 6, -7 },    8, -7, 100 },
+        { "NaN first",              { NAN, 2, 3, 4, 5, 6, 7, 8, 9 },    9, 2, 9 },
+        { "NaN in the tail",        { 1, 2, 3, 4, 5, 6, 7, 8, NAN },    9, 1, 8 },
+        { "short, NaN first",       { NAN, 3 },                         2, 3, 3 },
+        { "all NaN",                { NAN, NAN, NAN, NAN, NAN },        5, NAN, NAN },
+    };
+    int failed = 0;
+
+    for (size_t i = 0; i < ARRAY_LEN(cases); i++) {
+        const Minmax_Case *c = &cases[i];
+        double min = lopsin_simd_min_f64(c->a, c->n);
+        double max = lopsin_simd_max_f64(c->a, c->n);
+        if (!same(min, c->min) || !same(max, c->max)) {
+            fprintf(stderr, "FAIL: %s: vmin %g and vmax %g, expected %g and %g\n",
+                    c->name, min, max, c->min, c->max);
+            failed = 1;
+        }
+    }
+
+    if (failed) return 1;
+    printf("OK: vmin and vmax skip NaNs\n");
+    return 0;
+}
@@ -0,0 +1,62 @@
+// Runs `pfor` slices that create a map, a map of byte string keys or a channel. Nothing a slice
+// could hand them to outlives it, and they would pile up on the VM its thread keeps, so each
+// must fail with ERR_NATIVE_ERROR.
+
+#include "lopsinvm.h"
+#include "lopsinvm_pfor.h"
+
+#include <stdio.h>
+
+#include "util.h"
+#include "test.h"
+
+#define SLICES_TEST_WORKERS 2
+
+static const char natives[] = "pfor\0map_new\0map_new_bytes\0chan_new";
+enum { PFOR, MAP_NEW, MAP_NEW_BYTES, CHAN_NEW };
+
+#define SLICE_ADDR 7
+// ( -- ) runs the slice on [0, 4) in slices of 1, the slice calls the native in its NCALL
+static LopsinInst insts[] = {
+    INST(PUSH, SLICE_ADDR), INST(PUSH, 0), INST(PUSH, 0), INST(PUSH, 4), INST(PUSH, 1),
+    INST(NCALL, PFOR),
+    INST(HLT, 0),
+
+    // ( arg start end -- ), the 1 is the capacity chan_new takes, the others take nothing
+    INST(DROP, 1), INST(DROP, 1), INST(DROP, 1),
+    INST(PUSH, 1), INST(NCALL, MAP_NEW),
+    INST(RET, 0),
+};
+
+int main(void)
+{
+    static const int created[] = { MAP_NEW, MAP_NEW_BYTES, CHAN_NEW };
+    int failed = 0;
+
+    lopsin_pfor_set_workers(SLICES_TEST_WORKERS);
+    fprintf(stderr, "Expecting three native errors:\n");
+
+    for (size_t i = 0; i < ARRAY_LEN(created); i++) {
+        insts[SLICE_ADDR + 4].operand.as_i64 = created[i];
+        LopsinProgram *program = program_from_insts(natives, sizeof(natives), insts, ARRAY_LEN(insts));
+
+        LopsinVM vm;
+        lopsinvm_new(&vm);
+        lopsinvm_attach_program(&vm, program);
+        lopsin_program_release(program);
+
+        LopsinErr err = lopsinvm_start(&vm);
+        if (err != ERR_NATIVE_ERROR) {
+            fprintf(stderr, "FAIL: A slice calling native %d returned %s, expected %s\n",
+                    created[i], ERR_AS_CSTR(err), ERR_AS_CSTR(ERR_NATIVE_ERROR));
+            failed = 1;
+        }
+        lopsinvm_free(&vm);
+    }
+
+    lopsin_pfor_shutdown();
+
+    if (failed) return 1;
+    printf("OK: slices can't create maps or channels\n");
+    return 0;
+}
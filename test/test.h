@@ -0,0 +1,43 @@
+/*
+Created 19 October 2026
+ */
+
+#ifndef LOPSINVM_TEST_H_
+#define LOPSINVM_TEST_H_
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lopsinvm.h"
+#include "util.h"
+
+// Helpers shared by the tests in test/, which are each built on their own.
+
+// A program of the instructions, calling the natives named in `natives` (each NUL-terminated).
+static inline LopsinProgram *program_from_insts(const char *natives, size_t natives_size,
+                                                const LopsinInst *insts, size_t count)
+{
+    const char magic[] = LOPSINVM_BYTECODE_MAGIC;
+    LopsinBytecodeHeader header = {
+        .version = LOPSINVM_BYTECODE_VERSION,
+        .natives_size = natives_size,
+        .inst_count = count,
+    };
+
+    size_t size = sizeof(magic) - 1 + sizeof(header) + natives_size + count * sizeof(LopsinInst);
+    char *bytes = NOTNULL(malloc(size));
+    char *p = bytes;
+    memcpy(p, magic, sizeof(magic) - 1);         p += sizeof(magic) - 1;
+    memcpy(p, &header, sizeof(header));          p += sizeof(header);
+    memcpy(p, natives, natives_size);            p += natives_size;
+    memcpy(p, insts, count * sizeof(LopsinInst));
+
+    LopsinProgram *program = lopsin_program_load_from_memory(bytes, size, "test");
+    free(bytes);
+    if (program == NULL) exit(1);
+    return program;
+}
+
+#define INST(insttype, value) { .type = LOPSIN_INST_##insttype, .operand = { .as_i64 = (value) } }
+
+#endif /* LOPSINVM_TEST_H_ */
@@ -0,0 +1,60 @@
+// A vec owns the chunk of the heap its elements live in, so the program can't free it (or
+// realloc it) from under the vec, and then have a later `malloc` hand the same address to
+// something else for the vec to write to.
+
+#include "lopsinvm.h"
+
+#include <stdio.h>
+
+#include "util.h"
+#include "test.h"
+
+static const char natives[] = "vec_new\0vec_push\0vec_data\0free\0realloc";
+enum { VEC_NEW, VEC_PUSH, VEC_DATA, FREE, REALLOC };
+
+// ( -- ptr ) to the elements of a vec holding one value
+#define VEC_DATA_OF_ONE                                               \
+    INST(NCALL, VEC_NEW),                                             \
+    INST(DUP, 1), INST(PUSH, 7), INST(SWAP, 1), INST(NCALL, VEC_PUSH), \
+    INST(NCALL, VEC_DATA)
+
+static const LopsinInst free_data[] = {
+    VEC_DATA_OF_ONE,
+    INST(NCALL, FREE),
+    INST(HLT, 0),
+};
+
+static const LopsinInst realloc_data[] = {
+    VEC_DATA_OF_ONE,
+    INST(PUSH, 1024), INST(NCALL, REALLOC),
+    INST(HLT, 0),
+};
+
+static int expect_bad_mem_ptr(const char *what, const LopsinInst *insts, size_t count)
+{
+    LopsinProgram *program = program_from_insts(natives, sizeof(natives), insts, count);
+    LopsinVM vm;
+    lopsinvm_new(&vm);
+    lopsinvm_attach_program(&vm, program);
+    lopsin_program_release(program);
+
+    LopsinErr err = lopsinvm_start(&vm);
+    lopsinvm_free(&vm);
+
+    if (err != ERR_BAD_MEM_PTR) {
+        fprintf(stderr, "FAIL: %s returned %s, expected %s\n", what, ERR_AS_CSTR(err), ERR_AS_CSTR(ERR_BAD_MEM_PTR));
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    fprintf(stderr, "Expecting two bad memory pointers:\n");
+    int failed = expect_bad_mem_ptr("Freeing vec_data", free_data, ARRAY_LEN(free_data))
+               + expect_bad_mem_ptr("Reallocating vec_data", realloc_data, ARRAY_LEN(realloc_data));
+    if (failed) return 1;
+
+    printf("OK: vec_data can't be freed or reallocated\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+// Runs VMs with lopsinvm_start(), which parks a VM that waits on a channel until another thread
+// wakes it up, and takes it to be deadlocked when nothing could. A VM sharing one channel with
+// another VM but waiting on a channel only it holds must fail with ERR_DEADLOCK rather than sleep
+// forever, and one waiting on the shared channel must be woken up by the sender on another thread.
+// The scheduler must find the same deadlock, rather than never finishing.
+
+#include "lopsinvm.h"
+#include "lopsinvm_chan.h"
+#include "lopsinvm_sched.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "util.h"
+#include "test.h"
+
+#define WAKE_TEST_VALUE 42
+
+static const char natives[] = "chan_new\0chan_send\0chan_recv";
+enum { CHAN_NEW, CHAN_SEND, CHAN_RECV };
+
+// ( -- ) receives on a channel of its own, that nothing will ever send on
+static const LopsinInst recv_private[] = {
+    INST(PUSH, 1), INST(NCALL, CHAN_NEW),
+    INST(NCALL, CHAN_RECV),
+    INST(HLT, 0),
+};
+
+// ( -- value ) received on channel 0
+static const LopsinInst recv_shared[] = {
+    INST(PUSH, 0), INST(NCALL, CHAN_RECV),
+    INST(HLT, 0),
+};
+
+// ( -- ) sends WAKE_TEST_VALUE on channel 0
+static const LopsinInst send_shared[] = {
+    INST(PUSH, WAKE_TEST_VALUE), INST(PUSH, 0), INST(NCALL, CHAN_SEND),
+    INST(HLT, 0),
+};
+
+static void new_vm(LopsinVM *vm, const LopsinInst *insts, size_t count, LopsinChan *chan)
+{
+    LopsinProgram *program = program_from_insts(natives, sizeof(natives), insts, count);
+    lopsinvm_new(vm);
+    lopsinvm_attach_program(vm, program);
+    lopsin_program_release(program);
+    lopsinvm_add_chan(vm, chan);
+}
+
+static void *start_vm(void *vm)
+{
+    lopsinvm_start(vm);
+    return NULL;
+}
+
+static void sched_done(LopsinVM *vm, LopsinRunStatus status, LopsinErr err, void *user)
+{
+    (void) vm;
+    (void) status;
+    *(LopsinErr *) user = err;
+}
+
+int main(void)
+{
+    LopsinChan *chan = lopsin_chan_new(1);
+    LopsinVM receiver, sender;
+    int failed = 0;
+
+    new_vm(&receiver, recv_private, ARRAY_LEN(recv_private), chan);
+    new_vm(&sender, send_shared, ARRAY_LEN(send_shared), chan);
+    fprintf(stderr, "Expecting a deadlock:\n");
+    LopsinErr err = lopsinvm_start(&receiver);
+    if (err != ERR_DEADLOCK) {
+        fprintf(stderr, "FAIL: Waiting on a channel of its own returned %s, expected %s\n",
+                ERR_AS_CSTR(err), ERR_AS_CSTR(ERR_DEADLOCK));
+        failed = 1;
+    }
+    lopsinvm_free(&receiver);
+
+    new_vm(&receiver, recv_shared, ARRAY_LEN(recv_shared), chan);
+    pthread_t thread;
+    pthread_create(&thread, NULL, &start_vm, &receiver);
+    lopsinvm_start(&sender);
+    pthread_join(thread, NULL);
+    if (receiver.dsp != 1 || receiver.dstack[0].as_i64 != WAKE_TEST_VALUE) {
+        fprintf(stderr, "FAIL: Receiver wasn't woken up with the value sent\n");
+        failed = 1;
+    }
+    lopsinvm_free(&receiver);
+
+    new_vm(&receiver, recv_private, ARRAY_LEN(recv_private), chan);
+    LopsinSched *sched = lopsin_sched_new(1, LOPSIN_SCHED_DEFAULT_MAX_PENDING, 64);
+    err = ERR_OK;
+    lopsin_sched_submit(sched, &receiver, &sched_done, &err);
+    lopsin_sched_free(sched);
+    if (err != ERR_DEADLOCK) {
+        fprintf(stderr, "FAIL: Waiting on a channel of its own on the scheduler returned %s, expected %s\n",
+                ERR_AS_CSTR(err), ERR_AS_CSTR(ERR_DEADLOCK));
+        failed = 1;
+    }
+    lopsinvm_free(&receiver);
+
+    lopsinvm_free(&sender);
+    lopsin_chan_release(chan);
+
+    if (failed) return 1;
+    printf("OK: Deadlocks found, and receiver woken up\n");
+    return 0;
+}